@@ -0,0 +1,88 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+
+namespace rtiw
+{
+// Axis-aligned bounding box. A default constructed box is empty (inverted), so expanding it by
+// anything yields that thing's bounds.
+class AABB
+{
+  public:
+    AABB() : m_Min(INF), m_Max(-INF) {}
+    AABB(const point3& min, const point3& max) : m_Min(min), m_Max(max) {}
+
+    point3 Min() const { return m_Min; }
+    point3 Max() const { return m_Max; }
+
+    bool IsEmpty() const
+    {
+        return m_Min.x() > m_Max.x() || m_Min.y() > m_Max.y() || m_Min.z() > m_Max.z();
+    }
+
+    point3 Centroid() const { return 0.5f * (m_Min + m_Max); }
+    vec3 Extent() const { return m_Max - m_Min; }
+
+    float SurfaceArea() const
+    {
+        if (IsEmpty())
+            return 0.f;
+        vec3 d = Extent();
+        return 2.f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    int LongestAxis() const
+    {
+        vec3 d = Extent();
+        if (d.x() > d.y() && d.x() > d.z())
+            return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
+    void Expand(const point3& p)
+    {
+        m_Min = point3(std::min(m_Min.x(), p.x()), std::min(m_Min.y(), p.y()),
+                       std::min(m_Min.z(), p.z()));
+        m_Max = point3(std::max(m_Max.x(), p.x()), std::max(m_Max.y(), p.y()),
+                       std::max(m_Max.z(), p.z()));
+    }
+
+    void Expand(const AABB& box)
+    {
+        m_Min = point3(std::min(m_Min.x(), box.m_Min.x()), std::min(m_Min.y(), box.m_Min.y()),
+                       std::min(m_Min.z(), box.m_Min.z()));
+        m_Max = point3(std::max(m_Max.x(), box.m_Max.x()), std::max(m_Max.y(), box.m_Max.y()),
+                       std::max(m_Max.z(), box.m_Max.z()));
+    }
+
+    // Slab test against the interval (tMin, tMax)
+    bool Hit(const ray& r, float tMin, float tMax) const
+    {
+        for (int a = 0; a < 3; a++) {
+            float invD = 1.f / r.Direction()[a];
+            float t0 = (m_Min[a] - r.Origin()[a]) * invD;
+            float t1 = (m_Max[a] - r.Origin()[a]) * invD;
+            if (invD < 0.f)
+                std::swap(t0, t1);
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+            if (tMax <= tMin)
+                return false;
+        }
+        return true;
+    }
+
+  private:
+    point3 m_Min;
+    point3 m_Max;
+};
+
+inline AABB SurroundingBox(const AABB& a, const AABB& b)
+{
+    AABB box = a;
+    box.Expand(b);
+    return box;
+}
+} // namespace rtiw
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace rtiw
+{
+// Standard error of a pixel's 8-bit output value, in levels, estimated from the sum and sum of
+// squares of its n samples. The output is sqrt(mean), whose error is about
+// error(mean) / (2 sqrt(mean)); the worst channel counts.
+inline float PixelErrorLevels(const color& sum, const color& sumSquares, uint32_t n)
+{
+    if (n < 2)
+        return INF;
+
+    float worst = 0.f;
+    for (int c = 0; c < 3; c++) {
+        float mean = sum[c] / n;
+        float variance = std::max(0.f, (sumSquares[c] - sum[c] * mean) / (n - 1));
+        float meanError = sqrtf(variance / n);
+        worst = std::max(worst, meanError / (2.f * sqrtf(std::max(mean, 1e-4f))));
+    }
+    return 255.f * worst;
+}
+
+// Adds one batch of samples to every active pixel of the tile
+template <typename Scene>
+void RenderTileBatch(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                     uint32_t batch, const Tile& tile, const std::vector<uint8_t>& active,
+                     Framebuffer& fb, std::vector<color>& sumSquares, RenderStats& stats)
+{
+    // Sample indices advance in whole batches, so every batch is one complete (shuffled) block
+    // of the sampler's sequence
+    std::unique_ptr<Sampler> sampler = MakeSampler(settings.Sampling, (int)batch, settings.Seed);
+    ActiveSampler() = sampler.get();
+
+    for (int y = tile.Y0; y < tile.Y1; y++) {
+        for (int i = tile.X0; i < tile.X1; i++) {
+            size_t p = (size_t)y * settings.ImageWidth + i;
+            if (!active[p])
+                continue;
+            uint32_t& count = fb.SampleCount(i, y);
+            color batchSum(0);
+            SamplePixel(world, cam, settings, *sampler, i, y, count, batch, batchSum, stats.Rays,
+                        &sumSquares[p], fb.HasFeatures() ? &fb.Features(i, y) : nullptr);
+            fb.At(i, y) += batchSum;
+            count += batch;
+            stats.Samples += batch;
+        }
+    }
+
+    ActiveSampler() = nullptr;
+}
+
+// Renders the frame with adaptive sampling. Every pixel first gets AdaptiveMinSamples samples,
+// or SamplesPerPixel if that is fewer (but at least 2, for an error estimate). Then, pass after
+// pass, the pixels whose estimated error is still above the threshold get another batch, until
+// all of them have converged, hit AdaptiveMaxSamples or the total budget of SamplesPerPixel per
+// pixel is spent. When the budget cannot cover every unconverged pixel the
+// noisiest ones go first, so the samples saved on smooth regions end up in the noisy ones. All
+// decisions are made between passes, so the image still only depends on the seed.
+// onPassDone (optional) is called with the pass number and the pixels left for the next pass.
+template <typename Scene>
+RenderStats RenderAdaptive(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                           ThreadPool& pool, Framebuffer& fb,
+                           const std::function<void(int, int)>& onPassDone = nullptr)
+{
+    const int width = settings.ImageWidth;
+    const int height = settings.ImageHeight;
+    const size_t pixelCount = (size_t)width * height;
+    // The first pass samples every pixel, so it must fit the budget; later passes only sample
+    // as many pixels as the remaining budget affords
+    const uint32_t batch =
+        (uint32_t)std::max(2, std::min(settings.AdaptiveMinSamples, settings.SamplesPerPixel));
+    uint32_t maxSamples = settings.AdaptiveMaxSamples > 0 ? (uint32_t)settings.AdaptiveMaxSamples
+                                                          : 4 * (uint32_t)settings.SamplesPerPixel;
+    maxSamples = std::max(batch, maxSamples / batch * batch);
+    const uint64_t budget = (uint64_t)settings.SamplesPerPixel * pixelCount;
+
+    fb.Resize(width, height);
+#if RTIW_STATS
+    RenderProfile::Get().Begin(settings);
+#endif
+    std::vector<color> sumSquares(pixelCount, color(0.f));
+    std::vector<float> errors(pixelCount);
+    std::vector<uint8_t> active(pixelCount, 1);
+    std::vector<Tile> tiles = MakeTiles(width, height, settings.TileSize);
+
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> rays{0};
+    std::vector<std::pair<float, uint32_t>> candidates;
+    for (int pass = 0;; pass++) {
+        pool.ParallelFor((int)tiles.size(), [&](int t, int) {
+#if RTIW_STATS
+            ProfileClock::time_point tileStart = ProfileClock::now();
+#endif
+            RenderStats tileStats;
+            RenderTileBatch(world, cam, settings, batch, tiles[t], active, fb, sumSquares,
+                            tileStats);
+#if RTIW_STATS
+            RenderProfile::Get().AddTileTime(tiles[t], ElapsedMS(tileStart));
+#endif
+            samples += tileStats.Samples;
+            rays += tileStats.Rays;
+        });
+
+        // A pixel keeps sampling while it or one of its neighbours is above the threshold. Error
+        // estimates from few samples are noisy themselves; looking at the neighbourhood keeps
+        // isolated pixels of a noisy region from stopping early on a lucky streak.
+        for (size_t p = 0; p < pixelCount; p++) {
+            int x = (int)(p % width);
+            int y = (int)(p / width);
+            errors[p] = PixelErrorLevels(fb.At(x, y), sumSquares[p], fb.SampleCount(x, y));
+        }
+        candidates.clear();
+        for (size_t p = 0; p < pixelCount; p++) {
+            int x = (int)(p % width);
+            int y = (int)(p / width);
+            active[p] = 0;
+            if (fb.SampleCount(x, y) >= maxSamples)
+                continue;
+            float error = 0.f;
+            for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1); ny++)
+                for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); nx++)
+                    error = std::max(error, errors[(size_t)ny * width + nx]);
+            if (error > settings.AdaptiveThreshold)
+                candidates.push_back({error, (uint32_t)p});
+        }
+
+        uint64_t spent = samples;
+        size_t affordable = spent < budget ? (size_t)((budget - spent) / batch) : 0;
+        if (candidates.size() > affordable) {
+            // Ties are broken by pixel index to keep the selection deterministic
+            auto noisier = [](const auto& a, const auto& b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            };
+            std::nth_element(candidates.begin(), candidates.begin() + affordable,
+                             candidates.end(), noisier);
+            candidates.resize(affordable);
+        }
+        for (const auto& c : candidates)
+            active[c.second] = 1;
+
+        if (onPassDone)
+            onPassDone(pass, (int)candidates.size());
+        if (candidates.empty())
+            break;
+    }
+
+    RenderStats stats;
+    stats.Samples = samples;
+    stats.Rays = rays;
+    return stats;
+}
+} // namespace rtiw
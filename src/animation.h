@@ -0,0 +1,268 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "image_writer.h"
+#include "scene_file.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Animation files key the camera and the objects of a scene at frames; '#' starts a comment:
+//
+//   camera <frame> <from x y z> <at x y z> <up x y z> <vfov degrees>
+//   move <object> <frame> <dx dy dz> [<spin degrees>]
+//
+// Frames are whole numbers from 0 to MAX_ANIMATION_FRAME. Values between keys are interpolated
+// linearly and hold before the first and after the last key. <object> numbers the spheres and
+// instances at the top level of the scene in the order they were added. Moves offset an object
+// from where the scene put it; spins turn instances about their own y axis.
+
+namespace rtiw
+{
+// Highest frame number an animation file may key
+const int MAX_ANIMATION_FRAME = 1000000;
+
+inline float Lerp(float a, float b, float t) { return a + t * (b - a); }
+
+inline vec3 Lerp(const vec3& a, const vec3& b, float t) { return a + t * (b - a); }
+
+inline CameraSetup Lerp(const CameraSetup& a, const CameraSetup& b, float t)
+{
+    CameraSetup setup;
+    setup.Set = true;
+    setup.LookFrom = Lerp(a.LookFrom, b.LookFrom, t);
+    setup.LookAt = Lerp(a.LookAt, b.LookAt, t);
+    setup.Up = Lerp(a.Up, b.Up, t);
+    setup.Vfov = Lerp(a.Vfov, b.Vfov, t);
+    return setup;
+}
+
+// Values of type T keyed at frames
+template <typename T>
+class Track
+{
+  public:
+    // Replaces the key at frame if there is one
+    void AddKey(int frame, const T& value);
+
+    bool Empty() const { return m_Keys.empty(); }
+    int LastFrame() const { return m_Keys.empty() ? 0 : m_Keys.back().Frame; }
+
+    // The track must not be empty
+    T At(int frame) const;
+
+  private:
+    struct Key
+    {
+        int Frame;
+        T Value;
+    };
+
+    // Sorted by frame
+    std::vector<Key> m_Keys;
+};
+
+template <typename T>
+void Track<T>::AddKey(int frame, const T& value)
+{
+    auto pos = std::lower_bound(m_Keys.begin(), m_Keys.end(), frame,
+                                [](const Key& key, int f) { return key.Frame < f; });
+    if (pos != m_Keys.end() && pos->Frame == frame)
+        pos->Value = value;
+    else
+        m_Keys.insert(pos, Key{frame, value});
+}
+
+template <typename T>
+T Track<T>::At(int frame) const
+{
+    auto next = std::upper_bound(m_Keys.begin(), m_Keys.end(), frame,
+                                 [](int f, const Key& key) { return f < key.Frame; });
+    if (next == m_Keys.begin())
+        return next->Value;
+    auto prev = next - 1;
+    if (next == m_Keys.end() || prev->Frame == frame)
+        return prev->Value;
+    float t = (float)(frame - prev->Frame) / (float)(next->Frame - prev->Frame);
+    return Lerp(prev->Value, next->Value, t);
+}
+
+// Keyframes of one top-level object of a scene
+struct ObjectAnimation
+{
+    uint32_t Object = 0;
+    Track<vec3> Offset;
+    Track<float> Spin;
+};
+
+struct Animation
+{
+    Track<CameraSetup> Camera;
+    std::vector<ObjectAnimation> Objects;
+
+    // Frames up to and including the last key
+    int FrameCount() const
+    {
+        int last = Camera.LastFrame();
+        for (const ObjectAnimation& object : Objects)
+            last = std::max({last, object.Offset.LastFrame(), object.Spin.LastFrame()});
+        return last + 1;
+    }
+
+    // The camera of frame, or still if the animation does not move the camera
+    CameraSetup CameraAt(int frame, const CameraSetup& still) const
+    {
+        return Camera.Empty() ? still : Camera.At(frame);
+    }
+};
+
+// Reads an animation file into animation. Returns false and describes the problem (with its line
+// number) in error if the file cannot be read or parsed.
+bool LoadAnimation(const std::string& path, Animation& animation, std::string& error)
+{
+    animation = Animation();
+    std::string keyword;
+    // Frame and object numbers are read as floats, which hold every integer up to 2^24 exactly
+    auto wholeNumber = [](float v, float max) { return v >= 0.f && v <= max && v == floorf(v); };
+    const float MAX_FRAME = (float)MAX_ANIMATION_FRAME;
+    const float MAX_OBJECT = 16777216.f;
+    return detail::ParseSceneLines(path, error, [&](detail::SceneLineReader& line,
+                                                    std::string& message) {
+        line.Word(keyword);
+        float frame, object;
+        bool ok = true;
+        if (keyword == "camera") {
+            CameraSetup cam;
+            cam.Set = true;
+            ok = line.Number(frame) && line.Vector(cam.LookFrom) && line.Vector(cam.LookAt) &&
+                 line.Vector(cam.Up) && line.Number(cam.Vfov) && wholeNumber(frame, MAX_FRAME);
+            if (ok)
+                animation.Camera.AddKey((int)frame, cam);
+        } else if (keyword == "move") {
+            vec3 offset;
+            float spin = 0.f;
+            ok = line.Number(object) && line.Number(frame) && line.Vector(offset) &&
+                 (line.AtEnd() || line.Number(spin)) && wholeNumber(object, MAX_OBJECT) &&
+                 wholeNumber(frame, MAX_FRAME);
+            if (ok) {
+                auto found = std::find_if(
+                    animation.Objects.begin(), animation.Objects.end(),
+                    [&](const ObjectAnimation& o) { return o.Object == (uint32_t)object; });
+                if (found == animation.Objects.end()) {
+                    animation.Objects.emplace_back();
+                    found = animation.Objects.end() - 1;
+                    found->Object = (uint32_t)object;
+                }
+                found->Offset.AddKey((int)frame, offset);
+                found->Spin.AddKey((int)frame, spin);
+            }
+        } else {
+            message = "unknown keyword '" + keyword + "'";
+            return false;
+        }
+        if (!ok || !line.AtEnd()) {
+            message = "malformed '" + keyword + "' line";
+            return false;
+        }
+        return true;
+    });
+}
+
+// One turn of the camera around its look-at point, about its up vector, in frames steps. camera
+// must be placed (see CameraSetup::Placed()).
+Animation Turntable(const CameraSetup& camera, int frames)
+{
+    Animation animation;
+    vec3 arm = camera.LookFrom - camera.LookAt;
+    for (int frame = 0; frame < frames; frame++) {
+        // A key per frame, since interpolating between keys would cut through the circle
+        Transform turn = Transform::Rotate(camera.Up, 360.f * frame / frames);
+        CameraSetup setup = camera;
+        setup.LookFrom = camera.LookAt + turn.ApplyVector(arm);
+        animation.Camera.AddKey(frame, setup);
+    }
+    return animation;
+}
+
+// Moves the top-level objects of a compiled scene to where an animation has them at a frame. The
+// objects' original placement is kept, so frames can be visited in any order.
+class SceneAnimator
+{
+  public:
+    // Remembers where scene has the objects that animation moves. Returns false and describes the
+    // problem in error if the scene cannot move them.
+    bool Start(const CompiledScene& scene, const Animation& animation, std::string& error);
+
+    bool MovesObjects() const { return !m_Objects.empty(); }
+
+    // Places the objects for frame. The scene's BVH needs a Refit() afterwards.
+    void MoveObjects(CompiledScene& scene, int frame) const;
+
+  private:
+    struct MovingObject
+    {
+        const ObjectAnimation* Keys;
+        CompiledPrimitive Original;
+        // Object-to-world transform of instances
+        Transform OriginalPlacement;
+    };
+
+    std::vector<MovingObject> m_Objects;
+};
+
+bool SceneAnimator::Start(const CompiledScene& scene, const Animation& animation,
+                          std::string& error)
+{
+    m_Objects.clear();
+    if (animation.Objects.empty())
+        return true;
+    if (!scene.CanMoveObjects()) {
+        error = "objects of scene caches cannot be animated, load the scene itself";
+        return false;
+    }
+    for (const ObjectAnimation& keys : animation.Objects) {
+        if (keys.Object >= scene.ObjectCount()) {
+            error = "the animation moves object " + std::to_string(keys.Object) +
+                    ", but the scene has " + std::to_string(scene.ObjectCount());
+            return false;
+        }
+        MovingObject object{&keys, scene.ObjectAt(keys.Object), Transform()};
+        if (const InstanceRecord* instance = std::get_if<InstanceRecord>(&object.Original))
+            object.OriginalPlacement = scene.InstanceToWorld(instance->TransformId);
+        m_Objects.push_back(object);
+    }
+    return true;
+}
+
+void SceneAnimator::MoveObjects(CompiledScene& scene, int frame) const
+{
+    for (const MovingObject& object : m_Objects) {
+        vec3 offset = object.Keys->Offset.At(frame);
+        if (const InstanceRecord* instance = std::get_if<InstanceRecord>(&object.Original)) {
+            Transform spin = Transform::Rotate(vec3(0.f, 1.f, 0.f), object.Keys->Spin.At(frame));
+            scene.SetInstanceTransform(instance->TransformId, Transform::Translate(offset) *
+                                                                  object.OriginalPlacement *
+                                                                  spin);
+        } else {
+            SphereRecord sphere = std::get<SphereRecord>(object.Original);
+            for (int a = 0; a < 3; a++)
+                sphere.Center[a] += offset[a];
+            scene.SetObject(object.Keys->Object, sphere);
+        }
+    }
+}
+
+// The file of one frame of a sequence: "out.ppm" becomes "out_0007.ppm"
+std::string FramePath(const std::string& path, int frame)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "_%04d", frame);
+    return PathWithSuffix(path, number);
+}
+} // namespace rtiw
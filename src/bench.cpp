@@ -0,0 +1,448 @@
+// Benchmark suite: micro benchmarks of the hot primitives and end-to-end renders of fixed scenes.
+// Results are written as JSON and can be compared against a baseline written by an earlier run;
+// any result slower than the baseline by more than the threshold, widened for benchmarks whose
+// repeats vary, fails the run.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "thread_pool.h"
+
+namespace
+{
+struct BenchOptions
+{
+    int NumThreads = 1;
+    int Repeat = 5;
+    uint32_t Seed = 0;
+    // Only benchmarks whose name contains Filter run
+    std::string Filter;
+    std::string OutputFile;
+    std::string BaselineFile;
+    // Allowed slowdown against the baseline, in percent. Noisy benchmarks get up to three times
+    // as much.
+    double Threshold = 5.0;
+};
+
+// One benchmark result. Score is the headline number, higher is better: Mops/s for micro
+// benchmarks, Mrays/s for scenes. It is what the baseline comparison looks at.
+struct BenchResult
+{
+    std::string Name;
+    double Score = 0.0;
+    // Median absolute deviation of the repeats from their median, in percent of it
+    double Mad = 0.0;
+    // Remaining metrics as (key, value), written to the JSON as they are
+    std::vector<std::pair<std::string, double>> Metrics;
+};
+
+// High-water mark of the resident set of the whole process, in MiB
+double PeakRSSMiB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+    return 0.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // Linux reports kilobytes
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+// Keeps the compiler from dropping computations whose result is otherwise unused
+volatile float g_Sink;
+
+struct Timing
+{
+    // Median of the runs, in seconds
+    double Seconds = 0.0;
+    // Median absolute deviation from Seconds, in percent of it. Unlike the range of the runs, one
+    // outlier barely moves it.
+    double Mad = 0.0;
+};
+
+double Median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Median time and its deviation over repeat runs of fn
+Timing TimeRuns(int repeat, const std::function<void()>& fn)
+{
+    std::vector<double> times;
+    for (int r = 0; r < std::max(1, repeat); r++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        fn();
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double>(end - start).count());
+    }
+
+    Timing timing;
+    timing.Seconds = Median(times);
+    std::vector<double> deviations;
+    for (double t : times)
+        deviations.push_back(fabs(t - timing.Seconds));
+    timing.Mad = Median(deviations) / timing.Seconds * 100.0;
+    return timing;
+}
+
+BenchResult MicroResult(const std::string& name, const Timing& timing, double ops)
+{
+    BenchResult result;
+    result.Name = name;
+    result.Score = ops / timing.Seconds / 1e6;
+    result.Mad = timing.Mad;
+    result.Metrics = {{"ns_per_op", timing.Seconds / ops * 1e9}, {"mops_per_sec", result.Score}};
+    return result;
+}
+
+std::vector<rtiw::ray> CameraRays(const rtiw::Camera& cam, int count)
+{
+    std::vector<rtiw::ray> rays;
+    rays.reserve(count);
+    rtiw::SeedRand(0, 0, 0);
+    for (int i = 0; i < count; i++)
+        rays.push_back(cam.GetRay(RandFloat(), RandFloat()));
+    return rays;
+}
+
+void RunMicroBenchmarks(const BenchOptions& opts, std::vector<BenchResult>& results,
+                        const std::function<bool(const std::string&)>& selected)
+{
+    const int ITERATIONS = 4000000;
+    rtiw::Camera cam;
+    std::vector<rtiw::ray> rays = CameraRays(cam, 4096);
+
+    if (selected("micro/sphere_hit")) {
+        auto mat = std::make_shared<rtiw::Lambertian>(rtiw::color(0.5f));
+        rtiw::Sphere sphere(rtiw::point3(0.f, 0.f, -1.f), 0.5f, mat);
+        Timing timing = TimeRuns(opts.Repeat, [&] {
+            rtiw::HitRecord rec;
+            float sum = 0.f;
+            for (int i = 0; i < ITERATIONS; i++)
+                if (sphere.Hit(rays[i & 4095], 0.0001f, INF, rec))
+                    sum += rec.t;
+            g_Sink = sum;
+        });
+        results.push_back(MicroResult("micro/sphere_hit", timing, ITERATIONS));
+    }
+
+    if (selected("micro/hittable_list_hit")) {
+        rtiw::HittableList world;
+        rtiw::CameraSetup unused;
+        rtiw::BuildScene("default", 0, opts.Seed, world, unused);
+        Timing timing = TimeRuns(opts.Repeat, [&] {
+            rtiw::HitRecord rec;
+            float sum = 0.f;
+            for (int i = 0; i < ITERATIONS; i++)
+                if (world.Hit(rays[i & 4095], 0.0001f, INF, rec))
+                    sum += rec.t;
+            g_Sink = sum;
+        });
+        results.push_back(MicroResult("micro/hittable_list_hit", timing, ITERATIONS));
+    }
+
+    if (selected("micro/vec3_ops")) {
+        std::vector<rtiw::vec3> a, b;
+        rtiw::SeedRand(1, 0, 0);
+        for (int i = 0; i < 4096; i++) {
+            a.push_back(rtiw::vec3::Random(-1.f, 1.f));
+            b.push_back(rtiw::vec3::Random(-1.f, 1.f));
+        }
+        // One op is a cross product, a normalization, a multiply-add and a dot product
+        Timing timing = TimeRuns(opts.Repeat, [&] {
+            float sum = 0.f;
+            for (int i = 0; i < ITERATIONS; i++) {
+                const rtiw::vec3& u = a[i & 4095];
+                const rtiw::vec3& v = b[(i * 7) & 4095];
+                sum += Dot(Normalize(Cross(u, v)) * 0.5f + u, v);
+            }
+            g_Sink = sum;
+        });
+        results.push_back(MicroResult("micro/vec3_ops", timing, ITERATIONS));
+    }
+
+    if (selected("micro/random_in_unit_sphere")) {
+        Timing timing = TimeRuns(opts.Repeat, [&] {
+            rtiw::SeedRand(opts.Seed, 0, 0);
+            rtiw::vec3 sum(0.f);
+            for (int i = 0; i < ITERATIONS; i++)
+                sum += rtiw::RandomInUnitSphere();
+            g_Sink = sum.x() + sum.y() + sum.z();
+        });
+        results.push_back(MicroResult("micro/random_in_unit_sphere", timing, ITERATIONS));
+    }
+}
+
+struct SceneBench
+{
+    std::string Name;
+    std::string Scene;
+    int SphereCount;
+    int SamplesPerPixel;
+};
+
+// Returns false if a scene fails to compile
+bool RunSceneBenchmarks(const BenchOptions& opts, std::vector<BenchResult>& results,
+                        const std::function<bool(const std::string&)>& selected)
+{
+    // Ordered by size, so the process-wide peak RSS read after each one belongs to it
+    const SceneBench SCENES[] = {
+        {"scene/default", "default", 0, 32},
+        {"scene/final", "final", 0, 16},
+        {"scene/instances_1b", "instances", 1000000000, 1},
+        {"scene/spheres_10k", "spheres", 10000, 8},
+        {"scene/spheres_100k", "spheres", 100000, 8},
+        {"scene/spheres_1m", "spheres", 1000000, 8},
+    };
+
+    rtiw::ThreadPool pool(opts.NumThreads);
+    for (const SceneBench& bench : SCENES) {
+        if (!selected(bench.Name))
+            continue;
+
+        rtiw::HittableList world;
+        rtiw::CameraSetup cameraSetup;
+        rtiw::BuildScene(bench.Scene, bench.SphereCount, opts.Seed, world, cameraSetup);
+        rtiw::Camera cam = cameraSetup.MakeCamera(16.f / 9.f);
+
+        rtiw::CompiledScene compiled;
+        std::string error;
+        bool compiledOk = false;
+        Timing build = TimeRuns(1, [&] { compiledOk = compiled.Compile(world, error); });
+        if (!compiledOk) {
+            std::cerr << bench.Name << ": " << error << "\n";
+            return false;
+        }
+        // The render only needs the compiled form
+        world.Clear();
+
+        rtiw::RenderSettings settings;
+        settings.SamplesPerPixel = bench.SamplesPerPixel;
+        settings.Seed = opts.Seed;
+
+        rtiw::Framebuffer fb;
+        rtiw::RenderStats stats;
+        Timing timing = TimeRuns(opts.Repeat, [&] {
+            stats = rtiw::Render(compiled, cam, settings, pool, fb);
+        });
+
+        BenchResult result;
+        result.Name = bench.Name;
+        result.Score = stats.Rays / timing.Seconds / 1e6;
+        result.Mad = timing.Mad;
+        result.Metrics = {
+            {"mrays_per_sec", result.Score},
+            {"ns_per_ray", timing.Seconds / stats.Rays * 1e9},
+            {"msamples_per_sec", stats.Samples / timing.Seconds / 1e6},
+            {"render_ms", timing.Seconds * 1e3},
+            {"build_ms", build.Seconds * 1e3},
+            {"scene_mib", compiled.MemoryBytes() / (1024.0 * 1024.0)},
+            {"peak_rss_mib", PeakRSSMiB()},
+        };
+        results.push_back(result);
+    }
+    return true;
+}
+
+std::string ToJSON(const BenchOptions& opts, const std::vector<BenchResult>& results)
+{
+    std::ostringstream out;
+    out << std::setprecision(6);
+    out << "{\n  \"threads\": " << opts.NumThreads << ",\n  \"seed\": " << opts.Seed
+        << ",\n  \"vec3\": \"" << rtiw::Vec3BackendName() << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        // One result per line; ReadBaseline() relies on it
+        out << "    {\"name\": \"" << r.Name << "\", \"score\": " << r.Score
+            << ", \"mad\": " << r.Mad;
+        for (const auto& metric : r.Metrics)
+            out << ", \"" << metric.first << "\": " << metric.second;
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+// Reads the name, score and deviation of every result of a file written by ToJSON()
+bool ReadBaseline(const std::string& filename, std::vector<BenchResult>& baseline)
+{
+    std::ifstream in(filename);
+    if (!in)
+        return false;
+
+    const std::string NAME_KEY = "\"name\": \"";
+    const std::string SCORE_KEY = "\"score\": ";
+    const std::string MAD_KEY = "\"mad\": ";
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find(NAME_KEY);
+        size_t score = line.find(SCORE_KEY);
+        if (name == std::string::npos || score == std::string::npos)
+            continue;
+        name += NAME_KEY.size();
+        BenchResult result;
+        result.Name = line.substr(name, line.find('"', name) - name);
+        result.Score = atof(line.c_str() + score + SCORE_KEY.size());
+        // Baselines written before the deviation was recorded have none
+        size_t mad = line.find(MAD_KEY);
+        if (mad != std::string::npos)
+            result.Mad = atof(line.c_str() + mad + MAD_KEY.size());
+        baseline.push_back(result);
+    }
+    return true;
+}
+
+// Prints the change of every result against the baseline. A result regressed if it is slower by
+// more than the threshold, or by more than three times the deviation of both runs if that is
+// larger, so noisy benchmarks do not fail on their own variance. The widening stops at
+// MAX_WIDENING times the threshold, so noise cannot hide a large slowdown. Returns the number of
+// regressions.
+int CompareWithBaseline(const std::vector<BenchResult>& results,
+                        const std::vector<BenchResult>& baseline, double threshold)
+{
+    int regressions = 0;
+    const double MAX_WIDENING = 3.0;
+    std::cout << "\nAgainst the baseline (threshold -" << threshold << "%, up to -"
+              << MAX_WIDENING * threshold << "% for noisy results):\n";
+    for (const BenchResult& r : results) {
+        auto base = std::find_if(baseline.begin(), baseline.end(),
+                                 [&](const BenchResult& b) { return b.Name == r.Name; });
+        std::cout << "  " << std::left << std::setw(30) << r.Name << std::right;
+        if (base == baseline.end() || base->Score <= 0.0) {
+            std::cout << "   (no baseline)\n";
+            continue;
+        }
+        double change = (r.Score - base->Score) / base->Score * 100.0;
+        double allowed = std::min(std::max(threshold, 3.0 * (r.Mad + base->Mad)),
+                                  MAX_WIDENING * threshold);
+        bool regressed = change < -allowed;
+        regressions += regressed;
+        std::cout << std::showpos << std::fixed << std::setprecision(1) << std::setw(8) << change
+                  << "%" << std::noshowpos << "  (allowed -" << allowed << "%)"
+                  << (regressed ? "  REGRESSION" : "") << "\n";
+    }
+    return regressions;
+}
+
+void PrintUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --threads <n>       Render threads of the scene benchmarks (default: 1)\n"
+              << "  --repeat <n>        Runs per benchmark, the median counts (default: 5)\n"
+              << "  --seed <n>          Scene and sampling seed (default: 0)\n"
+              << "  --filter <text>     Only run benchmarks whose name contains <text>\n"
+              << "  --output <file>     Write the results as JSON\n"
+              << "  --baseline <file>   Compare with the JSON of an earlier run\n"
+              << "  --threshold <pct>   Least slowdown counted as a regression (default: 5)\n";
+}
+
+bool ParseBenchOptions(int argc, char** argv, BenchOptions& opts)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(arg, "--threads") && hasValue) {
+            opts.NumThreads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--repeat") && hasValue) {
+            opts.Repeat = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--seed") && hasValue) {
+            opts.Seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(arg, "--filter") && hasValue) {
+            opts.Filter = argv[++i];
+        } else if (!strcmp(arg, "--output") && hasValue) {
+            opts.OutputFile = argv[++i];
+        } else if (!strcmp(arg, "--baseline") && hasValue) {
+            opts.BaselineFile = argv[++i];
+        } else if (!strcmp(arg, "--threshold") && hasValue) {
+            opts.Threshold = atof(argv[++i]);
+        } else {
+            std::cerr << "Unknown or incomplete option '" << arg << "'\n";
+            PrintUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    BenchOptions opts;
+    if (!ParseBenchOptions(argc, argv, opts))
+        return 2;
+
+    std::vector<BenchResult> baseline;
+    if (!opts.BaselineFile.empty() && !ReadBaseline(opts.BaselineFile, baseline)) {
+        std::cerr << "Cannot read baseline " << opts.BaselineFile << "\n";
+        return 2;
+    }
+
+    auto selected = [&](const std::string& name) {
+        return opts.Filter.empty() || name.find(opts.Filter) != std::string::npos;
+    };
+
+    std::vector<BenchResult> results;
+    RunMicroBenchmarks(opts, results, selected);
+    if (!RunSceneBenchmarks(opts, results, selected))
+        return 2;
+
+    std::string json = ToJSON(opts, results);
+    std::cout << json;
+    if (!opts.OutputFile.empty()) {
+        std::ofstream out(opts.OutputFile);
+        out << json;
+        if (!out) {
+            std::cerr << "Cannot write " << opts.OutputFile << "\n";
+            return 2;
+        }
+    }
+
+    if (!opts.BaselineFile.empty()) {
+        int regressions = CompareWithBaseline(results, baseline, opts.Threshold);
+        if (regressions > 0) {
+            std::cout << regressions << " benchmark(s) regressed\n";
+            return 1;
+        }
+    }
+    return 0;
+}
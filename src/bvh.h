@@ -0,0 +1,388 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+
+#include <cassert>
+#include <future>
+#include <memory>
+#include <vector>
+
+namespace rtiw
+{
+// Flattened BVH node. Nodes are stored depth first, so an interior node's first child is the next
+// node in the array. Instead of child pointers every node stores where to continue once its box is
+// missed (or its subtree is done), which lets traversal run as a single loop without a stack.
+// Two nodes fit in a 64-byte cache line.
+struct alignas(32) BVHNode
+{
+    float BoundsMin[3];
+    float BoundsMax[3];
+    uint32_t MissIndex;
+    // Leaves: (first primitive << 4) | primitive count. Interior nodes: 0
+    uint32_t PrimInfo;
+
+    bool IsLeaf() const { return PrimInfo != 0; }
+    uint32_t FirstPrim() const { return PrimInfo >> 4; }
+    uint32_t PrimCount() const { return PrimInfo & 0xf; }
+
+    void SetBounds(const AABB& box)
+    {
+        for (int a = 0; a < 3; a++) {
+            BoundsMin[a] = box.Min()[a];
+            BoundsMax[a] = box.Max()[a];
+        }
+    }
+
+    AABB Bounds() const
+    {
+        return AABB(point3(BoundsMin[0], BoundsMin[1], BoundsMin[2]),
+                    point3(BoundsMax[0], BoundsMax[1], BoundsMax[2]));
+    }
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should stay half a cache line");
+
+const int BVH_MAX_LEAF_PRIMS = 15;
+const uint32_t BVH_MAX_PRIMS = 1u << 28;
+
+struct BVHBuildResult
+{
+    std::vector<BVHNode> Nodes;
+    // Primitive order referenced by the leaves
+    std::vector<uint32_t> PrimIndices;
+};
+
+namespace detail
+{
+struct BVHBuildNode
+{
+    AABB Bounds;
+    std::unique_ptr<BVHBuildNode> Children[2];
+    uint32_t First = 0;
+    uint32_t Count = 0;
+    // Number of nodes in this subtree, needed to place the second child when flattening
+    uint32_t NodeCount = 1;
+};
+
+struct BVHBuilder
+{
+    static const int NUM_BINS = 16;
+    // Subtrees larger than this are built on their own thread
+    static const uint32_t PARALLEL_THRESHOLD = 16 * 1024;
+    static const int MAX_PARALLEL_DEPTH = 6;
+
+    const std::vector<AABB>& PrimBounds;
+    std::vector<point3> Centroids;
+    std::vector<uint32_t>& Indices;
+    int MaxLeafSize;
+
+    std::unique_ptr<BVHBuildNode> Build(uint32_t first, uint32_t count, int depth)
+    {
+        auto node = std::make_unique<BVHBuildNode>();
+        AABB centroidBounds;
+        for (uint32_t i = first; i < first + count; i++) {
+            node->Bounds.Expand(PrimBounds[Indices[i]]);
+            centroidBounds.Expand(Centroids[Indices[i]]);
+        }
+
+        uint32_t mid;
+        if (!FindSplit(node->Bounds, centroidBounds, first, count, mid)) {
+            node->First = first;
+            node->Count = count;
+            return node;
+        }
+
+        uint32_t leftCount = mid - first;
+        uint32_t rightCount = count - leftCount;
+        if (depth < MAX_PARALLEL_DEPTH && leftCount > PARALLEL_THRESHOLD &&
+            rightCount > PARALLEL_THRESHOLD) {
+            auto left = std::async(std::launch::async,
+                                   [this, first, leftCount, depth] {
+                                       return Build(first, leftCount, depth + 1);
+                                   });
+            node->Children[1] = Build(mid, rightCount, depth + 1);
+            node->Children[0] = left.get();
+        } else {
+            node->Children[0] = Build(first, leftCount, depth + 1);
+            node->Children[1] = Build(mid, rightCount, depth + 1);
+        }
+        node->NodeCount = 1 + node->Children[0]->NodeCount + node->Children[1]->NodeCount;
+        return node;
+    }
+
+    // Picks the cheapest binned SAH split and partitions Indices around it. Returns false if the
+    // range should become a leaf.
+    bool FindSplit(const AABB& bounds, const AABB& centroidBounds, uint32_t first,
+                   uint32_t count, uint32_t& mid)
+    {
+        if (count <= 1)
+            return false;
+
+        int axis = centroidBounds.LongestAxis();
+        float cMin = centroidBounds.Min()[axis];
+        float cExtent = centroidBounds.Max()[axis] - cMin;
+        if (cExtent <= 0.f) {
+            // All centroids coincide, no spatial split is possible
+            if (count <= (uint32_t)BVH_MAX_LEAF_PRIMS)
+                return false;
+            mid = first + count / 2;
+            return true;
+        }
+
+        struct Bin
+        {
+            AABB Bounds;
+            uint32_t Count = 0;
+        };
+        Bin bins[NUM_BINS];
+        auto binOf = [&](uint32_t prim) {
+            int b = (int)(NUM_BINS * ((Centroids[prim][axis] - cMin) / cExtent));
+            return std::min(b, NUM_BINS - 1);
+        };
+        for (uint32_t i = first; i < first + count; i++) {
+            Bin& bin = bins[binOf(Indices[i])];
+            bin.Count++;
+            bin.Bounds.Expand(PrimBounds[Indices[i]]);
+        }
+
+        // Sweep from the right to get the cost of every split plane in one pass each way
+        float rightArea[NUM_BINS - 1];
+        uint32_t rightCount[NUM_BINS - 1];
+        AABB acc;
+        uint32_t accCount = 0;
+        for (int b = NUM_BINS - 1; b > 0; b--) {
+            acc.Expand(bins[b].Bounds);
+            accCount += bins[b].Count;
+            rightArea[b - 1] = acc.SurfaceArea();
+            rightCount[b - 1] = accCount;
+        }
+
+        int bestSplit = -1;
+        float bestCost = INF;
+        acc = AABB();
+        accCount = 0;
+        for (int b = 0; b < NUM_BINS - 1; b++) {
+            acc.Expand(bins[b].Bounds);
+            accCount += bins[b].Count;
+            float cost = acc.SurfaceArea() * accCount + rightArea[b] * rightCount[b];
+            if (accCount > 0 && rightCount[b] > 0 && cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        // Traversal step is taken to cost as much as one primitive test
+        float leafCost = (float)count;
+        float splitCost = 1.f + bestCost / bounds.SurfaceArea();
+        if (bestSplit < 0 || (count <= (uint32_t)MaxLeafSize && leafCost <= splitCost)) {
+            if (count <= (uint32_t)BVH_MAX_LEAF_PRIMS)
+                return false;
+            mid = first + count / 2;
+            std::nth_element(Indices.begin() + first, Indices.begin() + mid,
+                             Indices.begin() + first + count, [&](uint32_t a, uint32_t b) {
+                                 return Centroids[a][axis] < Centroids[b][axis];
+                             });
+            return true;
+        }
+
+        auto it = std::partition(Indices.begin() + first, Indices.begin() + first + count,
+                                 [&](uint32_t prim) { return binOf(prim) <= bestSplit; });
+        mid = (uint32_t)(it - Indices.begin());
+        return true;
+    }
+
+    uint32_t Flatten(const BVHBuildNode& node, uint32_t missIndex, std::vector<BVHNode>& nodes)
+    {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.emplace_back();
+        nodes[index].SetBounds(node.Bounds);
+        nodes[index].MissIndex = missIndex;
+
+        if (!node.Children[0]) {
+            nodes[index].PrimInfo = (node.First << 4) | node.Count;
+            return index;
+        }
+
+        nodes[index].PrimInfo = 0;
+        uint32_t rightIndex = index + 1 + node.Children[0]->NodeCount;
+        Flatten(*node.Children[0], rightIndex, nodes);
+        Flatten(*node.Children[1], missIndex, nodes);
+        return index;
+    }
+};
+} // namespace detail
+
+// Builds a BVH over the given primitive bounds with a binned surface area heuristic. Large
+// subtrees are built in parallel.
+inline BVHBuildResult BuildBVH(const std::vector<AABB>& primBounds, int maxLeafSize = 4)
+{
+    BVHBuildResult result;
+    uint32_t primCount = (uint32_t)primBounds.size();
+    assert(primCount < BVH_MAX_PRIMS);
+    if (primCount == 0)
+        return result;
+
+    result.PrimIndices.resize(primCount);
+    for (uint32_t i = 0; i < primCount; i++)
+        result.PrimIndices[i] = i;
+
+    detail::BVHBuilder builder{primBounds, {}, result.PrimIndices,
+                               std::min(maxLeafSize, BVH_MAX_LEAF_PRIMS)};
+    builder.Centroids.resize(primCount);
+    for (uint32_t i = 0; i < primCount; i++)
+        builder.Centroids[i] = primBounds[i].Centroid();
+
+    std::unique_ptr<detail::BVHBuildNode> root = builder.Build(0, primCount, 0);
+    result.Nodes.reserve(root->NodeCount);
+    builder.Flatten(*root, root->NodeCount, result.Nodes);
+    return result;
+}
+
+// Stackless traversal of a flattened BVH. hitLeaf(firstPrim, primCount, tMax) tests the
+// primitives of a leaf, shrinks tMax to the closest hit and returns whether anything was hit.
+template <typename LeafFn>
+bool TraverseBVH(const BVHNode* nodes, uint32_t nodeCount, const ray& r, float tMin, float tMax,
+                 LeafFn&& hitLeaf)
+{
+    point3 origin = r.Origin();
+    vec3 dir = r.Direction();
+    float org[3] = {origin.x(), origin.y(), origin.z()};
+    float invDir[3] = {1.f / dir.x(), 1.f / dir.y(), 1.f / dir.z()};
+
+    bool hitAnything = false;
+    uint32_t i = 0;
+    while (i < nodeCount) {
+        const BVHNode& node = nodes[i];
+        RTIW_STAT_ADD(NodeVisits, 1);
+
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; a++) {
+            float tNear = (node.BoundsMin[a] - org[a]) * invDir[a];
+            float tFar = (node.BoundsMax[a] - org[a]) * invDir[a];
+            if (tNear > tFar)
+                std::swap(tNear, tFar);
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+
+        if (t0 > t1) {
+            i = node.MissIndex;
+        } else if (node.IsLeaf()) {
+            if (hitLeaf(node.FirstPrim(), node.PrimCount(), tMax))
+                hitAnything = true;
+            i = node.MissIndex;
+        } else {
+            i++;
+        }
+    }
+    return hitAnything;
+}
+
+// Updates the bounds of a flattened BVH after its primitives moved, keeping its structure.
+// primBounds(prim) returns the current bounds of a primitive. Children are stored after their
+// parent, so one pass from the back visits both children of every node before the node itself.
+// Much cheaper than a rebuild, but the tree's quality drops as primitives move away from where
+// it was built.
+template <typename PrimBoundsFn>
+void RefitBVH(BVHNode* nodes, uint32_t nodeCount, PrimBoundsFn&& primBounds)
+{
+    for (uint32_t i = nodeCount; i-- > 0;) {
+        BVHNode& node = nodes[i];
+        AABB box;
+        if (node.IsLeaf()) {
+            for (uint32_t p = node.FirstPrim(); p < node.FirstPrim() + node.PrimCount(); p++)
+                box.Expand(primBounds(p));
+        } else {
+            // The left child follows its parent and misses to its right sibling
+            const BVHNode& left = nodes[i + 1];
+            box = SurroundingBox(left.Bounds(), nodes[left.MissIndex].Bounds());
+        }
+        node.SetBounds(box);
+    }
+}
+
+// Bounding volume hierarchy over the objects of a HittableList
+class BVH : public Hittable
+{
+  public:
+    BVH(const HittableList& list, int maxLeafSize = 4);
+
+    virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const override;
+    virtual bool BoundingBox(AABB& outputBox) const override;
+
+    size_t NodeCount() const { return m_Nodes.size(); }
+    // Objects with finite bounds in leaf order, and the ones without
+    const std::vector<std::shared_ptr<Hittable>>& Objects() const { return m_Objects; }
+    const std::vector<std::shared_ptr<Hittable>>& Unbounded() const { return m_Unbounded; }
+
+  private:
+    std::vector<BVHNode> m_Nodes;
+    // Bounded objects in leaf order
+    std::vector<std::shared_ptr<Hittable>> m_Objects;
+    // Objects without finite bounds are tested separately
+    std::vector<std::shared_ptr<Hittable>> m_Unbounded;
+};
+
+BVH::BVH(const HittableList& list, int maxLeafSize)
+{
+    std::vector<std::shared_ptr<Hittable>> bounded;
+    std::vector<AABB> bounds;
+    AABB box;
+    for (const auto& object : list.Objects()) {
+        if (object->BoundingBox(box)) {
+            bounded.push_back(object);
+            bounds.push_back(box);
+        } else {
+            m_Unbounded.push_back(object);
+        }
+    }
+
+    BVHBuildResult result = BuildBVH(bounds, maxLeafSize);
+    m_Nodes = std::move(result.Nodes);
+    m_Objects.reserve(bounded.size());
+    for (uint32_t index : result.PrimIndices)
+        m_Objects.push_back(bounded[index]);
+}
+
+bool BVH::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    HitRecord tempRecord;
+    bool hitAnything = false;
+    float closestSoFar = tMax;
+
+    for (const auto& object : m_Unbounded) {
+        if (object->Hit(r, tMin, closestSoFar, tempRecord)) {
+            hitAnything = true;
+            closestSoFar = tempRecord.t;
+            rec = tempRecord;
+        }
+    }
+
+    auto hitLeaf = [&](uint32_t first, uint32_t count, float& leafTMax) {
+        bool hitLeaf = false;
+        for (uint32_t i = first; i < first + count; i++) {
+            if (m_Objects[i]->Hit(r, tMin, leafTMax, tempRecord)) {
+                hitLeaf = true;
+                leafTMax = tempRecord.t;
+                rec = tempRecord;
+            }
+        }
+        return hitLeaf;
+    };
+    if (TraverseBVH(m_Nodes.data(), (uint32_t)m_Nodes.size(), r, tMin, closestSoFar, hitLeaf))
+        hitAnything = true;
+
+    return hitAnything;
+}
+
+bool BVH::BoundingBox(AABB& outputBox) const
+{
+    if (!m_Unbounded.empty() || m_Nodes.empty())
+        return false;
+
+    outputBox = m_Nodes[0].Bounds();
+    return true;
+}
+} // namespace rtiw
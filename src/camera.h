@@ -21,6 +21,24 @@ class Camera
             m_Origin - (m_Horizontal / 2) - (m_Vertical / 2) - vec3(0, 0, focalLength);
     }
 
+    // Camera at lookFrom looking towards lookAt, with vUp pointing up and a vertical field of view
+    // of vfov degrees
+    Camera(point3 lookFrom, point3 lookAt, vec3 vUp, float vfov, float aspectRatio)
+    {
+        float h = tanf(vfov * F_PI / 360.f);
+        float viewportHeight = 2.f * h;
+        float viewportWidth = aspectRatio * viewportHeight;
+
+        vec3 w = Normalize(lookFrom - lookAt);
+        vec3 u = Normalize(Cross(vUp, w));
+        vec3 v = Cross(w, u);
+
+        m_Origin = lookFrom;
+        m_Horizontal = viewportWidth * u;
+        m_Vertical = viewportHeight * v;
+        m_LowerLeftCorner = m_Origin - (m_Horizontal / 2) - (m_Vertical / 2) - w;
+    }
+
     ray GetRay(float u, float v) const
     {
         return ray(m_Origin, m_LowerLeftCorner + u * m_Horizontal + v * m_Vertical - m_Origin);
@@ -32,4 +50,35 @@ class Camera
     vec3 m_Horizontal;
     vec3 m_Vertical;
 };
+
+// Where a scene places its camera, as stored in scene files. Scenes that do not set it use the
+// default Camera().
+struct CameraSetup
+{
+    bool Set = false;
+    point3 LookFrom;
+    point3 LookAt;
+    vec3 Up;
+    float Vfov = 90.f;
+
+    Camera MakeCamera(float aspectRatio) const
+    {
+        return Set ? Camera(LookFrom, LookAt, Up, Vfov, aspectRatio) : Camera();
+    }
+
+    // The same view as an explicit placement, which can be moved. Setups that are not set get the
+    // placement of the default Camera().
+    CameraSetup Placed() const
+    {
+        if (Set)
+            return *this;
+        CameraSetup placed;
+        placed.Set = true;
+        placed.LookFrom = point3(0.f);
+        placed.LookAt = point3(0.f, 0.f, -1.f);
+        placed.Up = vec3(0.f, 1.f, 0.f);
+        placed.Vfov = 90.f;
+        return placed;
+    }
+};
 } // namespace rtiw
\ No newline at end of file
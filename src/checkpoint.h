@@ -0,0 +1,332 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "render_settings.h"
+#include "sampler.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace rtiw
+{
+// What a checkpoint belongs to. The random numbers of every sample are derived from the seed,
+// the pixel and the sample index, and the sampler's sequence from its type, seed and block size,
+// so together with the per-pixel sample counts this is all the RNG and sampler state a render
+// needs to continue exactly where it stopped.
+struct CheckpointInfo
+{
+    int Width = 0;
+    int Height = 0;
+    // Target of the render that wrote the checkpoint
+    int SamplesPerPixel = 0;
+    int SampleBlockSize = 0;
+    int MaxDepth = 0;
+    uint32_t Seed = 0;
+    SamplerType Sampling = SamplerType::Sobol;
+    // Identifies the scene and camera; a checkpoint is only resumed for the same key
+    uint64_t SceneKey = 0;
+
+    static CheckpointInfo FromSettings(const RenderSettings& settings, uint64_t sceneKey)
+    {
+        CheckpointInfo info;
+        info.Width = settings.ImageWidth;
+        info.Height = settings.ImageHeight;
+        info.SamplesPerPixel = settings.SamplesPerPixel;
+        info.SampleBlockSize = settings.SamplerBlock();
+        info.MaxDepth = settings.MaxDepth;
+        info.Seed = settings.Seed;
+        info.Sampling = settings.Sampling;
+        info.SceneKey = sceneKey;
+        return info;
+    }
+
+    // Settings that continue the checkpointed render
+    void ApplyTo(RenderSettings& settings) const
+    {
+        settings.ImageWidth = Width;
+        settings.ImageHeight = Height;
+        settings.SamplesPerPixel = SamplesPerPixel;
+        settings.SampleBlockSize = SampleBlockSize;
+        settings.MaxDepth = MaxDepth;
+        settings.Seed = Seed;
+        settings.Sampling = Sampling;
+    }
+};
+
+// 64-bit FNV-1a, used for scene keys
+inline uint64_t HashString(const std::string& s)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : s) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+namespace detail
+{
+const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'I', 'W', 'C', 'K', 'P', '\0'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+// File layout: this header, then width * height RGB float sums and width * height uint32
+// sample counts, rows top to bottom
+struct CheckpointHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t SamplesPerPixel;
+    uint32_t SampleBlockSize;
+    uint32_t MaxDepth;
+    uint32_t Seed;
+    uint32_t Sampling;
+    uint64_t SceneKey;
+};
+
+// Whether every field of header lies in the range the renderer writes. Samples and bounces
+// become ints on load, and --add-samples raises the target further.
+inline bool ValidCheckpointHeader(const CheckpointHeader& header)
+{
+    const uint32_t MAX_SIZE = 65536;
+    const uint32_t MAX_SAMPLES = 1u << 30;
+    const uint32_t MAX_DEPTH = 1024;
+    return header.Width > 0 && header.Width <= MAX_SIZE && header.Height > 0 &&
+           header.Height <= MAX_SIZE && header.SamplesPerPixel > 0 &&
+           header.SamplesPerPixel <= MAX_SAMPLES && header.SampleBlockSize > 0 &&
+           header.SampleBlockSize <= header.SamplesPerPixel && header.MaxDepth > 0 &&
+           header.MaxDepth <= MAX_DEPTH && header.Sampling <= (uint32_t)SamplerType::R2;
+}
+} // namespace detail
+
+// Writes fb to path. The data goes to a temporary file first, which is flushed to disk and then
+// renamed over path, so path always holds either the previous or the new complete checkpoint.
+bool SaveCheckpoint(const std::string& path, const CheckpointInfo& info, const Framebuffer& fb,
+                    std::string& error)
+{
+    detail::CheckpointHeader header = {};
+    memcpy(header.Magic, detail::CHECKPOINT_MAGIC, sizeof(header.Magic));
+    header.Version = detail::CHECKPOINT_VERSION;
+    header.Width = (uint32_t)info.Width;
+    header.Height = (uint32_t)info.Height;
+    header.SamplesPerPixel = (uint32_t)info.SamplesPerPixel;
+    header.SampleBlockSize = (uint32_t)info.SampleBlockSize;
+    header.MaxDepth = (uint32_t)info.MaxDepth;
+    header.Seed = info.Seed;
+    header.Sampling = (uint32_t)info.Sampling;
+    header.SceneKey = info.SceneKey;
+
+    const size_t pixelCount = (size_t)fb.Width() * fb.Height();
+    std::vector<float> sums(pixelCount * 3);
+    for (size_t p = 0; p < pixelCount; p++)
+        for (int c = 0; c < 3; c++)
+            sums[3 * p + c] = fb.Pixels()[p][c];
+
+    std::string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (!file) {
+        error = "cannot open " + temp;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(sums.data(), sizeof(float), sums.size(), file) == sums.size() &&
+              fwrite(fb.SampleCounts().data(), sizeof(uint32_t), pixelCount, file) == pixelCount &&
+              fflush(file) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(file)) == 0;
+#else
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        remove(temp.c_str());
+        error = "cannot write " + temp;
+        return false;
+    }
+
+#ifdef _WIN32
+    ok = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = rename(temp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok)
+        error = "cannot replace " + path;
+    return ok;
+}
+
+// Reads a checkpoint into info and fb. Returns false and describes the problem in error if the
+// file is missing or damaged.
+bool LoadCheckpoint(const std::string& path, CheckpointInfo& info, Framebuffer& fb,
+                    std::string& error)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    detail::CheckpointHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.Magic, detail::CHECKPOINT_MAGIC, sizeof(header.Magic)) == 0 &&
+              header.Version == detail::CHECKPOINT_VERSION;
+    bool damaged = ok && !detail::ValidCheckpointHeader(header);
+    ok = ok && !damaged;
+    std::vector<float> sums;
+    if (ok) {
+        info.Width = (int)header.Width;
+        info.Height = (int)header.Height;
+        info.SamplesPerPixel = (int)header.SamplesPerPixel;
+        info.SampleBlockSize = (int)header.SampleBlockSize;
+        info.MaxDepth = (int)header.MaxDepth;
+        info.Seed = header.Seed;
+        info.Sampling = (SamplerType)header.Sampling;
+        info.SceneKey = header.SceneKey;
+
+        const size_t pixelCount = (size_t)info.Width * info.Height;
+        fb.Resize(info.Width, info.Height);
+        sums.resize(pixelCount * 3);
+        std::vector<uint32_t> counts(pixelCount);
+        ok = fread(sums.data(), sizeof(float), sums.size(), file) == sums.size() &&
+             fread(counts.data(), sizeof(uint32_t), pixelCount, file) == pixelCount;
+        // No pixel of the render that wrote it can be past its target
+        for (size_t p = 0; ok && p < pixelCount; p++)
+            damaged = damaged || counts[p] > header.SamplesPerPixel;
+        ok = ok && !damaged;
+        for (size_t p = 0; ok && p < pixelCount; p++) {
+            int x = (int)(p % info.Width);
+            int y = (int)(p / info.Width);
+            fb.At(x, y) = color(sums[3 * p], sums[3 * p + 1], sums[3 * p + 2]);
+            fb.SampleCount(x, y) = counts[p];
+        }
+    }
+    fclose(file);
+
+    if (damaged)
+        error = path + " is damaged";
+    else if (!ok)
+        error = path + " is not a complete checkpoint";
+    return ok;
+}
+
+// Checkpoints a running render. Finished tiles are copied into a snapshot as they come in (tiles
+// still being rendered are never read), and a background thread saves the snapshot every
+// interval once something changed.
+class CheckpointWriter
+{
+  public:
+    CheckpointWriter() {}
+    ~CheckpointWriter() { StopThread(); }
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // Starts from the state fb holds now (empty, or a loaded checkpoint)
+    void Start(const std::string& path, const CheckpointInfo& info, const Framebuffer& fb,
+               double intervalSeconds);
+
+    // Records the pixels of a finished tile. Thread-safe.
+    void TileDone(const Framebuffer& fb, const Tile& tile);
+
+    // Stops the background thread and saves the final state of fb
+    bool Finish(const Framebuffer& fb, std::string& error);
+
+  private:
+    void SaveLoop();
+    void StopThread();
+
+    std::string m_Path;
+    CheckpointInfo m_Info;
+    double m_Interval = 60.0;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_StopCV;
+    Framebuffer m_Snapshot;
+    bool m_Dirty = false;
+    bool m_Stop = false;
+    std::thread m_Thread;
+};
+
+void CheckpointWriter::Start(const std::string& path, const CheckpointInfo& info,
+                             const Framebuffer& fb, double intervalSeconds)
+{
+    m_Path = path;
+    m_Info = info;
+    m_Interval = intervalSeconds;
+    m_Snapshot = fb;
+    m_Dirty = false;
+    m_Stop = false;
+    m_Thread = std::thread(&CheckpointWriter::SaveLoop, this);
+}
+
+void CheckpointWriter::TileDone(const Framebuffer& fb, const Tile& tile)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (int y = tile.Y0; y < tile.Y1; y++) {
+        for (int x = tile.X0; x < tile.X1; x++) {
+            m_Snapshot.At(x, y) = fb.At(x, y);
+            m_Snapshot.SampleCount(x, y) = fb.SampleCount(x, y);
+        }
+    }
+    m_Dirty = true;
+}
+
+void CheckpointWriter::SaveLoop()
+{
+    Framebuffer copy;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;) {
+        auto interval = std::chrono::duration<double>(m_Interval);
+        if (m_StopCV.wait_for(lock, interval, [&] { return m_Stop; }))
+            return;
+        if (!m_Dirty)
+            continue;
+
+        // Save a copy, so the render threads only wait for the copy and not for the disk
+        copy = m_Snapshot;
+        m_Dirty = false;
+        lock.unlock();
+        std::string error;
+        if (!SaveCheckpoint(m_Path, m_Info, copy, error))
+            std::cerr << "\nCheckpoint failed: " << error << "\n";
+        lock.lock();
+    }
+}
+
+void CheckpointWriter::StopThread()
+{
+    if (!m_Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_StopCV.notify_one();
+    m_Thread.join();
+}
+
+bool CheckpointWriter::Finish(const Framebuffer& fb, std::string& error)
+{
+    StopThread();
+    return SaveCheckpoint(m_Path, m_Info, fb, error);
+}
+} // namespace rtiw
@@ -0,0 +1,831 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "sphere.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Materials and primitives of the compiled scene are a closed set held in std::variant and
+// dispatched with std::visit, which the compiler resolves statically and inlines into the bounce
+// loop. Building with RTIW_VIRTUAL_DISPATCH=1 routes the same calls through virtual functions
+// (materials) and a per-type function table (primitives) instead, to measure what static
+// dispatch buys on identical data.
+#ifndef RTIW_VIRTUAL_DISPATCH
+#define RTIW_VIRTUAL_DISPATCH 0
+#endif
+
+namespace rtiw
+{
+struct SphereRecord
+{
+    float Center[3];
+    float Radius;
+    uint32_t MaterialId;
+
+    bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+    {
+        point3 center(Center[0], Center[1], Center[2]);
+        if (!HitSphere(center, Radius, r, tMin, tMax, rec))
+            return false;
+        rec.MaterialId = MaterialId;
+        return true;
+    }
+
+    AABB Bounds() const
+    {
+        point3 center(Center[0], Center[1], Center[2]);
+        vec3 r(fabsf(Radius));
+        return AABB(center - r, center + r);
+    }
+};
+
+// Another BVH of the scene (a prototype) placed through one of the scene's transforms. The
+// transform lives in a separate table so that instances do not make every primitive larger.
+struct InstanceRecord
+{
+    uint32_t Prototype;
+    uint32_t TransformId;
+};
+
+// Closed sets of the compiled scene. A new type is added to these lists; primitives need Hit()
+// and Bounds() (instances are intersected and bounded by the scene, which holds what they
+// reference), materials are the final Material classes.
+using CompiledMaterial = std::variant<Lambertian, Metal>;
+using CompiledPrimitive = std::variant<SphereRecord, InstanceRecord>;
+// Scene caches store primitives as they are in memory
+static_assert(std::is_trivially_copyable_v<CompiledPrimitive>,
+              "compiled primitives must be plain data");
+static_assert(std::is_trivially_copyable_v<Transform>, "transforms must be plain data");
+
+// One BVH of a compiled scene: a range of the node array over a range of the primitive array.
+// Leaf primitive indices are relative to FirstPrimitive.
+struct CompiledPrototype
+{
+    uint64_t FirstPrimitive;
+    uint64_t PrimitiveCount;
+    uint32_t FirstNode;
+    uint32_t NodeCount;
+};
+
+class CompiledScene;
+
+namespace detail
+{
+using PrimitiveHitFn = bool (*)(const CompiledScene&, const CompiledPrimitive&, const ray&, float,
+                                float, HitRecord&);
+
+// Defined after CompiledScene
+template <typename T>
+bool HitPrimitive(const CompiledScene& scene, const CompiledPrimitive& p, const ray& r,
+                  float tMin, float tMax, HitRecord& rec);
+
+template <typename Variant>
+struct PrimitiveHitFns;
+
+template <typename... Ts>
+struct PrimitiveHitFns<std::variant<Ts...>>
+{
+    static std::array<PrimitiveHitFn, sizeof...(Ts)> Make() { return {&HitPrimitive<Ts>...}; }
+};
+
+const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'I', 'W', 'S', 'C', 'N', '\0'};
+const uint32_t SCENE_CACHE_VERSION = 2;
+// Sections start on cache line boundaries
+const size_t SCENE_CACHE_ALIGNMENT = 64;
+
+// Start of a scene cache file. The offsets point at the material records, the primitives, the
+// BVH nodes, the prototypes and the instance transforms. Caches are tied to the build that wrote
+// them: the array layouts are recorded and a cache with different ones is rejected.
+struct SceneCacheHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t PrimitiveSize;
+    uint32_t NodeSize;
+    uint32_t MaterialCount;
+    uint64_t PrimitiveCount;
+    uint64_t NodeCount;
+    uint64_t MaterialsOffset;
+    uint64_t PrimitivesOffset;
+    uint64_t NodesOffset;
+    uint32_t CameraSet;
+    // LookFrom, LookAt, Up and Vfov of the CameraSetup
+    float Camera[10];
+    uint64_t PrototypesOffset;
+    uint64_t TransformsOffset;
+    uint32_t PrototypeCount;
+    uint32_t TransformCount;
+    uint32_t RootPrototype;
+};
+
+// Materials hold a vtable pointer, so they are stored as records and rebuilt on load
+struct MaterialCacheRecord
+{
+    uint32_t Type;
+    float Albedo[3];
+    float Fuzz;
+};
+} // namespace detail
+
+// Immutable render-time form of a scene. The authoring graph of shared_ptr'd Hittables and
+// Materials is compiled into three contiguous arrays (materials, primitives in BVH leaf order
+// and BVH nodes). Hits carry a 32-bit material id instead of a pointer, so tracing a ray neither
+// allocates nor touches a reference count.
+//
+// Instanced objects are compiled once each, into a BVH of their own (a prototype) that shares
+// the primitive and node arrays. An instance is a primitive of the BVH above it; rays that reach
+// it continue, transformed into the prototype's space, in the prototype's BVH.
+class CompiledScene
+{
+  public:
+    CompiledScene() = default;
+    // Not copyable: with virtual dispatch m_MaterialPtrs points into m_Materials
+    CompiledScene(const CompiledScene&) = delete;
+    CompiledScene& operator=(const CompiledScene&) = delete;
+
+    // Compiles the objects of world: Spheres, HittableLists and BVHs of them, and Instances of
+    // any of these. Returns false and describes the problem in error if the scene holds objects
+    // that cannot be compiled.
+    bool Compile(const HittableList& world, std::string& error);
+
+    // Builds the BVH over already flat materials and primitives, e.g. read from a scene file.
+    // Every primitive's material id must index materials.
+    void Build(std::vector<CompiledMaterial> materials, std::vector<CompiledPrimitive> primitives);
+
+    // Writes the compiled scene and camera as a binary cache. LoadCache() maps such a file and
+    // uses its primitives and BVH nodes in place, so loading costs neither parsing nor a BVH
+    // build. Both return false and describe the problem in error on failure.
+    bool SaveCache(const std::string& path, const CameraSetup& camera, std::string& error) const;
+    bool LoadCache(const std::string& path, CameraSetup& camera, std::string& error);
+
+    bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const;
+
+    // Intersects one primitive; instances continue in their prototype
+    template <typename Primitive>
+    bool HitPrimitive(const Primitive& prim, const ray& r, float tMin, float tMax,
+                      HitRecord& rec) const
+    {
+        return prim.Hit(r, tMin, tMax, rec);
+    }
+    bool HitPrimitive(const InstanceRecord& instance, const ray& r, float tMin, float tMax,
+                      HitRecord& rec) const;
+
+    MaterialType MaterialTypeOf(const HitRecord& rec) const
+    {
+#if RTIW_VIRTUAL_DISPATCH
+        return m_MaterialPtrs[rec.MaterialId]->Type();
+#else
+        return std::visit([](const auto& mat) { return mat.Type(); }, m_Materials[rec.MaterialId]);
+#endif
+    }
+
+    bool Scatter(const ray& inRay, const HitRecord& rec, color& attenuation, ray& scattered) const
+    {
+#if RTIW_VIRTUAL_DISPATCH
+        return m_MaterialPtrs[rec.MaterialId]->scatter(inRay, rec, attenuation, scattered);
+#else
+        return std::visit(
+            [&](const auto& mat) { return mat.scatter(inRay, rec, attenuation, scattered); },
+            m_Materials[rec.MaterialId]);
+#endif
+    }
+
+    size_t MaterialCount() const { return m_Materials.size(); }
+    size_t PrimitiveCount() const { return m_PrimitiveCount; }
+    size_t NodeCount() const { return m_NodeCount; }
+    size_t PrototypeCount() const { return m_Prototypes.size(); }
+    size_t InstanceCount() const { return m_Transforms.size(); }
+    const CompiledMaterial& MaterialAt(uint32_t id) const { return m_Materials[id]; }
+    // Primitives are in BVH leaf order, one prototype after another
+    const CompiledPrimitive& PrimitiveAt(size_t index) const { return m_Primitives[index]; }
+
+    size_t MemoryBytes() const
+    {
+        return m_Materials.size() * sizeof(CompiledMaterial) +
+               m_PrimitiveCount * sizeof(CompiledPrimitive) + m_NodeCount * sizeof(BVHNode) +
+               m_Prototypes.size() * sizeof(CompiledPrototype) +
+               m_Transforms.size() * sizeof(Transform);
+    }
+
+    // Primitive count and memory of the same scene with every instance replaced by a copy of its
+    // prototype. Reads every primitive.
+    void FlatSize(uint64_t& primitives, uint64_t& memoryBytes) const;
+
+    // Animation. The top-level objects are the primitives of the scene itself (spheres and
+    // instances, not what the instances contain), numbered in the order they were compiled. Only
+    // scenes made by Compile() or Build() can move them; caches do not record that order.
+    bool CanMoveObjects() const { return !m_ObjectSlots.empty(); }
+    size_t ObjectCount() const { return m_ObjectSlots.size(); }
+    const CompiledPrimitive& ObjectAt(size_t index) const
+    {
+        return m_Primitives[m_Prototypes[m_Root].FirstPrimitive + m_ObjectSlots[index]];
+    }
+    // Replaces a top-level object, e.g. by a sphere that moved. Instances move through their
+    // transform instead.
+    void SetObject(size_t index, const CompiledPrimitive& object)
+    {
+        m_OwnedPrimitives[m_Prototypes[m_Root].FirstPrimitive + m_ObjectSlots[index]] = object;
+    }
+    const Transform& InstanceToWorld(uint32_t transformId) const
+    {
+        return m_InstanceToWorld[transformId];
+    }
+    // Places a top-level instance anew
+    void SetInstanceTransform(uint32_t transformId, const Transform& objectToWorld)
+    {
+        m_InstanceToWorld[transformId] = objectToWorld;
+        m_Transforms[transformId] = objectToWorld.Inverse();
+    }
+    // Fits the top-level BVH to the objects after they moved. The prototypes stay as they are.
+    void Refit();
+    // Builds a new top-level BVH over the objects as they are now and returns it without using
+    // it, to compare the cost of a rebuild with Refit()
+    BVHBuildResult BuildTopLevel() const;
+
+    static const char* DispatchName() { return RTIW_VIRTUAL_DISPATCH ? "virtual" : "static"; }
+
+  private:
+    struct Builder
+    {
+        std::vector<CompiledMaterial> Materials;
+        std::unordered_map<const Material*, uint32_t> MaterialIds;
+        // Primitives of every prototype; the top level of the scene is prototype 0
+        std::vector<std::vector<CompiledPrimitive>> Prototypes = {{}};
+        std::unordered_map<const Hittable*, uint32_t> PrototypeIds;
+        // Prototypes in the order they were completed, so each one follows those it instances
+        std::vector<uint32_t> BuildOrder;
+        std::vector<Transform> WorldToObject;
+        // Only needed to bound the instances
+        std::vector<Transform> ObjectToWorld;
+
+        bool AddObject(const Hittable& object, uint32_t prototype, std::string& error);
+        bool AddPrototype(const Hittable& object, uint32_t& id, std::string& error);
+        bool AddMaterial(const Material* mat, uint32_t& id, std::string& error);
+    };
+
+    // Builds the BVHs of every prototype, in the builder's order
+    void Build(Builder& builder);
+    void SetMaterials(std::vector<CompiledMaterial> materials);
+    bool HitPrototype(const CompiledPrototype& prototype, const ray& r, float tMin, float tMax,
+                      HitRecord& rec) const;
+    AABB PrimitiveBounds(const CompiledPrimitive& p) const;
+
+    std::vector<CompiledMaterial> m_Materials;
+    // Primitives and nodes point into the owned arrays after Compile() and Build(), or into the
+    // mapped cache file after LoadCache()
+    std::vector<CompiledPrimitive> m_OwnedPrimitives;
+    std::vector<BVHNode> m_OwnedNodes;
+    MappedFile m_Cache;
+    const CompiledPrimitive* m_Primitives = nullptr;
+    size_t m_PrimitiveCount = 0;
+    const BVHNode* m_Nodes = nullptr;
+    uint32_t m_NodeCount = 0;
+    std::vector<CompiledPrototype> m_Prototypes;
+    uint32_t m_Root = 0;
+    // World-to-object transforms of the instances
+    std::vector<Transform> m_Transforms;
+    // Only kept for animation: the object-to-world transforms, and where every top-level object
+    // went in the BVH leaf order
+    std::vector<Transform> m_InstanceToWorld;
+    std::vector<uint32_t> m_ObjectSlots;
+#if RTIW_VIRTUAL_DISPATCH
+    std::vector<const Material*> m_MaterialPtrs;
+    // Loaded from the object rather than a constant table, so the compiler cannot resolve the
+    // call like it could for a single-entry constexpr array
+    std::array<detail::PrimitiveHitFn, std::variant_size_v<CompiledPrimitive>> m_HitFns =
+        detail::PrimitiveHitFns<CompiledPrimitive>::Make();
+#endif
+};
+
+bool CompiledScene::Builder::AddMaterial(const Material* mat, uint32_t& id, std::string& error)
+{
+    auto found = MaterialIds.find(mat);
+    if (found != MaterialIds.end()) {
+        id = found->second;
+        return true;
+    }
+
+    if (const Lambertian* lambertian = dynamic_cast<const Lambertian*>(mat)) {
+        Materials.emplace_back(*lambertian);
+    } else if (const Metal* metal = dynamic_cast<const Metal*>(mat)) {
+        Materials.emplace_back(*metal);
+    } else {
+        error = "unsupported material type";
+        return false;
+    }
+
+    id = (uint32_t)Materials.size() - 1;
+    MaterialIds[mat] = id;
+    return true;
+}
+
+bool CompiledScene::Builder::AddObject(const Hittable& object, uint32_t prototype,
+                                       std::string& error)
+{
+    if (const Sphere* sphere = dynamic_cast<const Sphere*>(&object)) {
+        SphereRecord record;
+        point3 center = sphere->Center();
+        for (int a = 0; a < 3; a++)
+            record.Center[a] = center[a];
+        record.Radius = sphere->Radius();
+        if (!AddMaterial(sphere->MaterialPtr().get(), record.MaterialId, error))
+            return false;
+        Prototypes[prototype].emplace_back(record);
+    } else if (const HittableList* list = dynamic_cast<const HittableList*>(&object)) {
+        for (const auto& child : list->Objects()) {
+            if (!AddObject(*child, prototype, error))
+                return false;
+        }
+    } else if (const BVH* bvh = dynamic_cast<const BVH*>(&object)) {
+        // Compiled like a list; the scene builds its own BVH
+        for (const auto* objects : {&bvh->Unbounded(), &bvh->Objects()}) {
+            for (const auto& child : *objects) {
+                if (!AddObject(*child, prototype, error))
+                    return false;
+            }
+        }
+    } else if (const Instance* instance = dynamic_cast<const Instance*>(&object)) {
+        InstanceRecord record;
+        if (!AddPrototype(*instance->Object(), record.Prototype, error))
+            return false;
+        // Instances of nothing would only put empty boxes into the BVH
+        if (Prototypes[record.Prototype].empty())
+            return true;
+        record.TransformId = (uint32_t)WorldToObject.size();
+        WorldToObject.push_back(instance->WorldToObject());
+        ObjectToWorld.push_back(instance->ObjectToWorld());
+        Prototypes[prototype].emplace_back(record);
+    } else {
+        error = "only spheres and lists, BVHs and instances of spheres can be compiled";
+        return false;
+    }
+    return true;
+}
+
+bool CompiledScene::Builder::AddPrototype(const Hittable& object, uint32_t& id,
+                                          std::string& error)
+{
+    auto found = PrototypeIds.find(&object);
+    if (found != PrototypeIds.end()) {
+        id = found->second;
+        // Prototypes are only in the build order once they are complete
+        if (std::find(BuildOrder.begin(), BuildOrder.end(), id) == BuildOrder.end()) {
+            error = "an instance contains itself";
+            return false;
+        }
+        return true;
+    }
+
+    id = (uint32_t)Prototypes.size();
+    Prototypes.emplace_back();
+    PrototypeIds[&object] = id;
+    if (!AddObject(object, id, error))
+        return false;
+    BuildOrder.push_back(id);
+    return true;
+}
+
+bool CompiledScene::Compile(const HittableList& world, std::string& error)
+{
+    Builder builder;
+    if (!builder.AddObject(world, 0, error))
+        return false;
+    builder.BuildOrder.push_back(0);
+
+    Build(builder);
+    return true;
+}
+
+void CompiledScene::Build(std::vector<CompiledMaterial> materials,
+                          std::vector<CompiledPrimitive> primitives)
+{
+    Builder builder;
+    builder.Materials = std::move(materials);
+    builder.Prototypes[0] = std::move(primitives);
+    builder.BuildOrder.push_back(0);
+    Build(builder);
+}
+
+void CompiledScene::Build(Builder& builder)
+{
+    size_t totalPrimitives = 0;
+    for (const std::vector<CompiledPrimitive>& primitives : builder.Prototypes)
+        totalPrimitives += primitives.size();
+
+    m_Cache.Close();
+    m_OwnedNodes.clear();
+    m_OwnedPrimitives.clear();
+    m_OwnedPrimitives.reserve(totalPrimitives);
+    m_ObjectSlots.clear();
+    m_Prototypes.assign(builder.Prototypes.size(), CompiledPrototype{});
+    std::vector<AABB> prototypeBounds(builder.Prototypes.size());
+    auto boundsOf = [&](const auto& prim) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(prim)>, InstanceRecord>)
+            return builder.ObjectToWorld[prim.TransformId].ApplyBox(
+                prototypeBounds[prim.Prototype]);
+        else
+            return prim.Bounds();
+    };
+
+    for (uint32_t id : builder.BuildOrder) {
+        std::vector<CompiledPrimitive>& primitives = builder.Prototypes[id];
+        std::vector<AABB> bounds;
+        bounds.reserve(primitives.size());
+        for (const CompiledPrimitive& p : primitives)
+            bounds.push_back(std::visit(boundsOf, p));
+
+        BVHBuildResult bvh = BuildBVH(bounds);
+        CompiledPrototype& prototype = m_Prototypes[id];
+        prototype.FirstPrimitive = m_OwnedPrimitives.size();
+        prototype.PrimitiveCount = primitives.size();
+        prototype.FirstNode = (uint32_t)m_OwnedNodes.size();
+        prototype.NodeCount = (uint32_t)bvh.Nodes.size();
+        for (uint32_t index : bvh.PrimIndices)
+            m_OwnedPrimitives.push_back(primitives[index]);
+        if (id == builder.BuildOrder.back()) {
+            m_ObjectSlots.resize(primitives.size());
+            for (uint32_t slot = 0; slot < (uint32_t)bvh.PrimIndices.size(); slot++)
+                m_ObjectSlots[bvh.PrimIndices[slot]] = slot;
+        }
+        m_OwnedNodes.insert(m_OwnedNodes.end(), bvh.Nodes.begin(), bvh.Nodes.end());
+        if (!bvh.Nodes.empty())
+            prototypeBounds[id] = bvh.Nodes[0].Bounds();
+        std::vector<CompiledPrimitive>().swap(primitives);
+    }
+
+    m_Primitives = m_OwnedPrimitives.data();
+    m_PrimitiveCount = m_OwnedPrimitives.size();
+    m_Nodes = m_OwnedNodes.data();
+    m_NodeCount = (uint32_t)m_OwnedNodes.size();
+    m_Root = builder.BuildOrder.back();
+    m_Transforms = std::move(builder.WorldToObject);
+    m_InstanceToWorld = std::move(builder.ObjectToWorld);
+    SetMaterials(std::move(builder.Materials));
+}
+
+void CompiledScene::SetMaterials(std::vector<CompiledMaterial> materials)
+{
+    m_Materials = std::move(materials);
+#if RTIW_VIRTUAL_DISPATCH
+    m_MaterialPtrs.clear();
+    for (const CompiledMaterial& mat : m_Materials) {
+        auto base = [](const auto& m) -> const Material* { return &m; };
+        m_MaterialPtrs.push_back(std::visit(base, mat));
+    }
+#endif
+}
+
+bool CompiledScene::SaveCache(const std::string& path, const CameraSetup& camera,
+                              std::string& error) const
+{
+    auto alignUp = [](uint64_t offset) {
+        return (offset + detail::SCENE_CACHE_ALIGNMENT - 1) / detail::SCENE_CACHE_ALIGNMENT *
+               detail::SCENE_CACHE_ALIGNMENT;
+    };
+
+    detail::SceneCacheHeader header = {};
+    memcpy(header.Magic, detail::SCENE_CACHE_MAGIC, sizeof(header.Magic));
+    header.Version = detail::SCENE_CACHE_VERSION;
+    header.PrimitiveSize = sizeof(CompiledPrimitive);
+    header.NodeSize = sizeof(BVHNode);
+    header.MaterialCount = (uint32_t)m_Materials.size();
+    header.PrimitiveCount = m_PrimitiveCount;
+    header.NodeCount = m_NodeCount;
+    header.MaterialsOffset = alignUp(sizeof(header));
+    header.PrimitivesOffset =
+        alignUp(header.MaterialsOffset + m_Materials.size() * sizeof(detail::MaterialCacheRecord));
+    header.NodesOffset =
+        alignUp(header.PrimitivesOffset + m_PrimitiveCount * sizeof(CompiledPrimitive));
+    header.PrototypeCount = (uint32_t)m_Prototypes.size();
+    header.TransformCount = (uint32_t)m_Transforms.size();
+    header.RootPrototype = m_Root;
+    header.PrototypesOffset = alignUp(header.NodesOffset + m_NodeCount * sizeof(BVHNode));
+    header.TransformsOffset =
+        alignUp(header.PrototypesOffset + m_Prototypes.size() * sizeof(CompiledPrototype));
+    header.CameraSet = camera.Set ? 1 : 0;
+    for (int a = 0; a < 3; a++) {
+        header.Camera[a] = camera.LookFrom[a];
+        header.Camera[3 + a] = camera.LookAt[a];
+        header.Camera[6 + a] = camera.Up[a];
+    }
+    header.Camera[9] = camera.Vfov;
+
+    std::vector<detail::MaterialCacheRecord> records;
+    for (const CompiledMaterial& mat : m_Materials) {
+        detail::MaterialCacheRecord record = {};
+        color albedo = std::visit([](const auto& m) { return m.Albedo(); }, mat);
+        record.Type = (uint32_t)std::visit([](const auto& m) { return m.Type(); }, mat);
+        for (int c = 0; c < 3; c++)
+            record.Albedo[c] = albedo[c];
+        if (const Metal* metal = std::get_if<Metal>(&mat))
+            record.Fuzz = metal->Fuzz();
+        records.push_back(record);
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    uint64_t written = 0;
+    auto put = [&](uint64_t offset, const void* data, size_t size) {
+        static const char ZEROS[detail::SCENE_CACHE_ALIGNMENT] = {};
+        bool ok = fwrite(ZEROS, 1, offset - written, file) == offset - written &&
+                  (size == 0 || fwrite(data, 1, size, file) == size);
+        written = offset + size;
+        return ok;
+    };
+    bool ok = put(0, &header, sizeof(header)) &&
+              put(header.MaterialsOffset, records.data(),
+                  records.size() * sizeof(detail::MaterialCacheRecord)) &&
+              put(header.PrimitivesOffset, m_Primitives,
+                  m_PrimitiveCount * sizeof(CompiledPrimitive)) &&
+              put(header.NodesOffset, m_Nodes, m_NodeCount * sizeof(BVHNode)) &&
+              put(header.PrototypesOffset, m_Prototypes.data(),
+                  m_Prototypes.size() * sizeof(CompiledPrototype)) &&
+              put(header.TransformsOffset, m_Transforms.data(),
+                  m_Transforms.size() * sizeof(Transform));
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        error = "cannot write " + path;
+    return ok;
+}
+
+bool CompiledScene::LoadCache(const std::string& path, CameraSetup& camera, std::string& error)
+{
+    MappedFile file;
+    if (!file.Open(path)) {
+        error = "cannot map " + path;
+        return false;
+    }
+
+    detail::SceneCacheHeader header;
+    if (file.Size() < sizeof(header)) {
+        error = path + " is not a scene cache";
+        return false;
+    }
+    memcpy(&header, file.Data(), sizeof(header));
+    if (memcmp(header.Magic, detail::SCENE_CACHE_MAGIC, sizeof(header.Magic)) != 0) {
+        error = path + " is not a scene cache";
+        return false;
+    }
+    if (header.Version != detail::SCENE_CACHE_VERSION ||
+        header.PrimitiveSize != sizeof(CompiledPrimitive) || header.NodeSize != sizeof(BVHNode)) {
+        error = path + " was written by a different version of the renderer; rebuild it";
+        return false;
+    }
+
+    // Every section must lie inside the file and be aligned for in-place use
+    auto inside = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % detail::SCENE_CACHE_ALIGNMENT == 0 && offset <= file.Size() &&
+               count <= (file.Size() - offset) / size;
+    };
+    if (!inside(header.MaterialsOffset, header.MaterialCount,
+                sizeof(detail::MaterialCacheRecord)) ||
+        !inside(header.PrimitivesOffset, header.PrimitiveCount, sizeof(CompiledPrimitive)) ||
+        !inside(header.NodesOffset, header.NodeCount, sizeof(BVHNode)) ||
+        !inside(header.PrototypesOffset, header.PrototypeCount, sizeof(CompiledPrototype)) ||
+        !inside(header.TransformsOffset, header.TransformCount, sizeof(Transform)) ||
+        header.RootPrototype >= header.PrototypeCount) {
+        error = path + " is truncated or damaged";
+        return false;
+    }
+
+    // The prototype and transform tables are small, so they are copied
+    std::vector<CompiledPrototype> prototypes(header.PrototypeCount);
+    std::vector<Transform> transforms(header.TransformCount);
+    memcpy(prototypes.data(), file.Data() + header.PrototypesOffset,
+           prototypes.size() * sizeof(CompiledPrototype));
+    memcpy((void*)transforms.data(), file.Data() + header.TransformsOffset,
+           transforms.size() * sizeof(Transform));
+    for (const CompiledPrototype& prototype : prototypes) {
+        if (prototype.FirstPrimitive > header.PrimitiveCount ||
+            prototype.PrimitiveCount > header.PrimitiveCount - prototype.FirstPrimitive ||
+            prototype.FirstNode > header.NodeCount ||
+            prototype.NodeCount > header.NodeCount - prototype.FirstNode) {
+            error = path + " is truncated or damaged";
+            return false;
+        }
+    }
+
+    // The arrays are used in place, so every index in them is checked once, here. Misses only
+    // jump forward, so traversal ends. An instance must reference a prototype stored before the
+    // one holding it, as Build() writes them, so instances cannot form a cycle.
+    const CompiledPrimitive* primitives =
+        (const CompiledPrimitive*)(file.Data() + header.PrimitivesOffset);
+    const BVHNode* nodes = (const BVHNode*)(file.Data() + header.NodesOffset);
+    for (const CompiledPrototype& prototype : prototypes) {
+        bool valid = true;
+        for (uint64_t i = 0; i < prototype.PrimitiveCount && valid; i++) {
+            const CompiledPrimitive& p = primitives[prototype.FirstPrimitive + i];
+            if (p.index() >= std::variant_size_v<CompiledPrimitive>) {
+                valid = false;
+            } else if (const SphereRecord* sphere = std::get_if<SphereRecord>(&p)) {
+                valid = sphere->MaterialId < header.MaterialCount;
+            } else if (const InstanceRecord* instance = std::get_if<InstanceRecord>(&p)) {
+                const CompiledPrototype* target = instance->Prototype < prototypes.size()
+                                                      ? &prototypes[instance->Prototype]
+                                                      : nullptr;
+                valid = target && instance->TransformId < header.TransformCount &&
+                        target->FirstPrimitive + target->PrimitiveCount <=
+                            prototype.FirstPrimitive;
+            }
+        }
+        const BVHNode* prototypeNodes = nodes + prototype.FirstNode;
+        for (uint32_t i = 0; i < prototype.NodeCount && valid; i++) {
+            const BVHNode& node = prototypeNodes[i];
+            valid = node.MissIndex > i && node.MissIndex <= prototype.NodeCount &&
+                    (uint64_t)node.FirstPrim() + node.PrimCount() <= prototype.PrimitiveCount;
+        }
+        if (!valid) {
+            error = path + " is truncated or damaged";
+            return false;
+        }
+    }
+
+    std::vector<CompiledMaterial> materials;
+    materials.reserve(header.MaterialCount);
+    for (uint32_t m = 0; m < header.MaterialCount; m++) {
+        detail::MaterialCacheRecord record;
+        memcpy(&record, file.Data() + header.MaterialsOffset + m * sizeof(record), sizeof(record));
+        color albedo(record.Albedo[0], record.Albedo[1], record.Albedo[2]);
+        if (record.Type == (uint32_t)MaterialType::Lambertian) {
+            materials.emplace_back(Lambertian(albedo));
+        } else if (record.Type == (uint32_t)MaterialType::Metal) {
+            materials.emplace_back(Metal(albedo, record.Fuzz));
+        } else {
+            error = path + " holds an unknown material type";
+            return false;
+        }
+    }
+
+    camera.Set = header.CameraSet != 0;
+    camera.LookFrom = point3(header.Camera[0], header.Camera[1], header.Camera[2]);
+    camera.LookAt = point3(header.Camera[3], header.Camera[4], header.Camera[5]);
+    camera.Up = vec3(header.Camera[6], header.Camera[7], header.Camera[8]);
+    camera.Vfov = header.Camera[9];
+
+    // The primitive and node arrays are used straight from the mapping
+    m_OwnedPrimitives.clear();
+    m_OwnedNodes.clear();
+    m_Cache = std::move(file);
+    m_Primitives = (const CompiledPrimitive*)(m_Cache.Data() + header.PrimitivesOffset);
+    m_PrimitiveCount = header.PrimitiveCount;
+    m_Nodes = (const BVHNode*)(m_Cache.Data() + header.NodesOffset);
+    m_NodeCount = (uint32_t)header.NodeCount;
+    m_Prototypes = std::move(prototypes);
+    m_Root = header.RootPrototype;
+    m_Transforms = std::move(transforms);
+    m_InstanceToWorld.clear();
+    m_ObjectSlots.clear();
+    SetMaterials(std::move(materials));
+    return true;
+}
+
+AABB CompiledScene::PrimitiveBounds(const CompiledPrimitive& p) const
+{
+    auto boundsOf = [&](const auto& prim) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(prim)>, InstanceRecord>)
+            return m_InstanceToWorld[prim.TransformId].ApplyBox(
+                m_Nodes[m_Prototypes[prim.Prototype].FirstNode].Bounds());
+        else
+            return prim.Bounds();
+    };
+    return std::visit(boundsOf, p);
+}
+
+void CompiledScene::Refit()
+{
+    if (m_Prototypes.empty())
+        return;
+    const CompiledPrototype& root = m_Prototypes[m_Root];
+    const CompiledPrimitive* primitives = m_Primitives + root.FirstPrimitive;
+    RefitBVH(m_OwnedNodes.data() + root.FirstNode, root.NodeCount,
+             [&](uint32_t prim) { return PrimitiveBounds(primitives[prim]); });
+}
+
+BVHBuildResult CompiledScene::BuildTopLevel() const
+{
+    if (m_Prototypes.empty())
+        return BVHBuildResult();
+    const CompiledPrototype& root = m_Prototypes[m_Root];
+    std::vector<AABB> bounds;
+    bounds.reserve(root.PrimitiveCount);
+    for (uint64_t i = 0; i < root.PrimitiveCount; i++)
+        bounds.push_back(PrimitiveBounds(m_Primitives[root.FirstPrimitive + i]));
+    return BuildBVH(bounds);
+}
+
+void CompiledScene::FlatSize(uint64_t& primitives, uint64_t& memoryBytes) const
+{
+    primitives = 0;
+    memoryBytes = m_Materials.size() * sizeof(CompiledMaterial);
+    if (m_Prototypes.empty())
+        return;
+
+    // Prototypes are stored after the ones they instance, so going through them in storage
+    // order finds the expanded size of every prototype before its first instance
+    std::vector<uint32_t> order(m_Prototypes.size());
+    for (uint32_t id = 0; id < (uint32_t)order.size(); id++)
+        order[id] = id;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return m_Prototypes[a].FirstPrimitive + m_Prototypes[a].PrimitiveCount <
+               m_Prototypes[b].FirstPrimitive + m_Prototypes[b].PrimitiveCount;
+    });
+
+    std::vector<uint64_t> flatPrimitives(m_Prototypes.size(), 0);
+    std::vector<uint64_t> flatNodes(m_Prototypes.size(), 0);
+    for (uint32_t id : order) {
+        const CompiledPrototype& prototype = m_Prototypes[id];
+        flatNodes[id] = prototype.NodeCount;
+        for (uint64_t i = 0; i < prototype.PrimitiveCount; i++) {
+            const CompiledPrimitive& p = m_Primitives[prototype.FirstPrimitive + i];
+            if (const InstanceRecord* instance = std::get_if<InstanceRecord>(&p)) {
+                flatPrimitives[id] += flatPrimitives[instance->Prototype];
+                flatNodes[id] += flatNodes[instance->Prototype];
+            } else {
+                flatPrimitives[id]++;
+            }
+        }
+    }
+    primitives = flatPrimitives[m_Root];
+    memoryBytes += primitives * sizeof(CompiledPrimitive) + flatNodes[m_Root] * sizeof(BVHNode);
+}
+
+bool CompiledScene::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    if (m_Prototypes.empty())
+        return false;
+    return HitPrototype(m_Prototypes[m_Root], r, tMin, tMax, rec);
+}
+
+bool CompiledScene::HitPrototype(const CompiledPrototype& prototype, const ray& r, float tMin,
+                                 float tMax, HitRecord& rec) const
+{
+    const CompiledPrimitive* primitives = m_Primitives + prototype.FirstPrimitive;
+    auto hitLeaf = [&](uint32_t first, uint32_t count, float& leafTMax) {
+        bool hitAnything = false;
+        for (uint32_t i = first; i < first + count; i++) {
+            const CompiledPrimitive& p = primitives[i];
+#if RTIW_VIRTUAL_DISPATCH
+            bool hit = m_HitFns[p.index()](*this, p, r, tMin, leafTMax, rec);
+#else
+            bool hit = std::visit(
+                [&](const auto& prim) { return HitPrimitive(prim, r, tMin, leafTMax, rec); }, p);
+#endif
+            if (hit) {
+                hitAnything = true;
+                leafTMax = rec.t;
+            }
+        }
+        return hitAnything;
+    };
+    return TraverseBVH(m_Nodes + prototype.FirstNode, prototype.NodeCount, r, tMin, tMax,
+                       hitLeaf);
+}
+
+bool CompiledScene::HitPrimitive(const InstanceRecord& instance, const ray& r, float tMin,
+                                 float tMax, HitRecord& rec) const
+{
+    const CompiledPrototype& prototype = m_Prototypes[instance.Prototype];
+    return HitTransformed(m_Transforms[instance.TransformId], r, rec,
+                          [&](const ray& local, HitRecord& localRec) {
+                              return HitPrototype(prototype, local, tMin, tMax, localRec);
+                          });
+}
+
+template <typename T>
+bool detail::HitPrimitive(const CompiledScene& scene, const CompiledPrimitive& p, const ray& r,
+                          float tMin, float tMax, HitRecord& rec)
+{
+    return scene.HitPrimitive(*std::get_if<T>(&p), r, tMin, tMax, rec);
+}
+
+inline MaterialType HitMaterialType(const CompiledScene& scene, const HitRecord& rec)
+{
+    return scene.MaterialTypeOf(rec);
+}
+
+inline bool ScatterHit(const CompiledScene& scene, const ray& inRay, const HitRecord& rec,
+                       color& attenuation, ray& scattered)
+{
+    return scene.Scatter(inRay, rec, attenuation, scattered);
+}
+} // namespace rtiw
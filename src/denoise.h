@@ -0,0 +1,173 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace rtiw
+{
+struct DenoiseSettings
+{
+    // Filter passes. Pass k spreads its 5x5 kernel over gaps of 2^k pixels, so four passes
+    // reach 30 pixels in each direction.
+    int Iterations = 4;
+    // How different two pixels may be before they stop being averaged. Luminance differences
+    // are measured in standard deviations of the pixel's noise, which shrinks with every sample
+    // and every pass, so converged pixels and detail above the noise are left alone. Normals and
+    // albedos fall off as Gaussians of this width. Depths are compared relative to the pixel's
+    // depth, per pixel of distance between the two.
+    float LuminanceSigma = 4.f;
+    float NormalSigma = 0.1f;
+    float AlbedoSigma = 0.3f;
+    float DepthSigma = 0.05f;
+};
+
+namespace detail
+{
+// Per-pixel means of the features that steer the filter
+struct DenoiseGuide
+{
+    color Albedo;
+    vec3 Normal;
+    float Depth;
+};
+
+// Illumination of a pixel as it is filtered, and the variance of its luminance
+struct DenoiseValue
+{
+    color Illumination;
+    float Luminance;
+    float Variance;
+};
+} // namespace detail
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform
+// for fast Global Illumination Filtering", 2010) over the mean colors of fb, which must have
+// features enabled, with the variance-guided luminance weight of SVGF (Schied et al., 2017).
+// Each pass averages a pixel with 24 neighbours, weighted by a B3 spline and by how similar
+// their luminance, normals, albedo and depth are, so the noise is smoothed within surfaces but
+// not across their edges. The albedo is divided out before filtering and multiplied back in
+// afterwards, so material detail stays sharp. The filtered colors replace the sums of fb
+// (keeping the sample counts), so the frame is tone mapped as usual afterwards. The rows of each
+// pass are filtered in parallel on pool.
+void Denoise(Framebuffer& fb, const DenoiseSettings& settings, ThreadPool& pool)
+{
+    const int width = fb.Width();
+    const int height = fb.Height();
+    const size_t pixelCount = (size_t)width * height;
+    std::vector<detail::DenoiseGuide> guides(pixelCount);
+    // What the illumination is multiplied by to get the color back: the albedo, or 1 for
+    // channels the first surface absorbs
+    std::vector<color> modulations(pixelCount);
+    std::vector<detail::DenoiseValue> current(pixelCount);
+    std::vector<detail::DenoiseValue> next(pixelCount);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = (size_t)y * width + x;
+            uint32_t n = fb.SampleCount(x, y);
+            float scale = 1.f / std::max(1u, n);
+            const PixelFeatures& features = fb.Features(x, y);
+            detail::DenoiseGuide& guide = guides[p];
+            guide.Albedo = scale * features.Albedo;
+            guide.Normal = scale * features.Normal;
+            guide.Depth = scale * features.Depth;
+            color& modulation = modulations[p];
+            for (int c = 0; c < 3; c++)
+                modulation[c] = guide.Albedo[c] > 0.01f ? guide.Albedo[c] : 1.f;
+
+            color mean = scale * fb.At(x, y);
+            detail::DenoiseValue& value = current[p];
+            value.Illumination = color(mean[0] / modulation[0], mean[1] / modulation[1],
+                                       mean[2] / modulation[2]);
+            value.Luminance = Luminance(value.Illumination);
+            // Variance of the mean from the sample variance; a single sample says nothing
+            float meanLuminance = Luminance(mean);
+            float sampleVariance =
+                n > 1 ? std::max(0.f, features.LuminanceSquared * scale -
+                                          meanLuminance * meanLuminance) * n / (n - 1)
+                      : 1e30f;
+            value.Variance = sampleVariance * scale /
+                             (Luminance(modulation) * Luminance(modulation));
+        }
+    }
+
+    // B3 spline taps at offsets 0, 1 and 2
+    static const float KERNEL[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+    // 1 / the distance in taps (the larger offset), 0 at the center
+    static const float DISTANCE[3][3] = {{0.f, 1.f, 0.5f}, {1.f, 1.f, 0.5f}, {0.5f, 0.5f, 0.5f}};
+    const float normalFactor = 1.f / (settings.NormalSigma * settings.NormalSigma);
+    const float albedoFactor = 1.f / (settings.AlbedoSigma * settings.AlbedoSigma);
+    for (int pass = 0; pass < settings.Iterations; pass++) {
+        const int step = 1 << pass;
+        pool.ParallelFor(height, [&](int y, int) {
+            for (int x = 0; x < width; x++) {
+                size_t p = (size_t)y * width + x;
+                const detail::DenoiseGuide& center = guides[p];
+                const detail::DenoiseValue& centerValue = current[p];
+                const float luminanceFactor =
+                    1.f / (settings.LuminanceSigma * sqrtf(centerValue.Variance) + 1e-4f);
+                const float depthFactor =
+                    1.f / (settings.DepthSigma * center.Depth * (float)step + 1e-6f);
+                color sum(0.f);
+                float weightSum = 0.f;
+                float varianceSum = 0.f;
+                for (int dy = -2; dy <= 2; dy++) {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height)
+                        continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width)
+                            continue;
+                        size_t q = (size_t)qy * width + qx;
+                        const detail::DenoiseGuide& other = guides[q];
+                        // Rays that left the scene and rays that hit something are never mixed
+                        if ((center.Depth > 0.f) != (other.Depth > 0.f))
+                            continue;
+
+                        // Weights below e^-16 would not change the result, so the terms are added
+                        // cheapest first and the tap is dropped as soon as they exceed 16
+                        const detail::DenoiseValue& otherValue = current[q];
+                        float exponent =
+                            fabsf(otherValue.Luminance - centerValue.Luminance) * luminanceFactor +
+                            fabsf(other.Depth - center.Depth) * depthFactor *
+                                DISTANCE[abs(dx)][abs(dy)];
+                        if (exponent > 16.f)
+                            continue;
+                        vec3 normalDiff = other.Normal - center.Normal;
+                        vec3 albedoDiff = other.Albedo - center.Albedo;
+                        exponent += Dot(normalDiff, normalDiff) * normalFactor +
+                                    Dot(albedoDiff, albedoDiff) * albedoFactor;
+                        if (exponent > 16.f)
+                            continue;
+                        float weight = KERNEL[abs(dx)] * KERNEL[abs(dy)] * expf(-exponent);
+                        sum += weight * otherValue.Illumination;
+                        weightSum += weight;
+                        varianceSum += weight * weight * otherValue.Variance;
+                    }
+                }
+                // The center always counts, so weightSum is never zero
+                detail::DenoiseValue& result = next[p];
+                result.Illumination = sum / weightSum;
+                result.Luminance = Luminance(result.Illumination);
+                result.Variance = varianceSum / (weightSum * weightSum);
+            }
+        });
+        std::swap(current, next);
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = (size_t)y * width + x;
+            fb.At(x, y) =
+                (float)fb.SampleCount(x, y) * (modulations[p] * current[p].Illumination);
+        }
+    }
+}
+} // namespace rtiw
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "color.h"
+#include "denoise.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace rtiw
+{
+// Root mean square difference of the 8-bit output values of two frames of the same size, over
+// all channels
+inline double OutputRMSE(const Framebuffer& image, const Framebuffer& reference)
+{
+    double sum = 0.0;
+    for (int y = 0; y < image.Height(); y++) {
+        for (int x = 0; x < image.Width(); x++) {
+            color a = UnNormalizeColor(image.At(x, y), image.SampleCount(x, y));
+            color b = UnNormalizeColor(reference.At(x, y), reference.SampleCount(x, y));
+            for (int c = 0; c < 3; c++)
+                sum += (double)(a[c] - b[c]) * (a[c] - b[c]);
+        }
+    }
+    return sqrt(sum / (3.0 * image.Width() * image.Height()));
+}
+
+// Renders the frame at referenceSpp samples per pixel (with another seed, so its noise is
+// independent), then at 1, 2, 4, ... up to settings.SamplesPerPixel, and prints the render time
+// and error of every sample count with and without denoising. Ends with the plain sample count
+// each denoised render is as good as, which is what denoising saves.
+template <typename Scene>
+void RunDenoiseBenchmark(const Scene& world, const Camera& cam, RenderSettings settings,
+                         ThreadPool& pool, int referenceSpp, const DenoiseSettings& denoise)
+{
+    using Clock = std::chrono::high_resolution_clock;
+    auto msSince = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+
+    const int maxSpp = settings.SamplesPerPixel;
+    RenderSettings referenceSettings = settings;
+    referenceSettings.SamplesPerPixel = referenceSpp;
+    referenceSettings.Seed = settings.Seed + 1;
+    std::cout << "Rendering the reference at " << referenceSpp << " spp\n";
+    Framebuffer reference;
+    auto referenceStart = Clock::now();
+    Render(world, cam, referenceSettings, pool, reference);
+    std::cout << "Took " << msSince(referenceStart) << "ms\n\n";
+
+    struct Row
+    {
+        int Spp;
+        double RenderMS, Error, DenoiseMS, DenoisedError;
+    };
+    std::vector<Row> rows;
+    std::cout << "   spp   render ms     error   denoise ms     error\n" << std::fixed;
+    for (int spp = 1;; spp = std::min(2 * spp, maxSpp)) {
+        settings.SamplesPerPixel = spp;
+        Framebuffer fb;
+        fb.EnableFeatures(true);
+        Row row;
+        row.Spp = spp;
+        auto renderStart = Clock::now();
+        Render(world, cam, settings, pool, fb);
+        row.RenderMS = msSince(renderStart);
+        row.Error = OutputRMSE(fb, reference);
+        auto denoiseStart = Clock::now();
+        Denoise(fb, denoise, pool);
+        row.DenoiseMS = msSince(denoiseStart);
+        row.DenoisedError = OutputRMSE(fb, reference);
+        rows.push_back(row);
+
+        std::cout << std::setw(6) << spp << std::setprecision(1) << std::setw(12) << row.RenderMS
+                  << std::setprecision(2) << std::setw(10) << row.Error << std::setprecision(1)
+                  << std::setw(13) << row.DenoiseMS << std::setprecision(2) << std::setw(10)
+                  << row.DenoisedError << "\n";
+        if (spp == maxSpp)
+            break;
+    }
+
+    std::cout << "\nErrors are the RMS difference of the 8-bit output values from the reference.\n";
+    for (const Row& row : rows) {
+        auto plain = std::find_if(rows.begin(), rows.end(), [&](const Row& other) {
+            return other.Error <= row.DenoisedError;
+        });
+        std::cout << "Denoised " << row.Spp << " spp (" << std::setprecision(1)
+                  << row.RenderMS + row.DenoiseMS << "ms): ";
+        if (plain == rows.end())
+            std::cout << "better than every plain render up to " << maxSpp << " spp\n";
+        else
+            std::cout << "as good as plain " << plain->Spp << " spp (" << plain->RenderMS
+                      << "ms)\n";
+    }
+}
+} // namespace rtiw
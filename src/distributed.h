@@ -0,0 +1,939 @@
+#pragma once
+
+// Distributed rendering: a coordinator hands out tiles to worker processes over TCP or Unix
+// sockets and merges the float tiles they send back. POSIX only; main.cpp leaves it out of
+// Windows builds.
+//
+// Messages are a MessageHeader followed by Size bytes of payload, in the host's byte order, so
+// the coordinator and its workers must run the same build:
+//
+//   worker -> coordinator   Hello   protocol version and render thread count
+//   coordinator -> worker   Job     render settings and scene name, answered by loading the scene
+//   coordinator -> worker   Tile    one tile to render
+//   worker -> coordinator   Result  the tile's float sums and sample counts
+//   coordinator -> worker   Done    the frame is complete; the worker exits
+//
+// The render server (render_server.h) speaks its own messages over the same framing.
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "framebuffer.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace rtiw
+{
+// What every worker needs to render tiles of a frame. Workers load the scene themselves, so
+// scene files must exist under the same path on every worker's machine.
+struct DistributedJob
+{
+    std::string Scene;
+    int SphereCount = 0;
+    RenderSettings Settings;
+};
+
+namespace detail
+{
+const uint32_t DISTRIBUTED_PROTOCOL_VERSION = 1;
+// Larger messages are treated as a protocol error
+const uint32_t MAX_MESSAGE_SIZE = 64u << 20;
+
+enum class MessageType : uint32_t
+{
+    Hello = 1,
+    Job,
+    Tile,
+    Result,
+    Done,
+    // Render server, see render_server.h
+    Submit,
+    Accepted,
+    JobTile,
+    JobFinished,
+    JobFailed,
+    MetricsQuery,
+    Metrics,
+};
+
+struct MessageHeader
+{
+    uint32_t Type;
+    uint32_t Size;
+};
+
+struct HelloMessage
+{
+    uint32_t Version;
+    uint32_t Threads;
+};
+
+// Followed by the scene name
+struct JobMessage
+{
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t SamplesPerPixel;
+    uint32_t SampleBlockSize;
+    uint32_t MaxDepth;
+    uint32_t TileSize;
+    uint32_t Seed;
+    uint32_t Sampling;
+    uint32_t Integrator;
+    uint32_t SphereCount;
+};
+
+struct TileMessage
+{
+    uint32_t Index;
+    uint32_t X0, Y0, X1, Y1;
+};
+
+// Followed by the tile's RGB float sums and uint32 sample counts, rows top to bottom
+struct ResultMessage
+{
+    TileMessage Tile;
+    uint32_t Padding;
+    uint64_t Samples;
+    uint64_t Rays;
+};
+
+inline Tile ToTile(const TileMessage& message)
+{
+    return Tile{(int)message.X0, (int)message.Y0, (int)message.X1, (int)message.Y1};
+}
+
+inline TileMessage ToTileMessage(uint32_t index, const Tile& tile)
+{
+    return TileMessage{index, (uint32_t)tile.X0, (uint32_t)tile.Y0, (uint32_t)tile.X1,
+                       (uint32_t)tile.Y1};
+}
+
+// Bytes of the float sums and sample counts of a tile
+inline size_t TilePixelsSize(const Tile& tile)
+{
+    size_t pixels = (size_t)(tile.X1 - tile.X0) * (tile.Y1 - tile.Y0);
+    return pixels * (3 * sizeof(float) + sizeof(uint32_t));
+}
+
+// Writes the RGB float sums and then the uint32 sample counts of the tile's pixels to out, which
+// must hold TilePixelsSize(tile) bytes
+inline void PackTilePixels(const Framebuffer& fb, const Tile& tile, char* out)
+{
+    const size_t pixelCount = (size_t)(tile.X1 - tile.X0) * (tile.Y1 - tile.Y0);
+    char* sums = out;
+    char* counts = sums + pixelCount * 3 * sizeof(float);
+    size_t p = 0;
+    for (int y = tile.Y0; y < tile.Y1; y++) {
+        for (int x = tile.X0; x < tile.X1; x++, p++) {
+            float rgb[3] = {fb.At(x, y).x(), fb.At(x, y).y(), fb.At(x, y).z()};
+            uint32_t count = fb.SampleCount(x, y);
+            memcpy(sums + p * sizeof(rgb), rgb, sizeof(rgb));
+            memcpy(counts + p * sizeof(count), &count, sizeof(count));
+        }
+    }
+}
+
+// The inverse of PackTilePixels()
+inline void UnpackTilePixels(const char* in, const Tile& tile, Framebuffer& fb)
+{
+    const size_t pixelCount = (size_t)(tile.X1 - tile.X0) * (tile.Y1 - tile.Y0);
+    const char* sums = in;
+    const char* counts = sums + pixelCount * 3 * sizeof(float);
+    size_t p = 0;
+    for (int y = tile.Y0; y < tile.Y1; y++) {
+        for (int x = tile.X0; x < tile.X1; x++, p++) {
+            float rgb[3];
+            uint32_t count;
+            memcpy(rgb, sums + p * sizeof(rgb), sizeof(rgb));
+            memcpy(&count, counts + p * sizeof(count), sizeof(count));
+            fb.At(x, y) = color(rgb[0], rgb[1], rgb[2]);
+            fb.SampleCount(x, y) = count;
+        }
+    }
+}
+
+inline std::string SystemError(const std::string& what)
+{
+    return what + ": " + strerror(errno);
+}
+
+// Opens a listening or connected socket for "unix:<path>" or "<host>:<port>". An empty host
+// listens on every interface.
+inline int OpenSocket(const std::string& address, bool listening, std::string& error)
+{
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            error = "invalid socket path '" + path + "'";
+            return -1;
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error = SystemError("socket");
+            return -1;
+        }
+        if (listening)
+            unlink(path.c_str());
+        int result = listening ? bind(fd, (sockaddr*)&addr, sizeof(addr))
+                               : connect(fd, (sockaddr*)&addr, sizeof(addr));
+        if (result != 0 || (listening && listen(fd, 64) != 0)) {
+            error = SystemError(address);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        error = "address '" + address + "' is neither unix:<path> nor <host>:<port>";
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* found = nullptr;
+    int lookup = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+    if (lookup != 0) {
+        error = address + ": " + gai_strerror(lookup);
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        bool ok;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+            // Tile requests are tiny and latency bound
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (!ok) {
+            error = SystemError(address);
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+// Flags of every send(): a peer that hung up must not raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+// Blocks until size bytes are sent. Also waits out full buffers of non-blocking sockets.
+inline bool SendAll(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, p, size, SEND_FLAGS);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        p += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+inline bool RecvAll(int fd, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0) {
+        ssize_t received = recv(fd, p, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        p += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+inline bool SendMessage(int fd, MessageType type, const void* payload, size_t size)
+{
+    MessageHeader header = {(uint32_t)type, (uint32_t)size};
+    return SendAll(fd, &header, sizeof(header)) && (size == 0 || SendAll(fd, payload, size));
+}
+
+inline bool RecvMessage(int fd, MessageType& type, std::vector<char>& payload)
+{
+    MessageHeader header;
+    if (!RecvAll(fd, &header, sizeof(header)) || header.Size > MAX_MESSAGE_SIZE)
+        return false;
+    type = (MessageType)header.Type;
+    payload.resize(header.Size);
+    return RecvAll(fd, payload.data(), payload.size());
+}
+
+// (type, payload, size); returns false on a protocol error
+using MessageHandler = std::function<bool(MessageType, const char*, size_t)>;
+
+// Appends what a non-blocking socket has to input and hands every complete message to handle; a
+// partial one stays in input. Returns false if the connection closed or failed, or handle did.
+inline bool ReadMessages(int fd, std::vector<char>& input, const MessageHandler& handle)
+{
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received == 0)
+            return false;
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        input.insert(input.end(), chunk, chunk + received);
+    }
+
+    size_t pos = 0;
+    MessageHeader header;
+    while (input.size() - pos >= sizeof(header)) {
+        memcpy(&header, input.data() + pos, sizeof(header));
+        if (header.Size > MAX_MESSAGE_SIZE)
+            return false;
+        if (input.size() - pos - sizeof(header) < header.Size)
+            break;
+        if (!handle((MessageType)header.Type, input.data() + pos + sizeof(header), header.Size))
+            return false;
+        pos += sizeof(header) + header.Size;
+    }
+    input.erase(input.begin(), input.begin() + pos);
+    return true;
+}
+} // namespace detail
+
+// What one worker contributed to a distributed render
+struct WorkerReport
+{
+    std::string Name;
+    int Threads = 0;
+    // Tiles whose result went into the image
+    int TilesRendered = 0;
+    // Tiles that were also handed to another worker, which finished them first
+    int TilesWasted = 0;
+    // Disconnected before the frame was done; its unfinished tiles went to other workers
+    bool Lost = false;
+};
+
+// Hands out the tiles of a frame to the workers that connect and merges their results into a
+// framebuffer. Every worker keeps two tiles per thread in flight, so it never waits for the
+// round trip. Tiles of a worker that disconnects go back into the queue. Once the queue is empty,
+// idle workers also take copies of the tiles that have been in flight the longest, so a slow or
+// hung worker does not hold up the frame; the first result wins. Samples only depend on the
+// seed, the pixel and the sample index, so every copy of a tile is identical and the image
+// matches a single-process render exactly.
+class RenderCoordinator
+{
+  public:
+    using TileCallback = std::function<void(const Tile&, int, int)>;
+
+    RenderCoordinator() {}
+    ~RenderCoordinator() { Close(); }
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+
+    bool Listen(const std::string& address, std::string& error);
+
+    // While no worker is connected, Render() asks workersLeft whether any may still connect, and
+    // fails once it says no. Without it Render() waits for workers indefinitely.
+    void SetWorkersLeft(std::function<bool()> workersLeft)
+    {
+        m_WorkersLeft = std::move(workersLeft);
+    }
+
+    // Renders job into fb with whatever workers connect; waits for workers while there are none.
+    // onTileDone (optional) is called with every merged tile, the number of merged tiles and the
+    // total tile count.
+    bool Render(const DistributedJob& job, Framebuffer& fb, const TileCallback& onTileDone,
+                RenderStats& stats, std::string& error);
+
+    const std::vector<WorkerReport>& Workers() const { return m_Reports; }
+    // Tiles put back into the queue after their worker was lost
+    int ReassignedTiles() const { return m_Reassigned; }
+
+    void Close();
+
+  private:
+    struct Connection
+    {
+        int Socket = -1;
+        std::vector<char> Input;
+        int Threads = 0;
+        bool Ready = false;
+        std::vector<int> InFlight;
+        int Report = 0;
+    };
+
+    struct TileState
+    {
+        bool Done = false;
+        int Holders = 0;
+        std::chrono::steady_clock::time_point AssignedAt;
+    };
+
+    void Accept();
+    bool ReadFrom(Connection& conn);
+    bool HandleMessage(Connection& conn, detail::MessageType type, const char* payload,
+                       size_t size);
+    bool MergeResult(Connection& conn, const char* payload, size_t size);
+    bool Assign(Connection& conn);
+    int NextTile(const Connection& conn);
+    void Drop(Connection& conn);
+
+    std::string m_Address;
+    int m_Listener = -1;
+    std::vector<Connection> m_Connections;
+    std::vector<WorkerReport> m_Reports;
+    int m_Reassigned = 0;
+    std::function<bool()> m_WorkersLeft;
+
+    // State of the frame being rendered
+    const DistributedJob* m_Job = nullptr;
+    Framebuffer* m_Framebuffer = nullptr;
+    const TileCallback* m_OnTileDone = nullptr;
+    RenderStats* m_Stats = nullptr;
+    std::vector<Tile> m_Tiles;
+    std::vector<TileState> m_TileStates;
+    std::deque<int> m_Pending;
+    int m_TilesDone = 0;
+};
+
+bool RenderCoordinator::Listen(const std::string& address, std::string& error)
+{
+    Close();
+    m_Listener = detail::OpenSocket(address, true, error);
+    if (m_Listener < 0)
+        return false;
+    fcntl(m_Listener, F_SETFL, fcntl(m_Listener, F_GETFL) | O_NONBLOCK);
+    m_Address = address;
+    return true;
+}
+
+void RenderCoordinator::Close()
+{
+    for (Connection& conn : m_Connections)
+        close(conn.Socket);
+    m_Connections.clear();
+    if (m_Listener >= 0) {
+        close(m_Listener);
+        m_Listener = -1;
+        if (m_Address.compare(0, 5, "unix:") == 0)
+            unlink(m_Address.c_str() + 5);
+    }
+}
+
+bool RenderCoordinator::Render(const DistributedJob& job, Framebuffer& fb,
+                               const TileCallback& onTileDone, RenderStats& stats,
+                               std::string& error)
+{
+    const RenderSettings& settings = job.Settings;
+    fb.Resize(settings.ImageWidth, settings.ImageHeight);
+    stats = RenderStats();
+    m_Job = &job;
+    m_Framebuffer = &fb;
+    m_OnTileDone = &onTileDone;
+    m_Stats = &stats;
+    m_Tiles = MakeTiles(settings.ImageWidth, settings.ImageHeight, settings.TileSize);
+    m_TileStates.assign(m_Tiles.size(), TileState());
+    m_Pending.clear();
+    for (int t = 0; t < (int)m_Tiles.size(); t++)
+        m_Pending.push_back(t);
+    m_TilesDone = 0;
+
+    bool waitingShown = false;
+    std::vector<pollfd> fds;
+    while (m_TilesDone < (int)m_Tiles.size()) {
+        if (m_Connections.empty() && m_WorkersLeft && !m_WorkersLeft()) {
+            error = "no workers left, " + std::to_string(m_Tiles.size() - m_TilesDone) +
+                    " tiles unrendered";
+            return false;
+        }
+        if (m_Connections.empty() && !waitingShown) {
+            std::cout << "\nWaiting for workers on " << m_Address << "\n";
+            waitingShown = true;
+        }
+
+        fds.assign(1, pollfd{m_Listener, POLLIN, 0});
+        for (const Connection& conn : m_Connections)
+            fds.push_back(pollfd{conn.Socket, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+            error = detail::SystemError("poll");
+            return false;
+        }
+
+        // Connections accepted now are polled in the next round
+        size_t polled = m_Connections.size();
+        if (fds[0].revents & POLLIN)
+            Accept();
+        for (size_t c = 0; c < polled; c++) {
+            Connection& conn = m_Connections[c];
+            if ((fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !ReadFrom(conn))
+                Drop(conn);
+        }
+        for (Connection& conn : m_Connections) {
+            if (conn.Socket >= 0 && conn.Ready && !Assign(conn))
+                Drop(conn);
+        }
+        m_Connections.erase(std::remove_if(m_Connections.begin(), m_Connections.end(),
+                                           [](const Connection& c) { return c.Socket < 0; }),
+                            m_Connections.end());
+        if (!m_Connections.empty())
+            waitingShown = false;
+    }
+
+    // Workers may still be rendering copies of tiles. They get a moment to send those and read
+    // Done, so they do not run into a reset connection.
+    for (Connection& conn : m_Connections) {
+        detail::SendMessage(conn.Socket, detail::MessageType::Done, nullptr, 0);
+        shutdown(conn.Socket, SHUT_WR);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!m_Connections.empty() && std::chrono::steady_clock::now() < deadline) {
+        fds.clear();
+        for (const Connection& conn : m_Connections)
+            fds.push_back(pollfd{conn.Socket, POLLIN, 0});
+        poll(fds.data(), fds.size(), 100);
+        for (size_t c = 0; c < fds.size(); c++) {
+            if (!(fds[c].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            char discard[1 << 16];
+            ssize_t received = recv(fds[c].fd, discard, sizeof(discard), 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(fds[c].fd);
+                m_Connections[c].Socket = -1;
+            }
+        }
+        m_Connections.erase(std::remove_if(m_Connections.begin(), m_Connections.end(),
+                                           [](const Connection& c) { return c.Socket < 0; }),
+                            m_Connections.end());
+    }
+    for (Connection& conn : m_Connections)
+        close(conn.Socket);
+    m_Connections.clear();
+    return true;
+}
+
+void RenderCoordinator::Accept()
+{
+    for (;;) {
+        int fd = accept(m_Listener, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Connection conn;
+        conn.Socket = fd;
+        conn.Report = (int)m_Reports.size();
+        m_Reports.emplace_back();
+        m_Reports.back().Name = "worker " + std::to_string(conn.Report + 1);
+        m_Connections.push_back(std::move(conn));
+    }
+}
+
+bool RenderCoordinator::ReadFrom(Connection& conn)
+{
+    return detail::ReadMessages(conn.Socket, conn.Input,
+                                [&](detail::MessageType type, const char* payload, size_t size) {
+                                    return HandleMessage(conn, type, payload, size);
+                                });
+}
+
+bool RenderCoordinator::HandleMessage(Connection& conn, detail::MessageType type,
+                                      const char* payload, size_t size)
+{
+    if (type == detail::MessageType::Result && conn.Ready)
+        return MergeResult(conn, payload, size);
+    if (type != detail::MessageType::Hello || conn.Ready || size != sizeof(detail::HelloMessage))
+        return false;
+
+    detail::HelloMessage hello;
+    memcpy(&hello, payload, sizeof(hello));
+    if (hello.Version != detail::DISTRIBUTED_PROTOCOL_VERSION || hello.Threads == 0)
+        return false;
+    conn.Threads = (int)hello.Threads;
+    m_Reports[conn.Report].Threads = conn.Threads;
+
+    const RenderSettings& settings = m_Job->Settings;
+    detail::JobMessage job;
+    job.Width = (uint32_t)settings.ImageWidth;
+    job.Height = (uint32_t)settings.ImageHeight;
+    job.SamplesPerPixel = (uint32_t)settings.SamplesPerPixel;
+    job.SampleBlockSize = (uint32_t)settings.SampleBlockSize;
+    job.MaxDepth = (uint32_t)settings.MaxDepth;
+    job.TileSize = (uint32_t)settings.TileSize;
+    job.Seed = settings.Seed;
+    job.Sampling = (uint32_t)settings.Sampling;
+    job.Integrator = (uint32_t)settings.Integrator;
+    job.SphereCount = (uint32_t)m_Job->SphereCount;
+    std::vector<char> message(sizeof(job) + m_Job->Scene.size());
+    memcpy(message.data(), &job, sizeof(job));
+    memcpy(message.data() + sizeof(job), m_Job->Scene.data(), m_Job->Scene.size());
+    conn.Ready = true;
+    return detail::SendMessage(conn.Socket, detail::MessageType::Job, message.data(),
+                               message.size());
+}
+
+bool RenderCoordinator::MergeResult(Connection& conn, const char* payload, size_t size)
+{
+    detail::ResultMessage result;
+    if (size < sizeof(result))
+        return false;
+    memcpy(&result, payload, sizeof(result));
+    auto inFlight = std::find(conn.InFlight.begin(), conn.InFlight.end(), (int)result.Tile.Index);
+    if (inFlight == conn.InFlight.end() || result.Tile.Index >= m_Tiles.size())
+        return false;
+    const Tile& tile = m_Tiles[result.Tile.Index];
+    if (size != sizeof(result) + detail::TilePixelsSize(tile))
+        return false;
+    if (result.Tile.X0 != (uint32_t)tile.X0 || result.Tile.Y0 != (uint32_t)tile.Y0 ||
+        result.Tile.X1 != (uint32_t)tile.X1 || result.Tile.Y1 != (uint32_t)tile.Y1)
+        return false;
+
+    conn.InFlight.erase(inFlight);
+    TileState& state = m_TileStates[result.Tile.Index];
+    state.Holders--;
+    WorkerReport& report = m_Reports[conn.Report];
+    if (state.Done) {
+        report.TilesWasted++;
+        return true;
+    }
+
+    detail::UnpackTilePixels(payload + sizeof(result), tile, *m_Framebuffer);
+    state.Done = true;
+    m_TilesDone++;
+    report.TilesRendered++;
+    m_Stats->Samples += result.Samples;
+    m_Stats->Rays += result.Rays;
+    if (*m_OnTileDone)
+        (*m_OnTileDone)(tile, m_TilesDone, (int)m_Tiles.size());
+    return true;
+}
+
+bool RenderCoordinator::Assign(Connection& conn)
+{
+    const size_t capacity = (size_t)std::max(2, 2 * conn.Threads);
+    while (conn.InFlight.size() < capacity) {
+        int t = NextTile(conn);
+        if (t < 0)
+            break;
+        const Tile& tile = m_Tiles[t];
+        detail::TileMessage message = detail::ToTileMessage((uint32_t)t, tile);
+        if (!detail::SendMessage(conn.Socket, detail::MessageType::Tile, &message,
+                                 sizeof(message)))
+            return false;
+        TileState& state = m_TileStates[t];
+        if (state.Holders++ == 0)
+            state.AssignedAt = std::chrono::steady_clock::now();
+        conn.InFlight.push_back(t);
+    }
+    return true;
+}
+
+int RenderCoordinator::NextTile(const Connection& conn)
+{
+    while (!m_Pending.empty()) {
+        int t = m_Pending.front();
+        m_Pending.pop_front();
+        if (!m_TileStates[t].Done)
+            return t;
+    }
+
+    // Nothing left to hand out: back up the tile that has been in flight the longest
+    int oldest = -1;
+    for (int t = 0; t < (int)m_TileStates.size(); t++) {
+        const TileState& state = m_TileStates[t];
+        if (state.Done || state.Holders != 1 ||
+            std::find(conn.InFlight.begin(), conn.InFlight.end(), t) != conn.InFlight.end())
+            continue;
+        if (oldest < 0 || state.AssignedAt < m_TileStates[oldest].AssignedAt)
+            oldest = t;
+    }
+    return oldest;
+}
+
+void RenderCoordinator::Drop(Connection& conn)
+{
+    if (conn.Socket < 0)
+        return;
+    close(conn.Socket);
+    conn.Socket = -1;
+    if (m_TilesDone < (int)m_Tiles.size())
+        m_Reports[conn.Report].Lost = true;
+    for (int t : conn.InFlight) {
+        TileState& state = m_TileStates[t];
+        if (--state.Holders == 0 && !state.Done) {
+            m_Pending.push_front(t);
+            m_Reassigned++;
+        }
+    }
+    conn.InFlight.clear();
+}
+
+// Loads the scene of a job into its compiled form and sets up the camera
+using WorkerSceneLoader =
+    std::function<bool(const DistributedJob&, CompiledScene&, Camera&, std::string&)>;
+
+namespace detail
+{
+// Worker side of a connection to the coordinator, see RunWorker()
+bool ServeCoordinator(int fd, const std::string& address, ThreadPool& pool,
+                      const WorkerSceneLoader& loadScene, std::string& error)
+{
+    HelloMessage hello = {DISTRIBUTED_PROTOCOL_VERSION, (uint32_t)pool.NumThreads()};
+    MessageType type;
+    std::vector<char> payload;
+    if (!SendMessage(fd, MessageType::Hello, &hello, sizeof(hello)) ||
+        !RecvMessage(fd, type, payload)) {
+        error = "lost the connection to " + address;
+        return false;
+    }
+    if (type != MessageType::Job || payload.size() < sizeof(JobMessage)) {
+        error = "unexpected message from " + address;
+        return false;
+    }
+
+    JobMessage message;
+    memcpy(&message, payload.data(), sizeof(message));
+    DistributedJob job;
+    job.Scene.assign(payload.data() + sizeof(message), payload.size() - sizeof(message));
+    job.SphereCount = (int)message.SphereCount;
+    RenderSettings& settings = job.Settings;
+    settings.ImageWidth = (int)message.Width;
+    settings.ImageHeight = (int)message.Height;
+    settings.SamplesPerPixel = (int)message.SamplesPerPixel;
+    settings.SampleBlockSize = (int)message.SampleBlockSize;
+    settings.MaxDepth = (int)message.MaxDepth;
+    settings.TileSize = (int)message.TileSize;
+    settings.Seed = message.Seed;
+    settings.Sampling = (SamplerType)message.Sampling;
+    settings.Integrator = (IntegratorType)message.Integrator;
+
+    CompiledScene world;
+    Camera cam;
+    if (!loadScene(job, world, cam, error))
+        return false;
+
+    Framebuffer fb(settings.ImageWidth, settings.ImageHeight);
+
+    // A reader thread queues tiles as they arrive, so render threads that finish early pick up
+    // the next tile straight away instead of waiting for the rest of a batch
+    std::mutex queueMutex;
+    std::condition_variable queueCV;
+    std::deque<TileMessage> queue;
+    bool closed = false;
+    bool done = false;
+    std::thread reader([&] {
+        MessageType readType;
+        std::vector<char> readPayload;
+        std::string readError;
+        for (;;) {
+            if (!RecvMessage(fd, readType, readPayload)) {
+                readError = "lost the connection to " + address;
+                break;
+            }
+            if (readType == MessageType::Done)
+                break;
+            TileMessage tile;
+            if (readType != MessageType::Tile || readPayload.size() != sizeof(tile)) {
+                readError = "unexpected message from " + address;
+                break;
+            }
+            memcpy(&tile, readPayload.data(), sizeof(tile));
+            if (tile.X0 >= tile.X1 || tile.Y0 >= tile.Y1 || tile.X1 > message.Width ||
+                tile.Y1 > message.Height) {
+                readError = "invalid tile from " + address;
+                break;
+            }
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queue.push_back(tile);
+            queueCV.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(queueMutex);
+        closed = true;
+        done = readError.empty();
+        error = readError;
+        queueCV.notify_all();
+    });
+
+    std::mutex sendMutex;
+    std::atomic<bool> sendFailed{false};
+    pool.ParallelFor(pool.NumThreads(), [&](int, int) {
+        for (;;) {
+            TileMessage tileMessage;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCV.wait(lock, [&] { return closed || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                tileMessage = queue.front();
+                queue.pop_front();
+            }
+            // Fine if the coordinator finished the frame without these tiles, the reader
+            // still waits for it to say so
+            if (sendFailed)
+                continue;
+
+            Tile tile = ToTile(tileMessage);
+            for (int y = tile.Y0; y < tile.Y1; y++) {
+                for (int x = tile.X0; x < tile.X1; x++) {
+                    fb.At(x, y) = color(0.f);
+                    fb.SampleCount(x, y) = 0;
+                }
+            }
+            RenderStats stats;
+            if (settings.Integrator == IntegratorType::Wavefront)
+                RenderTileWavefront(world, cam, settings, tile, fb, stats);
+            else
+                RenderTile(world, cam, settings, tile, fb, stats);
+
+            ResultMessage result = {tileMessage, 0, stats.Samples, stats.Rays};
+            std::vector<char> data(sizeof(result) + TilePixelsSize(tile));
+            memcpy(data.data(), &result, sizeof(result));
+            PackTilePixels(fb, tile, data.data() + sizeof(result));
+
+            std::lock_guard<std::mutex> lock(sendMutex);
+            if (!SendMessage(fd, MessageType::Result, data.data(), data.size()))
+                sendFailed = true;
+        }
+    });
+    reader.join();
+    return done;
+}
+} // namespace detail
+
+// Connects to the coordinator at address (retrying for a few seconds, so workers may start
+// first), loads the scene of its job and renders the tiles it hands out on every thread of pool
+// until the frame is done. Returns false and describes the problem in error if the connection
+// fails or is lost.
+bool RunWorker(const std::string& address, ThreadPool& pool, const WorkerSceneLoader& loadScene,
+               std::string& error)
+{
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && fd < 0; attempt++) {
+        fd = detail::OpenSocket(address, false, error);
+        if (fd < 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    if (fd < 0)
+        return false;
+    bool ok = detail::ServeCoordinator(fd, address, pool, loadScene, error);
+    close(fd);
+    return ok;
+}
+
+// Worker processes started on this machine, running the renderer's own executable with
+// --worker <address>
+class LocalWorkers
+{
+  public:
+    LocalWorkers() {}
+    ~LocalWorkers() { Wait(); }
+    LocalWorkers(const LocalWorkers&) = delete;
+    LocalWorkers& operator=(const LocalWorkers&) = delete;
+
+    bool Start(const std::string& program, const std::string& address, int count,
+               int threadsEach, std::string& error);
+
+    // Waits for every worker to exit
+    void Wait();
+    // Reaps the workers that exited and returns how many still run
+    int Running();
+
+    const std::vector<pid_t>& Pids() const { return m_Pids; }
+
+  private:
+    std::vector<pid_t> m_Pids;
+};
+
+bool LocalWorkers::Start(const std::string& program, const std::string& address, int count,
+                         int threadsEach, std::string& error)
+{
+    std::string threads = std::to_string(threadsEach);
+    for (int w = 0; w < count; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            error = detail::SystemError("fork");
+            return false;
+        }
+        if (pid == 0) {
+            const char* args[] = {program.c_str(), "--worker", address.c_str(),
+                                  "--threads",     threads.c_str(), nullptr};
+            execvp(program.c_str(), (char* const*)args);
+            _exit(127);
+        }
+        m_Pids.push_back(pid);
+    }
+    return true;
+}
+
+void LocalWorkers::Wait()
+{
+    for (pid_t pid : m_Pids)
+        waitpid(pid, nullptr, 0);
+    m_Pids.clear();
+}
+
+int LocalWorkers::Running()
+{
+    m_Pids.erase(std::remove_if(m_Pids.begin(), m_Pids.end(),
+                                [](pid_t pid) { return waitpid(pid, nullptr, WNOHANG) == pid; }),
+                 m_Pids.end());
+    return (int)m_Pids.size();
+}
+} // namespace rtiw
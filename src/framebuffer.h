@@ -0,0 +1,95 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace rtiw
+{
+inline float Luminance(const color& c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+
+// What the camera ray of a sample hit first: the surface's albedo (the attenuation of its first
+// scatter, or the background color for rays that leave the scene), its normal and its distance
+// from the camera (0 for rays that leave the scene). Framebuffers sum them like the samples.
+struct PixelFeatures
+{
+    color Albedo;
+    vec3 Normal;
+    float Depth = 0.f;
+    // The squared luminance of the sample, for the variance of the pixel
+    float LuminanceSquared = 0.f;
+
+    PixelFeatures& operator+=(const PixelFeatures& other)
+    {
+        Albedo += other.Albedo;
+        Normal += other.Normal;
+        Depth += other.Depth;
+        LuminanceSquared += other.LuminanceSquared;
+        return *this;
+    }
+};
+
+// Float image shared by all render threads. Every pixel holds the sum of its samples and how many
+// samples were taken (adaptive sampling takes a different number per pixel); tone mapping
+// happens once the frame is done. Rows are stored top to bottom (PPM order).
+class Framebuffer
+{
+  public:
+    Framebuffer() {}
+    Framebuffer(int width, int height) { Resize(width, height); }
+
+    void Resize(int width, int height)
+    {
+        m_Width = width;
+        m_Height = height;
+        m_Pixels.assign((size_t)width * height, color(0.f));
+        m_SampleCounts.assign((size_t)width * height, 0);
+        m_Features.assign(m_FeaturesEnabled ? (size_t)width * height : 0, PixelFeatures());
+    }
+
+    void Clear()
+    {
+        std::fill(m_Pixels.begin(), m_Pixels.end(), color(0.f));
+        std::fill(m_SampleCounts.begin(), m_SampleCounts.end(), 0);
+        std::fill(m_Features.begin(), m_Features.end(), PixelFeatures());
+    }
+
+    // Renders into framebuffers with features enabled also sum the first-hit features of every
+    // sample, which guide the denoiser. Off by default, since they take twice the memory of the
+    // pixels.
+    void EnableFeatures(bool enable)
+    {
+        m_FeaturesEnabled = enable;
+        m_Features.assign(enable ? m_Pixels.size() : 0, PixelFeatures());
+    }
+    bool HasFeatures() const { return m_FeaturesEnabled; }
+
+    int Width() const { return m_Width; }
+    int Height() const { return m_Height; }
+
+    color& At(int x, int y) { return m_Pixels[(size_t)y * m_Width + x]; }
+    const color& At(int x, int y) const { return m_Pixels[(size_t)y * m_Width + x]; }
+
+    uint32_t& SampleCount(int x, int y) { return m_SampleCounts[(size_t)y * m_Width + x]; }
+    uint32_t SampleCount(int x, int y) const { return m_SampleCounts[(size_t)y * m_Width + x]; }
+
+    PixelFeatures& Features(int x, int y) { return m_Features[(size_t)y * m_Width + x]; }
+    const PixelFeatures& Features(int x, int y) const
+    {
+        return m_Features[(size_t)y * m_Width + x];
+    }
+
+    const std::vector<color>& Pixels() const { return m_Pixels; }
+    const std::vector<uint32_t>& SampleCounts() const { return m_SampleCounts; }
+
+  private:
+    int m_Width = 0;
+    int m_Height = 0;
+    std::vector<color> m_Pixels;
+    std::vector<uint32_t> m_SampleCounts;
+    bool m_FeaturesEnabled = false;
+    std::vector<PixelFeatures> m_Features;
+};
+} // namespace rtiw
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace rtiw
+{
+// Maps t in [0, 1] to a black - blue - red - yellow - white ramp
+inline color HeatmapColor(float t)
+{
+    static const color STOPS[] = {color(0.f), color(0.1f, 0.1f, 0.8f), color(0.9f, 0.1f, 0.1f),
+                                  color(1.f, 0.9f, 0.1f), color(1.f)};
+    const int segments = (int)(sizeof(STOPS) / sizeof(STOPS[0])) - 1;
+
+    float x = Clamp(t, 0.f, 1.f) * segments;
+    int k = std::min((int)x, segments - 1);
+    float f = x - k;
+    return (1.f - f) * STOPS[k] + f * STOPS[k + 1];
+}
+
+// Writes one value per pixel (rows top to bottom) as a PPM heatmap scaled to the largest value.
+// Returns false if the file cannot be written.
+inline bool WriteHeatmap(const std::string& filename, int width, int height,
+                         const std::vector<float>& values)
+{
+    std::ofstream out(filename);
+    if (!out)
+        return false;
+
+    float maxValue = 0.f;
+    for (float v : values)
+        maxValue = std::max(maxValue, v);
+    float scale = maxValue > 0.f ? 1.f / maxValue : 0.f;
+
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (size_t p = 0; p < (size_t)width * height; p++) {
+        color c = HeatmapColor(values[p] * scale);
+        out << (int)(255.999f * c.x()) << ' ' << (int)(255.999f * c.y()) << ' '
+            << (int)(255.999f * c.z()) << '\n';
+    }
+    return (bool)out;
+}
+} // namespace rtiw
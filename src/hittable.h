@@ -1,5 +1,6 @@
 #pragma once
 
+#include "aabb.h"
 #include "ray.h"
 #include "rtweekend.h"
 
@@ -11,7 +12,11 @@ struct HitRecord
 {
     point3 HitPoint;
     vec3 Normal;
-    std::shared_ptr<Material> Mat_Ptr;
+    // Raw pointer: the scene owns its materials, and copying a shared_ptr here would mean atomic
+    // refcount traffic on every hit
+    const Material* Mat_Ptr = nullptr;
+    // Index into the material table of a CompiledScene
+    uint32_t MaterialId = 0;
     float t;
     bool FrontFace;
 
@@ -26,5 +31,7 @@ class Hittable
 {
   public:
     virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const = 0;
+    // Returns false if the object has no finite bounds
+    virtual bool BoundingBox(AABB& outputBox) const = 0;
 };
 } // namespace rtiw
\ No newline at end of file
@@ -16,7 +16,10 @@ class HittableList : public Hittable
     void Clear() { m_Objects.clear(); }
     void Add(std::shared_ptr<Hittable> object) { m_Objects.push_back(object); }
 
+    const std::vector<std::shared_ptr<Hittable>>& Objects() const { return m_Objects; }
+
     virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const override;
+    virtual bool BoundingBox(AABB& outputBox) const override;
 
   private:
     std::vector<std::shared_ptr<Hittable>> m_Objects;
@@ -38,4 +41,19 @@ bool HittableList::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) con
 
     return hitAnything;
 }
+
+bool HittableList::BoundingBox(AABB& outputBox) const
+{
+    if (m_Objects.empty())
+        return false;
+
+    AABB tempBox;
+    outputBox = AABB();
+    for (const auto& object : m_Objects) {
+        if (!object->BoundingBox(tempBox))
+            return false;
+        outputBox.Expand(tempBox);
+    }
+    return true;
+}
 } // namespace rtiw
\ No newline at end of file
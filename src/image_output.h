@@ -0,0 +1,196 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "mapped_file.h"
+#include "render_settings.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace rtiw
+{
+// Output stage of a render. Finished tiles are handed over with TileDone() and encoded by a
+// background thread while the render threads move on, straight into the final file image: a
+// heap buffer written with one fwrite() at the end, or with useMmap the memory-mapped file
+// itself. Formats whose size depends on the pixels (P3 text) are encoded in Finish() instead.
+class ImageOutput
+{
+  public:
+    ImageOutput() {}
+    ~ImageOutput()
+    {
+        StopWriter();
+        if (m_File)
+            fclose(m_File);
+    }
+    ImageOutput(const ImageOutput&) = delete;
+    ImageOutput& operator=(const ImageOutput&) = delete;
+
+    // Creates the file and, for fixed-size formats, starts the writer thread. Returns false and
+    // describes the problem in error on failure.
+    bool Open(const std::string& filename, ImageFormat format, bool useMmap, int width,
+              int height, std::string& error);
+
+    // Queues the pixels of tile for encoding. They must not change afterwards; tiles that are
+    // rendered again (adaptive passes) are handed over once all passes are done. Thread-safe.
+    void TileDone(const Framebuffer& fb, const Tile& tile);
+
+    // Waits for the queued tiles, encodes what is left and completes the file
+    bool Finish(const Framebuffer& fb, std::string& error);
+
+  private:
+    void WriterLoop();
+    void StopWriter();
+
+    std::unique_ptr<ImageWriter> m_Writer;
+    std::string m_Filename;
+    FILE* m_File = nullptr;
+    MappedFile m_Mapped;
+    std::vector<uint8_t> m_Buffer;
+    uint8_t* m_Image = nullptr;
+
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::condition_variable m_QueueChanged;
+    std::deque<std::pair<const Framebuffer*, Tile>> m_Queue;
+    bool m_Stop = false;
+};
+
+bool ImageOutput::Open(const std::string& filename, ImageFormat format, bool useMmap, int width,
+                       int height, std::string& error)
+{
+    m_Writer = MakeImageWriter(format);
+    m_Filename = filename;
+    size_t size = m_Writer->FileSize(width, height);
+
+    if (useMmap) {
+        if (size == 0) {
+            error = "memory-mapped output needs a binary format";
+            return false;
+        }
+        if (!m_Mapped.Create(filename, size)) {
+            error = "cannot map " + filename;
+            return false;
+        }
+        m_Image = m_Mapped.Data();
+    } else {
+        m_File = fopen(filename.c_str(), "wb");
+        if (!m_File) {
+            error = "cannot open " + filename;
+            return false;
+        }
+        m_Buffer.resize(size);
+        m_Image = m_Buffer.data();
+    }
+
+    if (size > 0) {
+        m_Writer->WriteHeader(width, height, m_Image);
+        m_Thread = std::thread(&ImageOutput::WriterLoop, this);
+    }
+    return true;
+}
+
+void ImageOutput::TileDone(const Framebuffer& fb, const Tile& tile)
+{
+    if (!m_Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Queue.push_back({&fb, tile});
+    }
+    m_QueueChanged.notify_one();
+}
+
+void ImageOutput::WriterLoop()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;) {
+        m_QueueChanged.wait(lock, [&] { return m_Stop || !m_Queue.empty(); });
+        if (m_Queue.empty())
+            return;
+        auto [fb, tile] = m_Queue.front();
+        m_Queue.pop_front();
+
+        lock.unlock();
+        m_Writer->EncodeTile(*fb, tile, m_Image);
+        lock.lock();
+    }
+}
+
+void ImageOutput::StopWriter()
+{
+    if (!m_Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_QueueChanged.notify_one();
+    m_Thread.join();
+}
+
+bool ImageOutput::Finish(const Framebuffer& fb, std::string& error)
+{
+    // The writer drains the queue before it stops
+    StopWriter();
+
+    bool ok = true;
+    if (m_Mapped.Data()) {
+        m_Mapped.Close();
+    } else if (m_File) {
+        if (m_Buffer.empty()) {
+            std::string encoded;
+            m_Writer->Encode(fb, encoded);
+            ok = fwrite(encoded.data(), 1, encoded.size(), m_File) == encoded.size();
+        } else {
+            ok = fwrite(m_Buffer.data(), 1, m_Buffer.size(), m_File) == m_Buffer.size();
+        }
+        ok = fclose(m_File) == 0 && ok;
+        m_File = nullptr;
+    }
+    if (!ok)
+        error = "cannot write " + m_Filename;
+    return ok;
+}
+
+// Writes the mean first-hit albedo, normal and depth of fb, which must have features enabled, as
+// three images named after path with _albedo, _normal and _depth added. PFM and EXR keep the
+// values as they are; PPM clamps them to [0, 1] and applies the usual gamma. Returns false and
+// describes the problem in error on failure.
+bool WriteFeatureImages(const std::string& path, ImageFormat format, const Framebuffer& fb,
+                        std::string& error)
+{
+    const char* SUFFIXES[] = {"_albedo", "_normal", "_depth"};
+    Framebuffer image(fb.Width(), fb.Height());
+    for (int layer = 0; layer < 3; layer++) {
+        for (int y = 0; y < fb.Height(); y++) {
+            for (int x = 0; x < fb.Width(); x++) {
+                const PixelFeatures& features = fb.Features(x, y);
+                float scale = 1.f / std::max(1u, fb.SampleCount(x, y));
+                color value = layer == 0   ? features.Albedo
+                              : layer == 1 ? features.Normal
+                                           : color(features.Depth);
+                image.At(x, y) = scale * value;
+                image.SampleCount(x, y) = 1;
+            }
+        }
+        ImageOutput output;
+        if (!output.Open(PathWithSuffix(path, SUFFIXES[layer]), format, false, fb.Width(),
+                         fb.Height(), error))
+            return false;
+        output.TileDone(image, Tile{0, 0, fb.Width(), fb.Height()});
+        if (!output.Finish(image, error))
+            return false;
+    }
+    return true;
+}
+} // namespace rtiw
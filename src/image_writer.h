@@ -0,0 +1,384 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "framebuffer.h"
+#include "render_settings.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace rtiw
+{
+enum class ImageFormat
+{
+    // ASCII PPM, the original output
+    PPMText,
+    // Binary PPM, same 8-bit values as PPMText
+    PPM,
+    // Portable float map, linear 32-bit float RGB
+    PFM,
+    // Uncompressed scanline OpenEXR, linear half-float RGB
+    EXR,
+};
+
+inline bool ParseImageFormat(const std::string& name, ImageFormat& format)
+{
+    if (name == "p3")
+        format = ImageFormat::PPMText;
+    else if (name == "p6")
+        format = ImageFormat::PPM;
+    else if (name == "pfm")
+        format = ImageFormat::PFM;
+    else if (name == "exr")
+        format = ImageFormat::EXR;
+    else
+        return false;
+    return true;
+}
+
+// Picks the format from the file extension, binary PPM for anything unknown
+inline ImageFormat ImageFormatFromFilename(const std::string& filename)
+{
+    auto endsWith = [&](const char* ext) {
+        size_t n = strlen(ext);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".pfm"))
+        return ImageFormat::PFM;
+    if (endsWith(".exr"))
+        return ImageFormat::EXR;
+    return ImageFormat::PPM;
+}
+
+// Inserts suffix before the extension of path: "out.ppm" becomes "out<suffix>.ppm"
+inline std::string PathWithSuffix(const std::string& path, const std::string& suffix)
+{
+    size_t slash = path.find_last_of("/\\");
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + suffix;
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// Rounds a float to the nearest IEEE half, ties to even
+inline uint16_t FloatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t absX = x & 0x7fffffff;
+
+    // Inf and NaN (kept quiet)
+    if (absX >= 0x7f800000)
+        return (uint16_t)(sign | 0x7c00 | (absX > 0x7f800000 ? 0x200 : 0));
+    // Rounds to 65520 or more
+    if (absX >= 0x477ff000)
+        return (uint16_t)(sign | 0x7c00);
+    // Denormal halves, in units of 2^-24
+    if (absX < 0x38800000) {
+        uint32_t exponent = absX >> 23;
+        if (exponent < 102)
+            return (uint16_t)sign;
+        uint32_t mantissa = (absX & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - exponent;
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            h++;
+        return (uint16_t)(sign | h);
+    }
+    // Normal halves: rebias the exponent from 127 to 15 and drop 13 mantissa bits
+    uint32_t h = (absX - 0x38000000) >> 13;
+    uint32_t rest = absX & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return (uint16_t)(sign | h);
+}
+
+namespace detail
+{
+// File formats are little endian regardless of the host
+inline uint8_t* PutLE16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+inline uint8_t* PutLE32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+    return p + 4;
+}
+
+inline uint8_t* PutLE64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+    return p + 8;
+}
+
+inline uint8_t* PutFloat(uint8_t* p, float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return PutLE32(p, bits);
+}
+
+// Mean of a framebuffer pixel, the linear value HDR formats store
+inline color PixelMean(const Framebuffer& fb, int x, int y)
+{
+    float scale = 1.f / fb.SampleCount(x, y);
+    return scale * fb.At(x, y);
+}
+} // namespace detail
+
+// Encodes a framebuffer into one file format. Formats whose size only depends on the resolution
+// (FileSize() > 0) are encoded tile by tile straight into the file image, so tiles can be encoded
+// while others still render; the others are encoded in one go by Encode().
+class ImageWriter
+{
+  public:
+    virtual ~ImageWriter() = default;
+
+    // Size of the whole file, or 0 if it depends on the pixel values
+    virtual size_t FileSize(int width, int height) const = 0;
+
+    // Fixed-size formats: writes everything that does not depend on the pixels
+    virtual void WriteHeader(int /*width*/, int /*height*/, uint8_t* /*file*/) const {}
+
+    // Fixed-size formats: encodes the pixels of tile at their place in the file image
+    virtual void EncodeTile(const Framebuffer& /*fb*/, const Tile& /*tile*/,
+                            uint8_t* /*file*/) const
+    {
+    }
+
+    // Variable-size formats: encodes the whole file
+    virtual void Encode(const Framebuffer& /*fb*/, std::string& /*out*/) const {}
+};
+
+// P3 text, byte for byte what WriteColor() produced
+class PPMTextWriter : public ImageWriter
+{
+  public:
+    virtual size_t FileSize(int, int) const override { return 0; }
+
+    virtual void Encode(const Framebuffer& fb, std::string& out) const override
+    {
+        out = "P3\n" + std::to_string(fb.Width()) + ' ' + std::to_string(fb.Height()) + "\n255\n";
+        // At most "255 255 255\n" per pixel
+        out.reserve(out.size() + (size_t)fb.Width() * fb.Height() * 12);
+        for (int y = 0; y < fb.Height(); y++) {
+            for (int x = 0; x < fb.Width(); x++) {
+                color c = UnNormalizeColor(fb.At(x, y), fb.SampleCount(x, y));
+                for (int k = 0; k < 3; k++) {
+                    AppendLevel(out, (int)c[k]);
+                    out += k < 2 ? ' ' : '\n';
+                }
+            }
+        }
+    }
+
+  private:
+    static void AppendLevel(std::string& out, int v)
+    {
+        if (v >= 100)
+            out += (char)('0' + v / 100);
+        if (v >= 10)
+            out += (char)('0' + v / 10 % 10);
+        out += (char)('0' + v % 10);
+    }
+};
+
+// P6 binary PPM with the same tone mapping as the text version
+class PPMWriter : public ImageWriter
+{
+  public:
+    virtual size_t FileSize(int width, int height) const override
+    {
+        return Header(width, height).size() + (size_t)width * height * 3;
+    }
+
+    virtual void WriteHeader(int width, int height, uint8_t* file) const override
+    {
+        std::string header = Header(width, height);
+        memcpy(file, header.data(), header.size());
+    }
+
+    virtual void EncodeTile(const Framebuffer& fb, const Tile& tile, uint8_t* file) const override
+    {
+        uint8_t* pixels = file + Header(fb.Width(), fb.Height()).size();
+        for (int y = tile.Y0; y < tile.Y1; y++) {
+            uint8_t* p = pixels + ((size_t)y * fb.Width() + tile.X0) * 3;
+            for (int x = tile.X0; x < tile.X1; x++, p += 3) {
+                color c = UnNormalizeColor(fb.At(x, y), fb.SampleCount(x, y));
+                p[0] = (uint8_t)c[0];
+                p[1] = (uint8_t)c[1];
+                p[2] = (uint8_t)c[2];
+            }
+        }
+    }
+
+  private:
+    static std::string Header(int width, int height)
+    {
+        return "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    }
+};
+
+// Little-endian PFM (negative scale). Rows are stored bottom to top.
+class PFMWriter : public ImageWriter
+{
+  public:
+    virtual size_t FileSize(int width, int height) const override
+    {
+        return Header(width, height).size() + (size_t)width * height * 12;
+    }
+
+    virtual void WriteHeader(int width, int height, uint8_t* file) const override
+    {
+        std::string header = Header(width, height);
+        memcpy(file, header.data(), header.size());
+    }
+
+    virtual void EncodeTile(const Framebuffer& fb, const Tile& tile, uint8_t* file) const override
+    {
+        uint8_t* pixels = file + Header(fb.Width(), fb.Height()).size();
+        for (int y = tile.Y0; y < tile.Y1; y++) {
+            size_t row = (size_t)(fb.Height() - 1 - y);
+            uint8_t* p = pixels + (row * fb.Width() + tile.X0) * 12;
+            for (int x = tile.X0; x < tile.X1; x++) {
+                color c = detail::PixelMean(fb, x, y);
+                for (int k = 0; k < 3; k++)
+                    p = detail::PutFloat(p, c[k]);
+            }
+        }
+    }
+
+  private:
+    static std::string Header(int width, int height)
+    {
+        return "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+    }
+};
+
+// Single-part scanline OpenEXR with HALF B, G, R channels and no compression. Every scanline is
+// its own block of fixed size, so the offset table is known before any pixel is rendered.
+class EXRWriter : public ImageWriter
+{
+  public:
+    virtual size_t FileSize(int width, int height) const override
+    {
+        return Header(width, height).size() + (size_t)height * (8 + BlockSize(width));
+    }
+
+    virtual void WriteHeader(int width, int height, uint8_t* file) const override
+    {
+        std::string header = Header(width, height);
+        memcpy(file, header.data(), header.size());
+
+        uint8_t* offsets = file + header.size();
+        uint64_t blockStart = header.size() + (uint64_t)height * 8;
+        for (int y = 0; y < height; y++) {
+            uint64_t block = blockStart + (uint64_t)y * BlockSize(width);
+            detail::PutLE64(offsets + 8 * (size_t)y, block);
+            uint8_t* p = detail::PutLE32(file + block, (uint32_t)y);
+            detail::PutLE32(p, (uint32_t)(BlockSize(width) - 8));
+        }
+    }
+
+    virtual void EncodeTile(const Framebuffer& fb, const Tile& tile, uint8_t* file) const override
+    {
+        const int width = fb.Width();
+        uint8_t* blocks = file + Header(width, fb.Height()).size() + (size_t)fb.Height() * 8;
+        for (int y = tile.Y0; y < tile.Y1; y++) {
+            // Channels are stored one after the other, in alphabetical order
+            uint8_t* row = blocks + (size_t)y * BlockSize(width) + 8;
+            for (int x = tile.X0; x < tile.X1; x++) {
+                color c = detail::PixelMean(fb, x, y);
+                for (int k = 0; k < 3; k++)
+                    detail::PutLE16(row + ((size_t)k * width + x) * 2, FloatToHalf(c[2 - k]));
+            }
+        }
+    }
+
+  private:
+    // y, data size and three rows of halves
+    static size_t BlockSize(int width) { return 8 + (size_t)width * 3 * 2; }
+
+    static std::string Header(int width, int height)
+    {
+        std::string h;
+        auto putInt = [&](uint32_t v) {
+            uint8_t b[4];
+            detail::PutLE32(b, v);
+            h.append((const char*)b, 4);
+        };
+        auto putFloat = [&](float f) {
+            uint8_t b[4];
+            detail::PutFloat(b, f);
+            h.append((const char*)b, 4);
+        };
+        auto attribute = [&](const char* name, const char* type, uint32_t size) {
+            h.append(name, strlen(name) + 1);
+            h.append(type, strlen(type) + 1);
+            putInt(size);
+        };
+
+        // Magic number and version 2, single-part scanline
+        putInt(20000630);
+        putInt(2);
+
+        attribute("channels", "chlist", 3 * 18 + 1);
+        for (const char* channel : {"B", "G", "R"}) {
+            h.append(channel, 2);
+            putInt(1); // HALF
+            putInt(0); // pLinear and reserved bytes
+            putInt(1); // x sampling
+            putInt(1); // y sampling
+        }
+        h += '\0';
+
+        attribute("compression", "compression", 1);
+        h += '\0'; // NO_COMPRESSION
+        for (const char* window : {"dataWindow", "displayWindow"}) {
+            attribute(window, "box2i", 16);
+            putInt(0);
+            putInt(0);
+            putInt((uint32_t)(width - 1));
+            putInt((uint32_t)(height - 1));
+        }
+        attribute("lineOrder", "lineOrder", 1);
+        h += '\0'; // INCREASING_Y
+        attribute("pixelAspectRatio", "float", 4);
+        putFloat(1.f);
+        attribute("screenWindowCenter", "v2f", 8);
+        putFloat(0.f);
+        putFloat(0.f);
+        attribute("screenWindowWidth", "float", 4);
+        putFloat(1.f);
+        h += '\0';
+        return h;
+    }
+};
+
+inline std::unique_ptr<ImageWriter> MakeImageWriter(ImageFormat format)
+{
+    switch (format) {
+    case ImageFormat::PPMText:
+        return std::make_unique<PPMTextWriter>();
+    case ImageFormat::PPM:
+        return std::make_unique<PPMWriter>();
+    case ImageFormat::PFM:
+        return std::make_unique<PFMWriter>();
+    case ImageFormat::EXR:
+        return std::make_unique<EXRWriter>();
+    }
+    return nullptr;
+}
+} // namespace rtiw
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "hittable.h"
+#include "transform.h"
+
+#include <memory>
+
+namespace rtiw
+{
+// Intersects r with an object placed through a transform. hitObject(localRay, rec) intersects
+// the object in its own space. The ray's t is the same in both spaces (the local direction is
+// not normalized), so tMin and tMax carry over and only the hit point and normal are mapped back.
+template <typename HitObjectFn>
+bool HitTransformed(const Transform& worldToObject, const ray& r, HitRecord& rec,
+                    HitObjectFn&& hitObject)
+{
+    ray local(worldToObject.ApplyPoint(r.Origin()), worldToObject.ApplyVector(r.Direction()));
+    if (!hitObject(local, rec))
+        return false;
+
+    // Normals map with the inverse transpose of the object-to-world transform, which keeps them
+    // on the side of the ray FrontFace was set for
+    rec.HitPoint = r.At(rec.t);
+    rec.Normal = Normalize(worldToObject.ApplyTransposed(rec.Normal));
+    return true;
+}
+
+// Shared geometry (a single object, a HittableList or a whole BVH) placed in the world through an
+// affine transform. Any number of instances can reference the same object, and instances can be
+// instanced again, so repeated content costs memory once per level rather than once per copy.
+class Instance : public Hittable
+{
+  public:
+    // objectToWorld must not be singular
+    Instance(std::shared_ptr<Hittable> object, const Transform& objectToWorld);
+
+    virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const override;
+    virtual bool BoundingBox(AABB& outputBox) const override;
+
+    const std::shared_ptr<Hittable>& Object() const { return m_Object; }
+    const Transform& ObjectToWorld() const { return m_ObjectToWorld; }
+    const Transform& WorldToObject() const { return m_WorldToObject; }
+
+  private:
+    std::shared_ptr<Hittable> m_Object;
+    Transform m_ObjectToWorld;
+    Transform m_WorldToObject;
+    AABB m_Box;
+    bool m_Bounded;
+};
+
+Instance::Instance(std::shared_ptr<Hittable> object, const Transform& objectToWorld)
+    : m_Object(std::move(object)), m_ObjectToWorld(objectToWorld),
+      m_WorldToObject(objectToWorld.Inverse())
+{
+    AABB objectBox;
+    m_Bounded = m_Object->BoundingBox(objectBox);
+    if (m_Bounded)
+        m_Box = m_ObjectToWorld.ApplyBox(objectBox);
+}
+
+bool Instance::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    return HitTransformed(m_WorldToObject, r, rec, [&](const ray& local, HitRecord& localRec) {
+        return m_Object->Hit(local, tMin, tMax, localRec);
+    });
+}
+
+bool Instance::BoundingBox(AABB& outputBox) const
+{
+    outputBox = m_Box;
+    return m_Bounded;
+}
+} // namespace rtiw
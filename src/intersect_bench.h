@@ -0,0 +1,87 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "compiled_scene.h"
+#include "hittable_list.h"
+#include "sphere_group.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace rtiw
+{
+// Times closest-hit queries of the same camera rays against every acceleration structure and
+// checks that they all find the same hit distance as the plain HittableList
+void RunIntersectBenchmark(const HittableList& world, const Camera& cam, int rayCount)
+{
+    std::vector<ray> rays;
+    rays.reserve(rayCount);
+    SeedRand(0, 0, 0);
+    for (int i = 0; i < rayCount; i++)
+        rays.push_back(cam.GetRay(RandFloat(), RandFloat()));
+
+    std::vector<float> reference(rays.size());
+    const size_t objectCount = world.Objects().size();
+
+    auto run = [&](const std::string& name, const auto& accel, bool isReference) {
+        // Linear structures get fewer rays on big scenes so the benchmark stays short
+        size_t count = rays.size();
+        bool linear = name == "list" || name.rfind("group", 0) == 0;
+        if (linear && objectCount > 1000)
+            count = std::max<size_t>(1000, (size_t)(2e8 / objectCount));
+        count = std::min(count, rays.size());
+
+        HitRecord rec;
+        int hits = 0;
+        int mismatches = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            float t = accel.Hit(rays[i], 0.0001f, INF, rec) ? rec.t : INF;
+            hits += t < INF;
+            if (isReference)
+                reference[i] = t;
+            else if (t != reference[i])
+                mismatches++;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+
+        std::cout << std::left << std::setw(14) << name << std::right << std::setw(10)
+                  << std::fixed << std::setprecision(2) << (count / seconds) / 1e6 << " Mrays/s"
+                  << std::setw(10) << count << " rays" << std::setw(10) << hits << " hits";
+        if (!isReference)
+            std::cout << "  " << mismatches << " mismatches";
+        std::cout << "\n";
+    };
+
+    std::cout << "Intersecting " << rayCount << " camera rays with " << objectCount
+              << " objects\n";
+
+    // The BVH is the reference since it can afford every ray on large scenes
+    BVH bvh(world);
+    run("bvh", bvh, true);
+    CompiledScene compiled;
+    std::string error;
+    if (compiled.Compile(world, error))
+        run("compiled", compiled, false);
+    if (objectCount <= 100000)
+        run("list", world, false);
+
+    SphereGroup group;
+    if (group.AddSpheres(world)) {
+        for (int level = (int)DetectSimdLevel(); level >= 0; level--) {
+            group.SetSimdLevel((SimdLevel)level);
+            run(std::string("group-") + SimdLevelName((SimdLevel)level), group, false);
+        }
+    }
+
+    BVH bvhOfGroups(MakeSphereGroups(world));
+    run("bvh-group", bvhOfGroups, false);
+}
+} // namespace rtiw
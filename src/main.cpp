@@ -1,5 +1,5 @@
 #include <chrono>
-#include <fstream>
+#include <mutex>
 
 // #define RAYLIB_RENDER
 
@@ -9,32 +9,39 @@
 
 #include "rtweekend.h"
 
+#include "adaptive.h"
+#include "animation.h"
+#include "bvh.h"
+#include "checkpoint.h"
 #include "camera.h"
 #include "color.h"
+#include "compiled_scene.h"
+#include "denoise.h"
+#include "denoise_bench.h"
+#include "heatmap.h"
+#include "image_output.h"
 #include "hittable_list.h"
+#include "intersect_bench.h"
 #include "material.h"
+#include "options.h"
+#include "progressive.h"
+#include "render_profile.h"
+#include "renderer.h"
+#include "scene_file.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "sphere_group.h"
+#include "thread_pool.h"
+#include "vec3_check.h"
 
-rtiw::color RayColor(const rtiw::ray& r, const rtiw::Hittable& world, const int depth)
-{
-    using namespace rtiw;
-
-    if (depth == 0)
-        return color(0.f);
-
-    HitRecord rec;
-    if (world.Hit(r, 0.0001f, INF, rec)) {
-        ray scattered;
-        color attenuation;
-        if (rec.Mat_Ptr->scatter(r, rec, attenuation, scattered))
-            return attenuation * RayColor(scattered, world, depth - 1);
-        return color(0.f);
-    }
-
-    vec3 unitDirection = Normalize(r.Direction());
-    float t = 0.5f * (unitDirection.y() + 1.f);
-    return ((1.f - t) * color(1.f)) + (t * color(0.5f, 0.7f, 1.f));
-}
+// Distributed rendering and the render server need POSIX sockets and render to files only
+#if !defined(_WIN32) && !defined(RAYLIB_RENDER)
+#define RTIW_DISTRIBUTED 1
+#include "distributed.h"
+#include "render_server.h"
+#else
+#define RTIW_DISTRIBUTED 0
+#endif
 
 const float ASPECT_RATIO = 16.f / 9.f;
 const int IMG_WIDTH = 400;
@@ -43,79 +50,745 @@ const int SAMPLES_PER_PIXEL = 100;
 const int MAX_RAY_BOUNCES = 50;
 
 #ifdef RAYLIB_RENDER
-Texture2D RenderToRaylibTex(rtiw::HittableList& world, rtiw::Camera& cam, Image& image,
+template <typename Scene>
+Texture2D RenderToRaylibTex(const Scene& world, rtiw::Camera& cam,
+                            const rtiw::RenderSettings& settings, rtiw::ThreadPool& pool,
+                            rtiw::Framebuffer& fb, Image& image, rtiw::RenderStats& stats,
                             long long& timeInMS)
 #else
-void RenderToPPM(rtiw::HittableList& world, rtiw::Camera& cam, const std::string filename,
-                 long long& timeInMS)
+// With denoise the frame is filtered after the render, which takes denoiseMS
+template <typename Scene>
+void RenderToFile(const Scene& world, rtiw::Camera& cam,
+                  const rtiw::RenderSettings& settings, rtiw::ThreadPool& pool,
+                  rtiw::Framebuffer& fb, rtiw::ImageOutput& output,
+                  rtiw::CheckpointWriter* checkpoint, bool continuing,
+                  const rtiw::DenoiseSettings* denoise, rtiw::RenderStats& stats,
+                  long long& timeInMS, long long& denoiseMS)
 #endif
 {
-#ifndef RAYLIB_RENDER
-    // Open file for writing
-    std::ofstream outputFile(filename);
-    // Write PPM header
-    outputFile << "P3\n" << IMG_WIDTH << ' ' << IMG_HEIGHT << "\n255\n";
-#endif
-
     auto start = std::chrono::high_resolution_clock::now();
-    for (int j = IMG_HEIGHT - 1; j >= 0; j--) {
-#ifndef RAYLIB_RENDER
-        std::cout << "\rScanlines remaining: " << j << ' ' << std::flush;
-#endif
-        for (int i = 0; i < IMG_WIDTH; i++) {
-            rtiw::color pixelColor(0);
-            for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
-                float u = (i + RandFloat()) / (IMG_WIDTH - 1);
-                float v = (j + RandFloat()) / (IMG_HEIGHT - 1);
-                rtiw::ray r = cam.GetRay(u, v);
-                pixelColor += RayColor(r, world, MAX_RAY_BOUNCES);
-            }
 #ifdef RAYLIB_RENDER
-            rtiw::color a = UnNormalizeColor(pixelColor, SAMPLES_PER_PIXEL);
-            ImageDrawPixel(&image, i, IMG_HEIGHT - j,
-                           {(unsigned char)a[0], (unsigned char)a[1], (unsigned char)a[2], 255});
+    if (settings.AdaptiveThreshold > 0.f)
+        stats = rtiw::RenderAdaptive(world, cam, settings, pool, fb);
+    else
+        stats = rtiw::Render(world, cam, settings, pool, fb);
 #else
-            WriteColor(outputFile, pixelColor, SAMPLES_PER_PIXEL);
-#endif
-        }
+    // Pixels change until the last adaptive pass or the denoiser is done, so those frames are
+    // encoded as a whole
+    bool wholeFrame = settings.AdaptiveThreshold > 0.f || denoise;
+    if (settings.AdaptiveThreshold > 0.f) {
+        stats = rtiw::RenderAdaptive(world, cam, settings, pool, fb, [](int pass, int left) {
+            std::cout << "\rAdaptive pass " << pass + 1 << ": " << left << " pixels left "
+                      << std::flush;
+        });
+    } else {
+        std::mutex progressMutex;
+        int printed = 0;
+        auto onTileDone = [&](const rtiw::Tile& tile, int done, int total) {
+            if (!wholeFrame)
+                output.TileDone(fb, tile);
+            if (checkpoint)
+                checkpoint->TileDone(fb, tile);
+            // Counts are taken before the lock, so a thread may arrive with an older one
+            std::lock_guard<std::mutex> lock(progressMutex);
+            if (done <= printed)
+                return;
+            printed = done;
+            std::cout << "\rTiles remaining: " << (total - done) << ' ' << std::flush;
+        };
+        if (continuing)
+            stats = rtiw::RenderContinue(world, cam, settings, pool, fb, onTileDone);
+        else
+            stats = rtiw::Render(world, cam, settings, pool, fb, onTileDone);
     }
-
+#endif
     auto end = std::chrono::high_resolution_clock::now();
     auto durationInMS = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     timeInMS = durationInMS.count();
 
+#ifndef RAYLIB_RENDER
+    denoiseMS = 0;
+    if (denoise) {
+        rtiw::Denoise(fb, *denoise, pool);
+        auto denoiseEnd = std::chrono::high_resolution_clock::now();
+        denoiseMS =
+            std::chrono::duration_cast<std::chrono::milliseconds>(denoiseEnd - end).count();
+    }
+    if (wholeFrame)
+        output.TileDone(fb, rtiw::Tile{0, 0, fb.Width(), fb.Height()});
+#endif
+
 #ifdef RAYLIB_RENDER
+    // GenImageColor() images are R8G8B8A8, so the whole frame is copied in one pass
+    unsigned char* pixels = (unsigned char*)image.data;
+    for (int y = 0; y < fb.Height(); y++) {
+        for (int x = 0; x < fb.Width(); x++) {
+            rtiw::color a = UnNormalizeColor(fb.At(x, y), fb.SampleCount(x, y));
+            unsigned char* p = pixels + 4 * ((size_t)y * fb.Width() + x);
+            p[0] = (unsigned char)a[0];
+            p[1] = (unsigned char)a[1];
+            p[2] = (unsigned char)a[2];
+            p[3] = 255;
+        }
+    }
     return LoadTextureFromImage(image);
-#else
-    // Close file
-    outputFile.close();
 #endif
 }
 
-int main()
+#ifdef RAYLIB_RENDER
+// Orbits the camera around its look-at point with the arrow keys and moves it closer or further
+// with W/S or the mouse wheel. Returns true if the camera moved.
+bool MoveCamera(rtiw::CameraSetup& setup)
+{
+    const float TURN_SPEED = 1.5f;
+    float dt = GetFrameTime();
+    float yaw = TURN_SPEED * dt * (IsKeyDown(KEY_RIGHT) - IsKeyDown(KEY_LEFT));
+    float pitch = TURN_SPEED * dt * (IsKeyDown(KEY_UP) - IsKeyDown(KEY_DOWN));
+    float dolly = dt * (IsKeyDown(KEY_S) - IsKeyDown(KEY_W)) - 0.1f * GetMouseWheelMove();
+    if (yaw == 0.f && pitch == 0.f && dolly == 0.f)
+        return false;
+
+    rtiw::vec3 offset = setup.LookFrom - setup.LookAt;
+    float radius = offset.Length();
+    float theta = atan2f(offset.x(), offset.z()) + yaw;
+    float phi = Clamp(asinf(Clamp(offset.y() / radius, -1.f, 1.f)) + pitch, -1.5f, 1.5f);
+    radius = std::max(0.01f, radius * (1.f + dolly));
+    setup.LookFrom = setup.LookAt + radius * rtiw::vec3(cosf(phi) * sinf(theta), sinf(phi),
+                                                        cosf(phi) * cosf(theta));
+    return true;
+}
+
+// Shows the scene while it renders progressively, one sample per pixel per pass. Camera moves
+// restart the accumulation, and so does R, which runs reload (if given) to reload the scene.
+template <typename Scene>
+void RunProgressiveViewer(Scene& world, rtiw::CameraSetup setup,
+                          const rtiw::RenderSettings& settings, rtiw::ThreadPool& pool,
+                          const typename rtiw::ProgressiveRenderer<Scene>::Change& reload)
+{
+    setup = setup.Placed();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    rtiw::ProgressiveRenderer<Scene> renderer(world, setup.MakeCamera(ASPECT_RATIO), settings,
+                                              pool);
+    renderer.Start();
+
+    Image img = GenImageColor(settings.ImageWidth, settings.ImageHeight, BLANK);
+    Texture2D tex = LoadTextureFromImage(img);
+    UnloadImage(img);
+    std::vector<unsigned char> pixels;
+    long long firstImageMS = -1;
+
+    const Color BACKGROUND{20, 20, 20, 255};
+    while (!WindowShouldClose()) {
+        if (MoveCamera(setup)) {
+            rtiw::Camera cam = setup.MakeCamera(ASPECT_RATIO);
+            renderer.Restart([cam](Scene&, rtiw::Camera& current) { current = cam; });
+        }
+        if (reload && IsKeyPressed(KEY_R))
+            renderer.Restart(reload);
+
+        // One upload per finished pass; the window never waits for the renderer
+        if (renderer.TakeFrame(pixels)) {
+            UpdateTexture(tex, pixels.data());
+            if (firstImageMS < 0) {
+                auto now = std::chrono::high_resolution_clock::now();
+                firstImageMS =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+            }
+        }
+        rtiw::ProgressiveStatus status = renderer.Status();
+
+        BeginDrawing();
+        ClearBackground(BACKGROUND);
+        DrawTexture(tex, (GetScreenWidth() - tex.width) / 2, (GetScreenHeight() - tex.height) / 2,
+                    WHITE);
+        DrawText(TextFormat("%d/%d spp%s  %.2f Msamples/s  %.2f Mrays/s", status.Passes,
+                            settings.SamplesPerPixel, status.Converged ? " (done)" : "",
+                            status.SamplesPerSecond / 1e6, status.RaysPerSecond / 1e6),
+                 10, GetScreenHeight() - 60, 20, RAYWHITE);
+        DrawText(TextFormat("First image after %lldms. Arrows/W/S: move camera%s", firstImageMS,
+                            reload ? ", R: reload scene" : ""),
+                 10, GetScreenHeight() - 35, 20, RAYWHITE);
+        EndDrawing();
+    }
+
+    renderer.Stop();
+    UnloadTexture(tex);
+}
+#endif
+
+bool IsSceneFile(const std::string& name)
+{
+    return rtiw::EndsWith(name, ".rtsc") || rtiw::EndsWith(name, ".scene");
+}
+
+// Loads a built-in scene into world, or a scene file or cache. Scene files and caches go straight
+// to the compiled form if useCompiled is set (precompiled tells whether they did), without
+// building the Hittable graph first.
+bool LoadScene(const std::string& name, int sphereCount, uint32_t seed, bool useCompiled,
+               rtiw::HittableList& world, rtiw::CompiledScene& compiled,
+               rtiw::CameraSetup& cameraSetup, bool& precompiled, std::string& error)
+{
+    precompiled = false;
+    if (!IsSceneFile(name)) {
+        if (!rtiw::BuildScene(name, sphereCount, seed, world, cameraSetup)) {
+            error = "unknown scene '" + name + "'";
+            return false;
+        }
+        return true;
+    }
+
+    if (rtiw::EndsWith(name, ".rtsc")) {
+        if (!compiled.LoadCache(name, cameraSetup, error))
+            return false;
+    } else {
+        rtiw::SceneDescription description;
+        if (!rtiw::LoadSceneText(name, description, error))
+            return false;
+        cameraSetup = description.Camera;
+        if (!useCompiled) {
+            rtiw::AddToHittableList(description, world);
+            return true;
+        }
+        compiled.Build(std::move(description.Materials), std::move(description.Primitives));
+    }
+    precompiled = true;
+    return true;
+}
+
+// Loads a scene straight into its compiled form, for workers and the render server
+bool LoadCompiledScene(const std::string& name, int sphereCount, uint32_t seed,
+                       rtiw::CompiledScene& compiled, rtiw::CameraSetup& cameraSetup,
+                       std::string& error)
+{
+    rtiw::HittableList world;
+    bool precompiled;
+    if (!LoadScene(name, sphereCount, seed, true, world, compiled, cameraSetup, precompiled,
+                   error))
+        return false;
+    return precompiled || compiled.Compile(world, error);
+}
+
+// Render settings of the command line
+rtiw::RenderSettings MakeRenderSettings(const rtiw::Options& opts)
+{
+    rtiw::RenderSettings settings;
+    settings.ImageWidth = opts.ImageWidth > 1 ? opts.ImageWidth : IMG_WIDTH;
+    settings.ImageHeight = std::max(2, (int)(settings.ImageWidth / ASPECT_RATIO));
+    settings.SamplesPerPixel = opts.SamplesPerPixel > 0 ? opts.SamplesPerPixel : SAMPLES_PER_PIXEL;
+    settings.MaxDepth = MAX_RAY_BOUNCES;
+    settings.Seed = opts.Seed;
+    settings.Sampling = opts.Sampling;
+    settings.Integrator = opts.Integrator;
+    settings.AdaptiveThreshold = opts.AdaptiveThreshold;
+    settings.AdaptiveMinSamples = opts.AdaptiveMinSamples;
+    settings.AdaptiveMaxSamples = opts.AdaptiveMaxSamples;
+    return settings;
+}
+
+#ifndef RAYLIB_RENDER
+// Renders the frames of a sequence one after the other with the same scene, threads and
+// framebuffer. Between frames only the camera and the moving objects change: the instanced BVHs
+// stay as they are and the top-level BVH is refitted rather than built again.
+int RenderSequence(const rtiw::Options& opts, rtiw::CompiledScene& scene,
+                   const rtiw::CameraSetup& cameraSetup, const rtiw::RenderSettings& settings,
+                   rtiw::ThreadPool& pool)
+{
+    rtiw::Animation animation;
+    std::string error;
+    if (opts.AnimationFile.empty()) {
+        animation = rtiw::Turntable(cameraSetup.Placed(), opts.Frames);
+    } else if (!rtiw::LoadAnimation(opts.AnimationFile, animation, error)) {
+        std::cerr << "Cannot load the animation: " << error << "\n";
+        return 1;
+    }
+    rtiw::SceneAnimator animator;
+    if (!animator.Start(scene, animation, error)) {
+        std::cerr << "Cannot animate the scene: " << error << "\n";
+        return 1;
+    }
+    int frames = opts.Frames > 0 ? opts.Frames : animation.FrameCount();
+    rtiw::ImageFormat format = opts.FormatSet ? opts.Format
+                                              : rtiw::ImageFormatFromFilename(opts.OutputFile);
+
+    using Clock = std::chrono::high_resolution_clock;
+    auto msSince = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+    rtiw::Framebuffer fb;
+    fb.EnableFeatures(opts.Denoise || !opts.AovFile.empty());
+    rtiw::DenoiseSettings denoise;
+    double moveTotal = 0.0, refitTotal = 0.0, rebuildTotal = 0.0;
+    long long renderTotal = 0, denoiseTotal = 0;
+    uint64_t rays = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        double moveMS = 0.0, refitMS = 0.0, rebuildMS = 0.0;
+        size_t rebuiltNodes = 0;
+        if (animator.MovesObjects()) {
+            auto moveStart = Clock::now();
+            animator.MoveObjects(scene, frame);
+            moveMS = msSince(moveStart);
+            auto refitStart = Clock::now();
+            scene.Refit();
+            refitMS = msSince(refitStart);
+        }
+        if (opts.CompareRebuild) {
+            auto rebuildStart = Clock::now();
+            rebuiltNodes = scene.BuildTopLevel().Nodes.size();
+            rebuildMS = msSince(rebuildStart);
+        }
+
+        std::string path = rtiw::FramePath(opts.OutputFile, frame);
+        rtiw::ImageOutput output;
+        if (!output.Open(path, format, opts.MmapOutput, settings.ImageWidth, settings.ImageHeight,
+                         error)) {
+            std::cerr << "Cannot write the image: " << error << "\n";
+            return 1;
+        }
+        rtiw::Camera cam = animation.CameraAt(frame, cameraSetup).MakeCamera(ASPECT_RATIO);
+        rtiw::RenderStats stats;
+        long long timeInMS = 0, denoiseMS = 0;
+        RenderToFile(scene, cam, settings, pool, fb, output, nullptr, false,
+                     opts.Denoise ? &denoise : nullptr, stats, timeInMS, denoiseMS);
+        if (!output.Finish(fb, error)) {
+            std::cerr << "Cannot write the image: " << error << "\n";
+            return 1;
+        }
+        if (!opts.AovFile.empty() &&
+            !rtiw::WriteFeatureImages(rtiw::FramePath(opts.AovFile, frame),
+                                      rtiw::ImageFormatFromFilename(opts.AovFile), fb, error)) {
+            std::cerr << "Cannot write the AOVs: " << error << "\n";
+            return 1;
+        }
+
+        std::cout << "\rFrame " << frame + 1 << "/" << frames << ": ";
+        if (animator.MovesObjects())
+            std::cout << "moved objects in " << moveMS << "ms, refitted in " << refitMS << "ms";
+        if (opts.CompareRebuild)
+            std::cout << (animator.MovesObjects() ? " " : "") << "(a rebuild of "
+                      << rebuiltNodes << " nodes takes " << rebuildMS << "ms)";
+        std::cout << (animator.MovesObjects() || opts.CompareRebuild ? ", " : "") << "rendered "
+                  << path << " in " << timeInMS << "ms";
+        if (opts.Denoise)
+            std::cout << ", denoised in " << denoiseMS << "ms";
+        std::cout << "\n";
+        moveTotal += moveMS;
+        refitTotal += refitMS;
+        rebuildTotal += rebuildMS;
+        renderTotal += timeInMS;
+        denoiseTotal += denoiseMS;
+        rays += stats.Rays;
+    }
+
+    double seconds = renderTotal > 0 ? renderTotal / 1000.0 : 0.001;
+    std::cout << "\nDone!\n";
+    std::cout << "Took " << renderTotal << "ms to render " << frames << " frames on "
+              << pool.NumThreads() << " thread(s), " << rays / seconds / 1e6 << " Mrays/s\n";
+    if (opts.Denoise)
+        std::cout << "Denoising took " << denoiseTotal << "ms\n";
+    if (animator.MovesObjects())
+        std::cout << "Moving the objects took " << moveTotal << "ms and refitting " << refitTotal
+                  << "ms in total\n";
+    if (opts.CompareRebuild)
+        std::cout << "Rebuilding the top-level BVH every frame would have taken " << rebuildTotal
+                  << "ms\n";
+    return 0;
+}
+#endif
+
+#if RTIW_DISTRIBUTED
+// Renders through worker processes, and with --compare-local once more in this process to report
+// the scaling efficiency and check that both images are the same
+int RenderDistributed(const rtiw::Options& opts, const char* program,
+                      const rtiw::RenderSettings& settings, const rtiw::CompiledScene& world,
+                      const rtiw::Camera& cam)
+{
+    rtiw::RenderCoordinator coordinator;
+    std::string error;
+    if (!coordinator.Listen(opts.CoordinatorAddress, error)) {
+        std::cerr << "Cannot listen: " << error << "\n";
+        return 1;
+    }
+    rtiw::LocalWorkers localWorkers;
+    if (opts.SpawnWorkers > 0) {
+        int threadsEach = opts.NumThreads > 0
+                              ? opts.NumThreads
+                              : std::max(1, rtiw::ThreadPool::DefaultThreadCount() /
+                                                opts.SpawnWorkers);
+        if (!localWorkers.Start(program, opts.CoordinatorAddress, opts.SpawnWorkers, threadsEach,
+                                error)) {
+            std::cerr << "Cannot start the workers: " << error << "\n";
+            return 1;
+        }
+        coordinator.SetWorkersLeft([&] { return localWorkers.Running() > 0; });
+    }
+
+    rtiw::ImageOutput output;
+    rtiw::ImageFormat format = opts.FormatSet ? opts.Format
+                                              : rtiw::ImageFormatFromFilename(opts.OutputFile);
+    if (!output.Open(opts.OutputFile, format, opts.MmapOutput, settings.ImageWidth,
+                     settings.ImageHeight, error)) {
+        std::cerr << "Cannot write the image: " << error << "\n";
+        return 1;
+    }
+
+    rtiw::DistributedJob job;
+    job.Scene = opts.Scene;
+    job.SphereCount = opts.SphereCount;
+    job.Settings = settings;
+    rtiw::Framebuffer fb;
+    rtiw::RenderStats stats;
+    // Timed up to the last tile, without the workers' shutdown
+    auto start = std::chrono::high_resolution_clock::now();
+    auto end = start;
+    auto onTileDone = [&](const rtiw::Tile& tile, int done, int total) {
+        output.TileDone(fb, tile);
+        std::cout << "\rTiles remaining: " << (total - done) << ' ' << std::flush;
+        if (done == total)
+            end = std::chrono::high_resolution_clock::now();
+    };
+    if (!coordinator.Render(job, fb, onTileDone, stats, error)) {
+        std::cerr << "Distributed render failed: " << error << "\n";
+        return 1;
+    }
+    long long timeInMS = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    localWorkers.Wait();
+    if (!output.Finish(fb, error)) {
+        std::cerr << "Cannot write the image: " << error << "\n";
+        return 1;
+    }
+
+    int workerThreads = 0;
+    std::cout << "\nDone!\n";
+    for (const rtiw::WorkerReport& worker : coordinator.Workers()) {
+        std::cout << worker.Name << ": " << worker.Threads << " thread(s), "
+                  << worker.TilesRendered << " tiles";
+        if (worker.TilesWasted > 0)
+            std::cout << ", " << worker.TilesWasted << " duplicates finished too late";
+        std::cout << (worker.Lost ? " (lost)\n" : "\n");
+        if (!worker.Lost)
+            workerThreads += worker.Threads;
+    }
+    if (coordinator.ReassignedTiles() > 0)
+        std::cout << coordinator.ReassignedTiles() << " tiles reassigned from lost workers\n";
+    double seconds = timeInMS > 0 ? timeInMS / 1000.0 : 0.001;
+    std::cout << "Took " << timeInMS << "ms to render on " << coordinator.Workers().size()
+              << " worker(s) with " << workerThreads << " thread(s) in total.\n";
+    std::cout << "Traced " << stats.Rays << " rays: " << stats.Rays / seconds / 1e6
+              << " Mrays/s, " << stats.Samples / seconds / 1e6 << " Msamples/s\n";
+
+    if (opts.CompareLocal) {
+        // The same frame rendered by one process on the same number of threads
+        rtiw::ThreadPool pool(std::max(1, workerThreads));
+        rtiw::Framebuffer local;
+        auto localStart = std::chrono::high_resolution_clock::now();
+        rtiw::Render(world, cam, settings, pool, local);
+        auto localEnd = std::chrono::high_resolution_clock::now();
+        long long localMS =
+            std::chrono::duration_cast<std::chrono::milliseconds>(localEnd - localStart).count();
+        bool same = local.SampleCounts() == fb.SampleCounts();
+        for (size_t p = 0; same && p < local.Pixels().size(); p++)
+            for (int c = 0; c < 3; c++)
+                same = same && local.Pixels()[p][c] == fb.Pixels()[p][c];
+        std::cout << "Single process: " << localMS << "ms on " << pool.NumThreads()
+                  << " thread(s). Scaling efficiency: " << 100.0 * localMS / std::max(1LL, timeInMS)
+                  << "%. The images are " << (same ? "identical" : "DIFFERENT") << ".\n";
+        if (!same)
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+#if RTIW_DISTRIBUTED
+// Serves render jobs until killed, with the --scene loaded before the first job
+int RunServer(const rtiw::Options& opts)
 {
-    // World
+    rtiw::ThreadPool pool(opts.NumThreads);
+    rtiw::RenderServer server(pool, [](const rtiw::RenderRequest& request,
+                                       rtiw::CompiledScene& compiled,
+                                       rtiw::CameraSetup& cameraSetup, std::string& error) {
+        return LoadCompiledScene(request.Scene, request.SphereCount, request.Settings.Seed,
+                                 compiled, cameraSetup, error);
+    });
+    std::string error;
+    if (!server.Listen(opts.ServeAddress, error)) {
+        std::cerr << "Cannot listen: " << error << "\n";
+        return 1;
+    }
+    rtiw::RenderRequest preload;
+    preload.Scene = opts.Scene;
+    preload.SphereCount = opts.SphereCount;
+    preload.Settings.Seed = opts.Seed;
+    if (!server.Preload(preload, error)) {
+        std::cerr << "Cannot load the scene: " << error << "\n";
+        return 1;
+    }
+    std::cout << "Serving on " << opts.ServeAddress << " with " << pool.NumThreads()
+              << " thread(s)" << std::endl;
+    if (!server.Run(error)) {
+        std::cerr << "Server: " << error << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Renders the frame on the render server and writes the tiles it streams back to the output
+int SubmitToServer(const rtiw::Options& opts)
+{
+    rtiw::RenderRequest request;
+    request.Scene = opts.Scene;
+    request.SphereCount = opts.SphereCount;
+    request.Settings = MakeRenderSettings(opts);
+    request.Priority = opts.Priority;
+    request.Region = opts.Region;
+    request.Camera = opts.Camera;
+    request.AspectRatio = ASPECT_RATIO;
+
+    rtiw::ImageOutput output;
+    std::string error;
+    rtiw::ImageFormat format = opts.FormatSet ? opts.Format
+                                              : rtiw::ImageFormatFromFilename(opts.OutputFile);
+    if (!output.Open(opts.OutputFile, format, opts.MmapOutput, request.Settings.ImageWidth,
+                     request.Settings.ImageHeight, error)) {
+        std::cerr << "Cannot write the image: " << error << "\n";
+        return 1;
+    }
+
+    rtiw::Framebuffer fb;
+    rtiw::RenderJobReport report;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto onTileDone = [&](const rtiw::Tile& tile, int done, int total) {
+        output.TileDone(fb, tile);
+        std::cout << "\rTiles remaining: " << (total - done) << ' ' << std::flush;
+    };
+    if (!rtiw::SubmitRender(opts.SubmitAddress, request, fb, onTileDone, report, error)) {
+        std::cerr << "\nRender failed: " << error << "\n";
+        return 1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    long long timeInMS = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    if (!output.Finish(fb, error)) {
+        std::cerr << "Cannot write the image: " << error << "\n";
+        return 1;
+    }
+
+    std::cout << "\nDone!\n";
+    std::cout << "Job " << report.Job << " took " << timeInMS << "ms. On the server: queued for "
+              << report.QueuedMS << "ms, first tile after " << report.FirstTileMS
+              << "ms, last after " << report.TotalMS << "ms\n";
+    double renderMS = report.TotalMS - report.QueuedMS;
+    double seconds = renderMS > 0.0 ? renderMS / 1000.0 : 0.001;
+    std::cout << "Traced " << report.Rays << " rays: " << report.Rays / seconds / 1e6
+              << " Mrays/s, " << report.Samples / seconds / 1e6 << " Msamples/s\n";
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    rtiw::Options opts;
+    if (!rtiw::ParseOptions(argc, argv, opts))
+        return 1;
+    if (opts.CheckVec3Inputs > 0)
+        return rtiw::CheckVec3Backend(opts.CheckVec3Inputs) ? 0 : 1;
+
+#if RTIW_DISTRIBUTED
+    if (!opts.WorkerAddress.empty()) {
+        rtiw::ThreadPool pool(opts.NumThreads);
+        // Workers always render the compiled scene, loaded like the coordinator loaded it
+        auto loadScene = [](const rtiw::DistributedJob& job, rtiw::CompiledScene& compiled,
+                            rtiw::Camera& cam, std::string& error) {
+            rtiw::CameraSetup cameraSetup;
+            if (!LoadCompiledScene(job.Scene, job.SphereCount, job.Settings.Seed, compiled,
+                                   cameraSetup, error))
+                return false;
+            cam = cameraSetup.MakeCamera(ASPECT_RATIO);
+            return true;
+        };
+        std::string error;
+        if (!rtiw::RunWorker(opts.WorkerAddress, pool, loadScene, error)) {
+            std::cerr << "Worker: " << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!opts.ServeAddress.empty())
+        return RunServer(opts);
+    if (!opts.SubmitAddress.empty())
+        return SubmitToServer(opts);
+    if (!opts.MetricsAddress.empty()) {
+        std::string json, error;
+        if (!rtiw::QueryServerMetrics(opts.MetricsAddress, json, error)) {
+            std::cerr << "Cannot query the server: " << error << "\n";
+            return 1;
+        }
+        std::cout << json;
+        return 0;
+    }
+#else
+    if (!opts.CoordinatorAddress.empty() || !opts.WorkerAddress.empty() ||
+        !opts.ServeAddress.empty() || !opts.SubmitAddress.empty() ||
+        !opts.MetricsAddress.empty()) {
+        std::cerr << "This build does not support distributed rendering or the render server\n";
+        return 1;
+    }
+#endif
+
+    // World and camera
     rtiw::HittableList world;
+    rtiw::CameraSetup cameraSetup;
+    rtiw::CompiledScene compiled;
+    bool precompiled = false;
+    bool useCompiled = opts.Accel == "compiled" && opts.BenchIntersectRays == 0;
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    std::string loadError;
+    if (!LoadScene(opts.Scene, opts.SphereCount, opts.Seed, useCompiled, world, compiled,
+                   cameraSetup, precompiled, loadError)) {
+        std::cerr << "Cannot load the scene: " << loadError << "\n";
+        return 1;
+    }
+    if (IsSceneFile(opts.Scene)) {
+        auto loadEnd = std::chrono::high_resolution_clock::now();
+        auto loadMS = std::chrono::duration_cast<std::chrono::milliseconds>(loadEnd - loadStart);
+        std::cout << "Loaded " << opts.Scene << " in " << loadMS.count() << "ms\n";
+    }
+    rtiw::Camera cam = cameraSetup.MakeCamera(ASPECT_RATIO);
+
+    rtiw::SphereGroup::SetDefaultSimdLevel(opts.MaxSimd);
+
+    if (opts.BenchIntersectRays > 0) {
+        rtiw::RunIntersectBenchmark(world, cam, opts.BenchIntersectRays);
+        return 0;
+    }
+
+    // The compiled scene is the default; the other modes keep the Hittable graph for comparison
+    std::shared_ptr<rtiw::Hittable> scene;
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    if (precompiled) {
+        // Built while loading
+    } else if (opts.Accel == "compiled") {
+        std::string error;
+        if (!compiled.Compile(world, error)) {
+            std::cerr << "Cannot compile the scene: " << error << "\n";
+            return 1;
+        }
+    } else if (opts.Accel == "bvh") {
+        scene = std::make_shared<rtiw::BVH>(world);
+    } else if (opts.Accel == "bvh-group") {
+        scene = std::make_shared<rtiw::BVH>(rtiw::MakeSphereGroups(world));
+    } else if (opts.Accel == "group") {
+        auto group = std::make_shared<rtiw::SphereGroup>();
+        if (!group->AddSpheres(world)) {
+            std::cerr << "--accel group only supports scenes made of spheres\n";
+            return 1;
+        }
+        scene = group;
+    } else {
+        scene = std::make_shared<rtiw::HittableList>(world);
+    }
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    auto buildMS = std::chrono::duration_cast<std::chrono::milliseconds>(buildEnd - buildStart);
+    if (!precompiled) {
+        std::cout << "Built '" << opts.Accel << "' over " << world.Objects().size()
+                  << " objects in " << buildMS.count() << "ms\n";
+    }
+    if (!scene) {
+        std::cout << "Compiled " << compiled.PrimitiveCount() << " primitives, "
+                  << compiled.MaterialCount() << " materials, " << compiled.NodeCount()
+                  << " BVH nodes (" << compiled.MemoryBytes() / 1024 << " KiB, "
+                  << rtiw::CompiledScene::DispatchName() << " dispatch)\n";
+        if (compiled.InstanceCount() > 0) {
+            uint64_t flatPrimitives, flatBytes;
+            compiled.FlatSize(flatPrimitives, flatBytes);
+            std::cout << compiled.InstanceCount() << " instances of "
+                      << compiled.PrototypeCount() - 1 << " BVHs stand for " << flatPrimitives
+                      << " primitives, which would take " << flatBytes / (1024.0 * 1024.0)
+                      << " MiB without instancing\n";
+        }
+        // The render only needs the compiled form
+        world.Clear();
 
-    auto materialGround = std::make_shared<rtiw::Lambertian>(rtiw::color(0.8f, 0.8f, 0.f));
-    auto materialCenter = std::make_shared<rtiw::Lambertian>(rtiw::color(0.7f, 0.3f, 0.3f));
-    auto materialLeft = std::make_shared<rtiw::Metal>(rtiw::color(0.8f), 0.3f);
-    auto materialRight = std::make_shared<rtiw::Metal>(rtiw::color(0.8f, 0.6f, 0.2f), 1.f);
+        std::string error;
+        if (!opts.SaveSceneFile.empty() &&
+            !rtiw::SaveSceneText(opts.SaveSceneFile, compiled, cameraSetup, error)) {
+            std::cerr << "Cannot save the scene: " << error << "\n";
+            return 1;
+        }
+        if (!opts.SaveCacheFile.empty() &&
+            !compiled.SaveCache(opts.SaveCacheFile, cameraSetup, error)) {
+            std::cerr << "Cannot save the scene cache: " << error << "\n";
+            return 1;
+        }
+    }
 
-    world.Add(
-        std::make_shared<rtiw::Sphere>(rtiw::point3(0.f, -100.5f, -1.0f), 100.f, materialGround));
-    world.Add(std::make_shared<rtiw::Sphere>(rtiw::point3(0.f, 0.f, -1.0f), 0.5f, materialCenter));
-    world.Add(std::make_shared<rtiw::Sphere>(rtiw::point3(-1.f, 0.f, -1.0f), 0.5f, materialLeft));
-    world.Add(std::make_shared<rtiw::Sphere>(rtiw::point3(1.f, 0.f, -1.0f), 0.5f, materialRight));
+    rtiw::RenderSettings settings = MakeRenderSettings(opts);
 
-    // Camera
-    rtiw::Camera cam;
+    rtiw::ThreadPool pool(opts.NumThreads);
 
+    rtiw::Framebuffer fb;
+    rtiw::RenderStats stats;
     long long timeInMS = 0;
+    rtiw::DenoiseSettings denoiseSettings;
+    if (opts.BenchDenoiseSpp > 0) {
+        if (scene)
+            rtiw::RunDenoiseBenchmark(*scene, cam, settings, pool, opts.BenchDenoiseSpp,
+                                      denoiseSettings);
+        else
+            rtiw::RunDenoiseBenchmark(compiled, cam, settings, pool, opts.BenchDenoiseSpp,
+                                      denoiseSettings);
+        return 0;
+    }
+
 #ifdef RAYLIB_RENDER
+    if (opts.Frames > 0 || !opts.AnimationFile.empty()) {
+        std::cerr << "This build cannot render sequences, they are written to files\n";
+        return 1;
+    }
+    if (opts.Denoise || !opts.AovFile.empty()) {
+        std::cerr << "This build cannot denoise or write AOVs, use the file renderer\n";
+        return 1;
+    }
     InitWindow(800, 625, "RayTracing In One Weekend");
-    Image img = GenImageColor(IMG_WIDTH, IMG_HEIGHT, BLANK);
-    Texture2D tex = RenderToRaylibTex(world, cam, img, timeInMS);
+    // Adaptive sampling and the wavefront integrator work on whole frames, so they keep the
+    // one-shot render
+    bool progressive = settings.AdaptiveThreshold <= 0.f &&
+                       settings.Integrator == rtiw::IntegratorType::Recursive;
+    if (progressive) {
+        rtiw::ProgressiveRenderer<rtiw::CompiledScene>::Change reload;
+        if (precompiled) {
+            std::string path = opts.Scene;
+            reload = [path](rtiw::CompiledScene& world, rtiw::Camera&) {
+                std::string error;
+                rtiw::CameraSetup unused;
+                rtiw::SceneDescription description;
+                bool ok;
+                if (rtiw::EndsWith(path, ".rtsc")) {
+                    ok = world.LoadCache(path, unused, error);
+                } else {
+                    ok = rtiw::LoadSceneText(path, description, error);
+                    if (ok)
+                        world.Build(std::move(description.Materials),
+                                    std::move(description.Primitives));
+                }
+                if (!ok)
+                    std::cerr << "Cannot reload the scene: " << error << "\n";
+            };
+        }
+        if (scene)
+            RunProgressiveViewer(*scene, cameraSetup, settings, pool, nullptr);
+        else
+            RunProgressiveViewer(compiled, cameraSetup, settings, pool, reload);
+        CloseWindow();
+        return 0;
+    }
+
+    Image img = GenImageColor(settings.ImageWidth, settings.ImageHeight, BLANK);
+    Texture2D tex;
+    if (scene)
+        tex = RenderToRaylibTex(*scene, cam, settings, pool, fb, img, stats, timeInMS);
+    else
+        tex = RenderToRaylibTex(compiled, cam, settings, pool, fb, img, stats, timeInMS);
 
     const Color BACKGROUND{20, 20, 20, 255};
     while (!WindowShouldClose()) {
@@ -131,11 +804,118 @@ int main()
 
     CloseWindow();
 #else
-    RenderToPPM(world, cam, "output.ppm", timeInMS);
+#if RTIW_DISTRIBUTED
+    if (!opts.CoordinatorAddress.empty())
+        return RenderDistributed(opts, argv[0], settings, compiled, cam);
+#endif
+    if (opts.Frames > 0 || !opts.AnimationFile.empty())
+        return RenderSequence(opts, compiled, cameraSetup, settings, pool);
+
+    // --resume and --add-samples continue from the checkpoint, with its settings
+    rtiw::CheckpointWriter checkpoint;
+    bool continuing = opts.Resume || opts.AddSamples > 0;
+    if (!opts.CheckpointFile.empty()) {
+        std::string key = opts.Scene + "\n" + std::to_string(opts.SphereCount) + "\n" +
+                          std::to_string(opts.Seed);
+        uint64_t sceneKey = rtiw::HashString(key);
+        if (continuing) {
+            rtiw::CheckpointInfo info;
+            std::string error;
+            if (!rtiw::LoadCheckpoint(opts.CheckpointFile, info, fb, error)) {
+                std::cerr << "Cannot resume: " << error << "\n";
+                return 1;
+            }
+            if (info.SceneKey != sceneKey) {
+                std::cerr << "Cannot resume: " << opts.CheckpointFile
+                          << " belongs to another scene (check --scene, --spheres and --seed)\n";
+                return 1;
+            }
+            info.ApplyTo(settings);
+            settings.SamplesPerPixel += std::max(0, opts.AddSamples);
+            std::cout << "Continuing " << opts.CheckpointFile << " to " << settings.SamplesPerPixel
+                      << " samples per pixel\n";
+        } else {
+            fb.Resize(settings.ImageWidth, settings.ImageHeight);
+        }
+        rtiw::CheckpointInfo info = rtiw::CheckpointInfo::FromSettings(settings, sceneKey);
+        checkpoint.Start(opts.CheckpointFile, info, fb, opts.CheckpointInterval);
+    }
+
+    // Tiles are encoded by the output's writer thread while the render goes on
+    rtiw::ImageOutput output;
+    std::string outputError;
+    rtiw::ImageFormat format = opts.FormatSet ? opts.Format
+                                              : rtiw::ImageFormatFromFilename(opts.OutputFile);
+    if (!output.Open(opts.OutputFile, format, opts.MmapOutput, settings.ImageWidth,
+                     settings.ImageHeight, outputError)) {
+        std::cerr << "Cannot write the image: " << outputError << "\n";
+        return 1;
+    }
 
+    rtiw::CheckpointWriter* checkpointing = opts.CheckpointFile.empty() ? nullptr : &checkpoint;
+    fb.EnableFeatures(opts.Denoise || !opts.AovFile.empty());
+    const rtiw::DenoiseSettings* denoise = opts.Denoise ? &denoiseSettings : nullptr;
+    long long denoiseMS = 0;
+    if (scene) {
+        RenderToFile(*scene, cam, settings, pool, fb, output, checkpointing, continuing, denoise,
+                     stats, timeInMS, denoiseMS);
+    } else {
+        RenderToFile(compiled, cam, settings, pool, fb, output, checkpointing, continuing, denoise,
+                     stats, timeInMS, denoiseMS);
+    }
+    if (checkpointing && !checkpoint.Finish(fb, outputError)) {
+        std::cerr << "Cannot save the checkpoint: " << outputError << "\n";
+        return 1;
+    }
+
+    auto writeStart = std::chrono::high_resolution_clock::now();
+    if (!output.Finish(fb, outputError)) {
+        std::cerr << "Cannot write the image: " << outputError << "\n";
+        return 1;
+    }
+    auto writeEnd = std::chrono::high_resolution_clock::now();
+    auto writeMS = std::chrono::duration_cast<std::chrono::milliseconds>(writeEnd - writeStart);
+
+    double seconds = timeInMS > 0 ? timeInMS / 1000.0 : 0.001;
     std::cout << "\nDone!\n";
-    std::cout << "Took " << timeInMS << "ms to render.\n";
+    std::cout << "Took " << timeInMS << "ms to render on " << pool.NumThreads()
+              << " thread(s).\n";
+    std::cout << "Traced " << stats.Rays << " rays: " << stats.Rays / seconds / 1e6
+              << " Mrays/s, " << stats.Samples / seconds / 1e6 << " Msamples/s\n";
+    if (denoise)
+        std::cout << "Denoised in " << denoiseMS << "ms\n";
+    std::cout << "Finished writing " << opts.OutputFile << " " << writeMS.count()
+              << "ms after the render\n";
+    if (!opts.AovFile.empty() &&
+        !rtiw::WriteFeatureImages(opts.AovFile, rtiw::ImageFormatFromFilename(opts.AovFile), fb,
+                                  outputError))
+        std::cerr << "Cannot write the AOVs: " << outputError << "\n";
+    if (settings.AdaptiveThreshold > 0.f) {
+        double pixels = (double)settings.ImageWidth * settings.ImageHeight;
+        double fixedSamples = settings.SamplesPerPixel * pixels;
+        std::cout << "Spent " << stats.Samples << " samples, " << stats.Samples / pixels
+                  << " per pixel (" << 100.0 * stats.Samples / fixedSamples
+                  << "% of the fixed budget)\n";
+    }
+#endif
+
+    if (!opts.SppHeatmapFile.empty()) {
+        std::vector<float> counts(fb.SampleCounts().begin(), fb.SampleCounts().end());
+        if (!rtiw::WriteHeatmap(opts.SppHeatmapFile, fb.Width(), fb.Height(), counts))
+            std::cerr << "Cannot write " << opts.SppHeatmapFile << "\n";
+    }
+
+#if RTIW_STATS
+    const rtiw::RenderProfile& profile = rtiw::RenderProfile::Get();
+    if (!opts.StatsFile.empty() &&
+        !rtiw::WriteStatsJSON(opts.StatsFile, settings, rtiw::CounterRegistry::Get().Sum(),
+                              profile, (double)timeInMS, pool.NumThreads()))
+        std::cerr << "Cannot write " << opts.StatsFile << "\n";
+    if (!opts.CostHeatmapFile.empty() &&
+        !rtiw::WriteHeatmap(opts.CostHeatmapFile, profile.Width(), profile.Height(),
+                            profile.PixelMS()))
+        std::cerr << "Cannot write " << opts.CostHeatmapFile << "\n";
 #endif
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rtiw
+{
+// A file mapped into memory, either created with a fixed size for writing or opened read-only.
+// The mapping is released by Close() or the destructor.
+class MappedFile
+{
+  public:
+    MappedFile() {}
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other) {
+            Close();
+            std::swap(m_Data, other.m_Data);
+            std::swap(m_Size, other.m_Size);
+#ifdef _WIN32
+            std::swap(m_File, other.m_File);
+            std::swap(m_Mapping, other.m_Mapping);
+#endif
+        }
+        return *this;
+    }
+
+    // Creates (or truncates) path with the given size and maps it for writing
+    bool Create(const std::string& path, size_t size);
+    // Maps an existing file for reading
+    bool Open(const std::string& path);
+    // Unmaps the file; written pages reach the disk through the page cache
+    void Close();
+
+    uint8_t* Data() { return m_Data; }
+    const uint8_t* Data() const { return m_Data; }
+    size_t Size() const { return m_Size; }
+
+  private:
+    uint8_t* m_Data = nullptr;
+    size_t m_Size = 0;
+#ifdef _WIN32
+    HANDLE m_File = INVALID_HANDLE_VALUE;
+    HANDLE m_Mapping = nullptr;
+
+    bool Map(DWORD protect, DWORD access);
+#else
+    bool Map(int fd, int protect);
+#endif
+};
+
+#ifdef _WIN32
+bool MappedFile::Map(DWORD protect, DWORD access)
+{
+    // Empty files cannot be mapped; they are represented by an open file without data
+    if (m_Size == 0)
+        return true;
+    m_Mapping = CreateFileMappingA(m_File, nullptr, protect, (DWORD)((uint64_t)m_Size >> 32),
+                                   (DWORD)m_Size, nullptr);
+    if (!m_Mapping)
+        return false;
+    m_Data = (uint8_t*)MapViewOfFile(m_Mapping, access, 0, 0, m_Size);
+    return m_Data != nullptr;
+}
+
+bool MappedFile::Create(const std::string& path, size_t size)
+{
+    Close();
+    m_File = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+        return false;
+    m_Size = size;
+    if (!Map(PAGE_READWRITE, FILE_MAP_WRITE)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+    m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_File, &size)) {
+        Close();
+        return false;
+    }
+    m_Size = (size_t)size.QuadPart;
+    if (!Map(PAGE_READONLY, FILE_MAP_READ)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_Data)
+        UnmapViewOfFile(m_Data);
+    if (m_Mapping)
+        CloseHandle(m_Mapping);
+    if (m_File != INVALID_HANDLE_VALUE)
+        CloseHandle(m_File);
+    m_Data = nullptr;
+    m_Mapping = nullptr;
+    m_File = INVALID_HANDLE_VALUE;
+    m_Size = 0;
+}
+#else
+bool MappedFile::Map(int fd, int protect)
+{
+    if (m_Size == 0)
+        return true;
+    void* data = mmap(nullptr, m_Size, protect, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+    m_Data = (uint8_t*)data;
+    return true;
+}
+
+bool MappedFile::Create(const std::string& path, size_t size)
+{
+    Close();
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    m_Size = size;
+    bool ok = ftruncate(fd, (off_t)size) == 0 && Map(fd, PROT_READ | PROT_WRITE);
+    // The mapping keeps the file alive
+    close(fd);
+    if (!ok)
+        Close();
+    return ok;
+}
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        m_Size = (size_t)st.st_size;
+        ok = Map(fd, PROT_READ);
+    }
+    close(fd);
+    if (!ok)
+        Close();
+    return ok;
+}
+
+void MappedFile::Close()
+{
+    if (m_Data)
+        munmap(m_Data, m_Size);
+    m_Data = nullptr;
+    m_Size = 0;
+}
+#endif
+} // namespace rtiw
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "camera.h"
+#include "image_writer.h"
+#include "render_settings.h"
+#include "sampler.h"
+#include "simd.h"
+#include "stats.h"
+
+namespace rtiw
+{
+// Command line options for the renderer
+struct Options
+{
+    // 0 picks std::thread::hardware_concurrency()
+    int NumThreads = 0;
+    uint32_t Seed = 0;
+    std::string OutputFile = "output.ppm";
+    // Without --format the format follows the extension of OutputFile
+    ImageFormat Format = ImageFormat::PPM;
+    bool FormatSet = false;
+    // Encode straight into a memory-mapped output file
+    bool MmapOutput = false;
+    // 0 keeps the built-in image width; the height follows from the aspect ratio
+    int ImageWidth = 0;
+    // "compiled", "bvh", "list", "group" or "bvh-group"
+    std::string Accel = "compiled";
+    // A built-in scene name, a text scene file (.scene) or a binary scene cache (.rtsc)
+    std::string Scene = "default";
+    // Number of spheres of the synthetic "spheres" and "instances" scenes
+    int SphereCount = 10000;
+    // Highest instruction set the SIMD kernels may use
+    SimdLevel MaxSimd = DetectSimdLevel();
+    // Non-zero runs the intersection benchmark with that many rays instead of rendering
+    int BenchIntersectRays = 0;
+    // Non-zero checks the vec3 backend against the scalar formulas on that many inputs per
+    // operation instead of rendering
+    int CheckVec3Inputs = 0;
+    // 0 keeps the built-in SAMPLES_PER_PIXEL
+    int SamplesPerPixel = 0;
+    SamplerType Sampling = SamplerType::Sobol;
+    IntegratorType Integrator = IntegratorType::Recursive;
+    // Adaptive sampling, see RenderSettings
+    float AdaptiveThreshold = 0.f;
+    int AdaptiveMinSamples = 32;
+    int AdaptiveMaxSamples = 0;
+    // Non-empty writes the samples taken per pixel as a heatmap image
+    std::string SppHeatmapFile;
+    // Filter the frame with the feature-guided denoiser before it is written
+    bool Denoise = false;
+    // Non-empty writes the albedo, normal and depth of the first hits as images named after it
+    std::string AovFile;
+    // Non-zero compares renders with and without denoising against a reference rendered with
+    // that many samples per pixel instead of rendering
+    int BenchDenoiseSpp = 0;
+    // Instrumentation output; only available in builds with RTIW_STATS=1
+    std::string StatsFile;
+    std::string CostHeatmapFile;
+    // Non-empty writes the compiled scene as a text scene file or a binary cache
+    std::string SaveSceneFile;
+    std::string SaveCacheFile;
+    // Non-empty saves the render's progress to this file every CheckpointInterval seconds and
+    // at the end
+    std::string CheckpointFile;
+    double CheckpointInterval = 60.0;
+    // Continue the checkpointed render, or refine it with AddSamples more samples per pixel
+    bool Resume = false;
+    int AddSamples = 0;
+    // Non-empty renders through worker processes that connect to this address ("unix:<path>"
+    // or "<host>:<port>"), SpawnWorkers of which are started on this machine
+    std::string CoordinatorAddress;
+    int SpawnWorkers = 0;
+    // Also render the frame in this process and report the scaling of the distributed render
+    bool CompareLocal = false;
+    // Non-empty runs as a worker of the coordinator at this address
+    std::string WorkerAddress;
+    // Non-zero renders a sequence of that many frames, numbered into the output file names. The
+    // camera turns around the scene unless AnimationFile keys the motion; with an animation, 0
+    // renders up to its last key.
+    int Frames = 0;
+    std::string AnimationFile;
+    // Also time a full rebuild of the top-level BVH for every frame
+    bool CompareRebuild = false;
+    // Non-empty runs as a render server on this address, with Scene loaded up front
+    std::string ServeAddress;
+    // Non-empty renders the frame on the render server at this address instead of in process,
+    // with this priority, only the pixels of Region (x0, y0, x1, y1; empty for the whole frame)
+    // and Camera instead of the scene's camera if it is set
+    std::string SubmitAddress;
+    int Priority = 0;
+    Tile Region = {0, 0, 0, 0};
+    CameraSetup Camera;
+    // Non-empty prints the metrics of the render server at this address
+    std::string MetricsAddress;
+};
+
+inline bool EndsWith(const std::string& s, const std::string& suffix)
+{
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+inline void PrintUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --threads <n>     Number of render threads (default: all cores)\n"
+              << "  --seed <n>        Random seed; output is identical for a given seed\n"
+              << "  --output <file>   Output image (default: output.ppm)\n"
+              << "  --format <type>   p3 (text PPM), p6 (binary PPM), pfm or exr (linear HDR);\n"
+              << "                    default: from the file extension, p6 for .ppm\n"
+              << "  --mmap            Encode into a memory-mapped output file (binary formats)\n"
+              << "  --width <n>       Image width (default: 400)\n"
+              << "  --accel <type>    Scene representation: compiled (default, flat arrays +\n"
+              << "                    BVH), bvh, list, group (SIMD sphere group) or bvh-group\n"
+              << "                    (BVH over SIMD sphere groups)\n"
+              << "  --scene <name>    default, final (the book's cover), spheres (synthetic),\n"
+              << "                    instances (instanced synthetic), a text scene file\n"
+              << "                    (.scene) or a scene cache (.rtsc)\n"
+              << "  --spheres <n>     Sphere count of the synthetic scenes (default: 10000)\n"
+              << "  --simd <level>    Limit SIMD kernels to scalar, sse, avx2 or avx512\n"
+              << "  --bench-intersect <rays>\n"
+              << "                    Time closest-hit queries of every acceleration structure\n"
+              << "  --check-vec3 <n>  Check the vec3 backend of this build against the scalar\n"
+              << "                    formulas on <n> random inputs per operation\n"
+              << "  --spp <n>         Samples per pixel\n"
+              << "  --sampler <type>  independent, stratified, sobol (default) or r2\n"
+              << "  --integrator <type>\n"
+              << "                    recursive (default) or wavefront\n"
+              << "  --adaptive <levels>\n"
+              << "                    Adaptive sampling: stop a pixel once the standard error\n"
+              << "                    of its 8-bit value is below <levels>; --spp becomes the\n"
+              << "                    average budget (at least 2)\n"
+              << "  --adaptive-min <n>\n"
+              << "                    Samples per pixel before the first error check and per\n"
+              << "                    adaptive pass, at most --spp (default: 32)\n"
+              << "  --adaptive-max <n>\n"
+              << "                    Most samples one pixel may take (default: 4 * spp)\n"
+              << "  --spp-heatmap <file>\n"
+              << "                    Write the samples taken per pixel as a PPM heatmap\n"
+              << "  --denoise         Filter the frame with the feature-guided a-trous denoiser\n"
+              << "  --aov <file>      Write the albedo, normal and depth of the first hits to\n"
+              << "                    <file> with _albedo, _normal and _depth added to the name\n"
+              << "  --bench-denoise <spp>\n"
+              << "                    Compare the error and time of renders up to --spp with and\n"
+              << "                    without denoising against a reference at <spp>\n"
+              << "  --stats <file>    Write ray, intersection and bounce counters and tile\n"
+              << "                    timings as JSON (needs a build with RTIW_STATS=1)\n"
+              << "  --cost-heatmap <file>\n"
+              << "                    Write the render time per pixel as a PPM heatmap\n"
+              << "                    (needs a build with RTIW_STATS=1)\n"
+              << "  --save-scene <file>\n"
+              << "                    Write the scene as a text scene file\n"
+              << "  --save-cache <file>\n"
+              << "                    Write the compiled scene as a binary cache (.rtsc) that\n"
+              << "                    later runs map and use without parsing or a BVH build\n"
+              << "  --checkpoint <file>\n"
+              << "                    Save the render's progress to <file> periodically and at\n"
+              << "                    the end\n"
+              << "  --checkpoint-interval <seconds>\n"
+              << "                    Time between checkpoints (default: 60)\n"
+              << "  --resume          Continue the render saved in the --checkpoint file\n"
+              << "  --add-samples <n> Refine the render saved in the --checkpoint file with <n>\n"
+              << "                    more samples per pixel\n"
+              << "  --coordinator <address>\n"
+              << "                    Distribute the tiles to worker processes connecting to\n"
+              << "                    unix:<path> or <host>:<port>\n"
+              << "  --spawn-workers <n>\n"
+              << "                    Start <n> workers on this machine (with --coordinator;\n"
+              << "                    --threads is then the thread count of each worker)\n"
+              << "  --compare-local   Also render in-process on as many threads as the workers\n"
+              << "                    had and report the scaling efficiency\n"
+              << "  --worker <address>\n"
+              << "                    Render tiles for the coordinator at <address>\n"
+              << "  --frames <n>      Render a sequence of <n> frames to numbered files\n"
+              << "                    (<output>_0000.ppm, ...); without --animation the\n"
+              << "                    camera turns once around the scene\n"
+              << "  --animation <file>\n"
+              << "                    Render the sequence keyed by an animation file\n"
+              << "  --compare-rebuild Time a full rebuild of the top-level BVH for every frame\n"
+              << "                    of a sequence next to the refit it uses\n"
+              << "  --serve <address> Run as a render server on unix:<path> or <host>:<port>,\n"
+              << "                    keeping scenes and threads between the jobs it is sent\n"
+              << "  --submit <address>\n"
+              << "                    Render on the server at <address> instead of in process\n"
+              << "  --priority <n>    Priority of a submitted job; higher runs first (default: 0)\n"
+              << "  --region <x0,y0,x1,y1>\n"
+              << "                    Only render these pixels of a submitted job\n"
+              << "  --camera \"<from x y z> <at x y z> <up x y z> <vfov>\"\n"
+              << "                    Camera of a submitted job instead of the scene's\n"
+              << "  --server-metrics <address>\n"
+              << "                    Print the queue depth, latencies and throughput of the\n"
+              << "                    server at <address> as JSON\n";
+}
+
+// Returns false (after printing the usage) if the command line could not be parsed
+inline bool ParseOptions(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(arg, "--threads") && hasValue) {
+            opts.NumThreads = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--seed") && hasValue) {
+            opts.Seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(arg, "--output") && hasValue) {
+            opts.OutputFile = argv[++i];
+        } else if (!strcmp(arg, "--format") && hasValue) {
+            if (!ParseImageFormat(argv[++i], opts.Format)) {
+                std::cerr << "Unknown image format '" << argv[i] << "'\n";
+                return false;
+            }
+            opts.FormatSet = true;
+        } else if (!strcmp(arg, "--mmap")) {
+            opts.MmapOutput = true;
+        } else if (!strcmp(arg, "--width") && hasValue) {
+            opts.ImageWidth = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--accel") && hasValue) {
+            opts.Accel = argv[++i];
+            if (opts.Accel != "compiled" && opts.Accel != "bvh" && opts.Accel != "list" &&
+                opts.Accel != "group" && opts.Accel != "bvh-group") {
+                std::cerr << "Unknown acceleration structure '" << opts.Accel << "'\n";
+                return false;
+            }
+        } else if (!strcmp(arg, "--scene") && hasValue) {
+            opts.Scene = argv[++i];
+        } else if (!strcmp(arg, "--spheres") && hasValue) {
+            opts.SphereCount = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--simd") && hasValue) {
+            if (!ParseSimdLevel(argv[++i], opts.MaxSimd)) {
+                std::cerr << "Unknown SIMD level '" << argv[i] << "'\n";
+                return false;
+            }
+        } else if (!strcmp(arg, "--bench-intersect") && hasValue) {
+            opts.BenchIntersectRays = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--check-vec3") && hasValue) {
+            opts.CheckVec3Inputs = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--spp") && hasValue) {
+            opts.SamplesPerPixel = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--sampler") && hasValue) {
+            if (!ParseSamplerType(argv[++i], opts.Sampling)) {
+                std::cerr << "Unknown sampler '" << argv[i] << "'\n";
+                return false;
+            }
+        } else if (!strcmp(arg, "--integrator") && hasValue) {
+            if (!ParseIntegratorType(argv[++i], opts.Integrator)) {
+                std::cerr << "Unknown integrator '" << argv[i] << "'\n";
+                return false;
+            }
+        } else if (!strcmp(arg, "--adaptive") && hasValue) {
+            opts.AdaptiveThreshold = (float)atof(argv[++i]);
+        } else if (!strcmp(arg, "--adaptive-min") && hasValue) {
+            opts.AdaptiveMinSamples = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--adaptive-max") && hasValue) {
+            opts.AdaptiveMaxSamples = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--spp-heatmap") && hasValue) {
+            opts.SppHeatmapFile = argv[++i];
+        } else if (!strcmp(arg, "--denoise")) {
+            opts.Denoise = true;
+        } else if (!strcmp(arg, "--aov") && hasValue) {
+            opts.AovFile = argv[++i];
+        } else if (!strcmp(arg, "--bench-denoise") && hasValue) {
+            opts.BenchDenoiseSpp = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--stats") && hasValue) {
+            opts.StatsFile = argv[++i];
+        } else if (!strcmp(arg, "--cost-heatmap") && hasValue) {
+            opts.CostHeatmapFile = argv[++i];
+        } else if (!strcmp(arg, "--save-scene") && hasValue) {
+            opts.SaveSceneFile = argv[++i];
+        } else if (!strcmp(arg, "--save-cache") && hasValue) {
+            opts.SaveCacheFile = argv[++i];
+        } else if (!strcmp(arg, "--checkpoint") && hasValue) {
+            opts.CheckpointFile = argv[++i];
+        } else if (!strcmp(arg, "--checkpoint-interval") && hasValue) {
+            opts.CheckpointInterval = atof(argv[++i]);
+        } else if (!strcmp(arg, "--resume")) {
+            opts.Resume = true;
+        } else if (!strcmp(arg, "--add-samples") && hasValue) {
+            opts.AddSamples = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--coordinator") && hasValue) {
+            opts.CoordinatorAddress = argv[++i];
+        } else if (!strcmp(arg, "--spawn-workers") && hasValue) {
+            opts.SpawnWorkers = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--compare-local")) {
+            opts.CompareLocal = true;
+        } else if (!strcmp(arg, "--worker") && hasValue) {
+            opts.WorkerAddress = argv[++i];
+        } else if (!strcmp(arg, "--frames") && hasValue) {
+            opts.Frames = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--animation") && hasValue) {
+            opts.AnimationFile = argv[++i];
+        } else if (!strcmp(arg, "--compare-rebuild")) {
+            opts.CompareRebuild = true;
+        } else if (!strcmp(arg, "--serve") && hasValue) {
+            opts.ServeAddress = argv[++i];
+        } else if (!strcmp(arg, "--submit") && hasValue) {
+            opts.SubmitAddress = argv[++i];
+        } else if (!strcmp(arg, "--priority") && hasValue) {
+            opts.Priority = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--region") && hasValue) {
+            Tile& r = opts.Region;
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &r.X0, &r.Y0, &r.X1, &r.Y1) != 4 ||
+                r.X0 < 0 || r.Y0 < 0 || r.X1 <= r.X0 || r.Y1 <= r.Y0) {
+                std::cerr << "Invalid region '" << argv[i] << "', expected x0,y0,x1,y1\n";
+                return false;
+            }
+        } else if (!strcmp(arg, "--camera") && hasValue) {
+            CameraSetup& cam = opts.Camera;
+            float v[10];
+            char extra;
+            if (sscanf(argv[++i], "%f %f %f %f %f %f %f %f %f %f %c", &v[0], &v[1], &v[2], &v[3],
+                       &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &extra) != 10) {
+                std::cerr << "Invalid camera '" << argv[i] << "', expected ten numbers\n";
+                return false;
+            }
+            cam.Set = true;
+            cam.LookFrom = point3(v[0], v[1], v[2]);
+            cam.LookAt = point3(v[3], v[4], v[5]);
+            cam.Up = vec3(v[6], v[7], v[8]);
+            cam.Vfov = v[9];
+        } else if (!strcmp(arg, "--server-metrics") && hasValue) {
+            opts.MetricsAddress = argv[++i];
+        } else {
+            std::cerr << "Unknown or incomplete option '" << arg << "'\n";
+            PrintUsage(argv[0]);
+            return false;
+        }
+    }
+
+    if (opts.AdaptiveThreshold > 0.f && opts.Integrator == IntegratorType::Wavefront) {
+        std::cerr << "Adaptive sampling only works with the recursive integrator\n";
+        return false;
+    }
+    // A pixel needs two samples to estimate its error, so one would overrun the budget
+    if (opts.AdaptiveThreshold > 0.f && opts.SamplesPerPixel != 0 && opts.SamplesPerPixel < 2) {
+        std::cerr << "Adaptive sampling needs --spp 2 or more\n";
+        return false;
+    }
+    if ((opts.Resume || opts.AddSamples > 0) && opts.CheckpointFile.empty()) {
+        std::cerr << "--resume and --add-samples need a --checkpoint file\n";
+        return false;
+    }
+    if (!opts.CheckpointFile.empty() && opts.AdaptiveThreshold > 0.f) {
+        std::cerr << "Checkpoints do not support adaptive sampling\n";
+        return false;
+    }
+    if (opts.AddSamples > 0 && opts.Integrator == IntegratorType::Wavefront) {
+        std::cerr << "--add-samples needs the recursive integrator\n";
+        return false;
+    }
+    bool coordinating = !opts.CoordinatorAddress.empty();
+    if ((opts.SpawnWorkers > 0 || opts.CompareLocal) && !coordinating) {
+        std::cerr << "--spawn-workers and --compare-local need --coordinator\n";
+        return false;
+    }
+    if (coordinating && !opts.WorkerAddress.empty()) {
+        std::cerr << "A process is either a --coordinator or a --worker\n";
+        return false;
+    }
+    if (coordinating && (opts.AdaptiveThreshold > 0.f || !opts.CheckpointFile.empty() ||
+                         opts.Accel != "compiled" || opts.BenchIntersectRays > 0)) {
+        std::cerr << "Distributed renders use the compiled scene, without adaptive sampling or "
+                     "checkpoints\n";
+        return false;
+    }
+    bool needsCompiled = EndsWith(opts.Scene, ".rtsc") || !opts.SaveSceneFile.empty() ||
+                         !opts.SaveCacheFile.empty();
+    if (needsCompiled && (opts.Accel != "compiled" || opts.BenchIntersectRays > 0)) {
+        std::cerr << "Scene caches and --save-scene/--save-cache need --accel compiled\n";
+        return false;
+    }
+    bool features = opts.Denoise || !opts.AovFile.empty() || opts.BenchDenoiseSpp > 0;
+    if (features && (opts.Integrator == IntegratorType::Wavefront ||
+                     !opts.CheckpointFile.empty() || coordinating)) {
+        std::cerr << "Denoising and --aov need the recursive integrator, without checkpoints or "
+                     "workers\n";
+        return false;
+    }
+    bool sequence = opts.Frames > 0 || !opts.AnimationFile.empty();
+    if (opts.CompareRebuild && !sequence) {
+        std::cerr << "--compare-rebuild needs --frames or --animation\n";
+        return false;
+    }
+    if (sequence && (opts.Accel != "compiled" || opts.BenchIntersectRays > 0 || coordinating ||
+                     !opts.CheckpointFile.empty())) {
+        std::cerr << "Sequences use the compiled scene, without checkpoints or workers\n";
+        return false;
+    }
+    bool serving = !opts.ServeAddress.empty();
+    bool submitting = !opts.SubmitAddress.empty();
+    int roles = serving + submitting + coordinating + !opts.WorkerAddress.empty() +
+                !opts.MetricsAddress.empty();
+    if (roles > 1) {
+        std::cerr << "--serve, --submit, --server-metrics, --coordinator and --worker exclude "
+                     "each other\n";
+        return false;
+    }
+    if ((opts.Priority != 0 || opts.Region.X1 > 0 || opts.Camera.Set) && !submitting) {
+        std::cerr << "--priority, --region and --camera need --submit\n";
+        return false;
+    }
+    if ((serving || submitting) &&
+        (opts.AdaptiveThreshold > 0.f || !opts.CheckpointFile.empty() || features || sequence ||
+         opts.Accel != "compiled" || opts.BenchIntersectRays > 0)) {
+        std::cerr << "The render server renders single frames of the compiled scene, without "
+                     "adaptive sampling, checkpoints or denoising\n";
+        return false;
+    }
+    if (!RTIW_STATS && (!opts.StatsFile.empty() || !opts.CostHeatmapFile.empty())) {
+        std::cerr << "--stats and --cost-heatmap need a build with RTIW_STATS=1\n";
+        return false;
+    }
+    return true;
+}
+} // namespace rtiw
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "color.h"
+#include "framebuffer.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rtiw
+{
+// Live numbers of a progressive render
+struct ProgressiveStatus
+{
+    // Samples per pixel accumulated so far
+    int Passes = 0;
+    bool Converged = false;
+    // Throughput of the last pass
+    double SamplesPerSecond = 0.0;
+    double RaysPerSecond = 0.0;
+};
+
+// Renders a scene progressively on a background thread for interactive viewers. Every pass adds
+// one sample to every pixel of a float accumulation buffer and publishes the tone-mapped result
+// as RGBA8, so a first image is available after a single pass. After SamplesPerPixel passes the
+// image matches Render() exactly and the thread goes idle. Changes to the camera or scene go
+// through Restart(), which runs them between passes and starts accumulating again.
+template <typename Scene>
+class ProgressiveRenderer
+{
+  public:
+    // Change queued with Restart(); it runs on the render thread while no pass is in flight
+    using Change = std::function<void(Scene&, Camera&)>;
+
+    ProgressiveRenderer(Scene& world, const Camera& cam, const RenderSettings& settings,
+                        ThreadPool& pool)
+        : m_World(world), m_Camera(cam), m_Settings(settings), m_Pool(pool)
+    {
+    }
+    ~ProgressiveRenderer() { Stop(); }
+    ProgressiveRenderer(const ProgressiveRenderer&) = delete;
+    ProgressiveRenderer& operator=(const ProgressiveRenderer&) = delete;
+
+    void Start();
+    void Stop();
+
+    // Queues change and restarts accumulation once it has run. Thread-safe; the pass in flight
+    // is abandoned.
+    void Restart(Change change);
+
+    // Copies the newest finished pass into pixels (width * height * 4 bytes, rows top to bottom)
+    // if it has not been taken yet. Never waits for a pass.
+    bool TakeFrame(std::vector<unsigned char>& pixels);
+
+    ProgressiveStatus Status() const;
+
+  private:
+    void RenderLoop();
+    // Adds one sample to every pixel. Returns false if a restart interrupted the pass.
+    bool RenderPass(uint32_t sampleIndex, uint64_t& rays);
+    void Publish(const ProgressiveStatus& status);
+
+    Scene& m_World;
+    Camera m_Camera;
+    const RenderSettings m_Settings;
+    ThreadPool& m_Pool;
+    Framebuffer m_Accumulated;
+    std::vector<Tile> m_Tiles;
+
+    std::thread m_Thread;
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+    std::vector<Change> m_Changes;
+    std::atomic<bool> m_RestartPending{false};
+    bool m_Stop = false;
+
+    // Latest published frame, guarded by m_Mutex
+    std::vector<unsigned char> m_Frame;
+    std::vector<unsigned char> m_Staging;
+    bool m_FrameTaken = true;
+    ProgressiveStatus m_Status;
+};
+
+template <typename Scene>
+void ProgressiveRenderer<Scene>::Start()
+{
+    m_Accumulated.Resize(m_Settings.ImageWidth, m_Settings.ImageHeight);
+    m_Tiles = MakeTiles(m_Settings.ImageWidth, m_Settings.ImageHeight, m_Settings.TileSize);
+    m_Stop = false;
+    m_Thread = std::thread(&ProgressiveRenderer::RenderLoop, this);
+}
+
+template <typename Scene>
+void ProgressiveRenderer<Scene>::Stop()
+{
+    if (!m_Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_RestartPending = true;
+    m_Wake.notify_one();
+    m_Thread.join();
+}
+
+template <typename Scene>
+void ProgressiveRenderer<Scene>::Restart(Change change)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Changes.push_back(std::move(change));
+    }
+    m_RestartPending = true;
+    m_Wake.notify_one();
+}
+
+template <typename Scene>
+bool ProgressiveRenderer<Scene>::TakeFrame(std::vector<unsigned char>& pixels)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_FrameTaken)
+        return false;
+    pixels = m_Frame;
+    m_FrameTaken = true;
+    return true;
+}
+
+template <typename Scene>
+ProgressiveStatus ProgressiveRenderer<Scene>::Status() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Status;
+}
+
+template <typename Scene>
+bool ProgressiveRenderer<Scene>::RenderPass(uint32_t sampleIndex, uint64_t& rays)
+{
+    std::atomic<uint64_t> passRays{0};
+    m_Pool.ParallelFor((int)m_Tiles.size(), [&](int t, int) {
+        // Skip the rest of the pass once it is going to be thrown away
+        if (m_RestartPending)
+            return;
+        // Created like in RenderTile(), so sample s of a pixel is the same in both
+        std::unique_ptr<Sampler> sampler =
+            MakeSampler(m_Settings.Sampling, m_Settings.SamplerBlock(), m_Settings.Seed);
+        ActiveSampler() = sampler.get();
+
+        const Tile& tile = m_Tiles[t];
+        uint64_t tileRays = 0;
+        for (int y = tile.Y0; y < tile.Y1; y++) {
+            for (int i = tile.X0; i < tile.X1; i++) {
+                SamplePixel(m_World, m_Camera, m_Settings, *sampler, i, y, sampleIndex, 1,
+                            m_Accumulated.At(i, y), tileRays);
+                m_Accumulated.SampleCount(i, y) = sampleIndex + 1;
+            }
+        }
+        passRays += tileRays;
+
+        ActiveSampler() = nullptr;
+    });
+    rays = passRays;
+    return !m_RestartPending;
+}
+
+template <typename Scene>
+void ProgressiveRenderer<Scene>::Publish(const ProgressiveStatus& status)
+{
+    const int width = m_Accumulated.Width();
+    const int height = m_Accumulated.Height();
+    m_Staging.resize((size_t)width * height * 4);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            color c = UnNormalizeColor(m_Accumulated.At(x, y), m_Accumulated.SampleCount(x, y));
+            unsigned char* p = &m_Staging[4 * ((size_t)y * width + x)];
+            p[0] = (unsigned char)c[0];
+            p[1] = (unsigned char)c[1];
+            p[2] = (unsigned char)c[2];
+            p[3] = 255;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    std::swap(m_Frame, m_Staging);
+    m_FrameTaken = false;
+    m_Status = status;
+}
+
+template <typename Scene>
+void ProgressiveRenderer<Scene>::RenderLoop()
+{
+    const uint32_t targetPasses = (uint32_t)m_Settings.SamplesPerPixel;
+    const double pixelCount = (double)m_Settings.ImageWidth * m_Settings.ImageHeight;
+    uint32_t pass = 0;
+    // An interrupted pass left some pixels with one sample more than others
+    bool interrupted = false;
+    std::vector<Change> changes;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            // Once converged there is nothing to do until something changes
+            m_Wake.wait(lock, [&] { return m_Stop || pass < targetPasses || !m_Changes.empty(); });
+            if (m_Stop)
+                return;
+            std::swap(changes, m_Changes);
+            m_RestartPending = false;
+        }
+
+        if (!changes.empty() || interrupted) {
+            // No pass is running, so the changes may touch the scene. They run unlocked, so a
+            // slow one (reloading the scene) does not stall the viewer.
+            for (const Change& change : changes)
+                change(m_World, m_Camera);
+            changes.clear();
+            m_Accumulated.Clear();
+            pass = 0;
+            interrupted = false;
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Status = ProgressiveStatus();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t rays = 0;
+        if (!RenderPass(pass, rays)) {
+            interrupted = true;
+            continue;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                             .count();
+        pass++;
+
+        ProgressiveStatus status;
+        status.Passes = (int)pass;
+        status.Converged = pass == targetPasses;
+        status.SamplesPerSecond = pixelCount / std::max(seconds, 1e-9);
+        status.RaysPerSecond = rays / std::max(seconds, 1e-9);
+        Publish(status);
+    }
+}
+} // namespace rtiw
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+
+namespace rtiw
+{
+// Mixes the bits of a 32-bit value so nearby inputs (pixel indices) give unrelated outputs
+inline uint32_t HashU32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint64_t HashU64(uint64_t x)
+{
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for
+// Random Number Generation"). 16 bytes of state, so seeding one per sample is cheap.
+class PCG32
+{
+  public:
+    PCG32() { Seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+    PCG32(uint64_t initState, uint64_t stream) { Seed(initState, stream); }
+
+    void Seed(uint64_t initState, uint64_t stream)
+    {
+        m_State = 0;
+        m_Inc = (stream << 1) | 1;
+        NextU32();
+        m_State += initState;
+        NextU32();
+    }
+
+    uint32_t NextU32()
+    {
+        uint64_t old = m_State;
+        m_State = old * 6364136223846793005ull + m_Inc;
+        uint32_t xorShifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorShifted >> rot) | (xorShifted << ((0u - rot) & 31));
+    }
+
+    // Returns a random real number in [0, 1)
+    float NextFloat() { return (float)(NextU32() >> 8) * (1.f / 16777216.f); }
+
+  private:
+    uint64_t m_State;
+    uint64_t m_Inc;
+};
+
+// Generator of the calling thread. Workers never share it, so there is no contention.
+inline PCG32& ThreadRNG()
+{
+    thread_local PCG32 rng;
+    return rng;
+}
+
+// Restarts the calling thread's generator for one sample of one pixel. Every (seed, pixel,
+// sample) triple gets its own sequence, so the result does not depend on which thread takes
+// which pixel, or in which order.
+inline void SeedRand(uint32_t seed, uint32_t pixelIndex, uint32_t sampleIndex)
+{
+    uint64_t key = ((uint64_t)pixelIndex << 32) | sampleIndex;
+    ThreadRNG().Seed(HashU64(key ^ HashU64(seed)), pixelIndex);
+}
+
+struct Sample2D
+{
+    float U, V;
+};
+
+// Source of sample points for one sample of one pixel. Consecutive calls to Get2D() return the
+// next dimensions of the sample: the first pair jitters the pixel position, later pairs choose
+// bounce directions.
+class Sampler
+{
+  public:
+    virtual ~Sampler() {}
+
+    virtual void StartSample(uint32_t pixelIndex, uint32_t sampleIndex) = 0;
+    virtual Sample2D Get2D() = 0;
+
+    // Index of the next dimension pair. Integrators that interleave many paths save it per path
+    // and restore it with StartSample() + SetDimension().
+    virtual uint32_t Dimension() const = 0;
+    virtual void SetDimension(uint32_t dimension) = 0;
+};
+
+// Sampler used by the bounce direction helpers on this thread. nullptr means plain random
+// numbers from ThreadRNG().
+inline Sampler*& ActiveSampler()
+{
+    thread_local Sampler* sampler = nullptr;
+    return sampler;
+}
+
+inline Sample2D Random2D()
+{
+    if (Sampler* sampler = ActiveSampler())
+        return sampler->Get2D();
+    PCG32& rng = ThreadRNG();
+    float u = rng.NextFloat();
+    return {u, rng.NextFloat()};
+}
+} // namespace rtiw
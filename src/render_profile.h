@@ -0,0 +1,151 @@
+#pragma once
+
+#include "render_settings.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace rtiw
+{
+using ProfileClock = std::chrono::steady_clock;
+
+inline double ElapsedMS(ProfileClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(ProfileClock::now() - start).count();
+}
+
+// Where the time of a frame went: the thread time spent on every pixel and tile. Filled by the
+// renderers when RTIW_STATS is on; each pixel and tile is only timed by the thread rendering it.
+class RenderProfile
+{
+  public:
+    static RenderProfile& Get()
+    {
+        static RenderProfile profile;
+        return profile;
+    }
+
+    // Clears the timings and the counters of every thread for a new frame. Only call while no
+    // render is running.
+    void Begin(const RenderSettings& settings);
+
+    void AddPixelTime(int x, int y, double ms) { m_PixelMS[(size_t)y * m_Width + x] += (float)ms; }
+    void AddTileTime(const Tile& tile, double ms)
+    {
+        m_TileMS[(size_t)(tile.Y0 / m_TileSize) * m_TilesX + tile.X0 / m_TileSize] += ms;
+    }
+
+    int Width() const { return m_Width; }
+    int Height() const { return m_Height; }
+    int TileSize() const { return m_TileSize; }
+    int TilesX() const { return m_TilesX; }
+    // Rows top to bottom, like the framebuffer
+    const std::vector<float>& PixelMS() const { return m_PixelMS; }
+    const std::vector<double>& TileMS() const { return m_TileMS; }
+
+  private:
+    int m_Width = 0;
+    int m_Height = 0;
+    int m_TileSize = 1;
+    int m_TilesX = 0;
+    std::vector<float> m_PixelMS;
+    std::vector<double> m_TileMS;
+};
+
+void RenderProfile::Begin(const RenderSettings& settings)
+{
+    m_Width = settings.ImageWidth;
+    m_Height = settings.ImageHeight;
+    m_TileSize = settings.TileSize;
+    m_TilesX = (m_Width + m_TileSize - 1) / m_TileSize;
+    int tilesY = (m_Height + m_TileSize - 1) / m_TileSize;
+    m_PixelMS.assign((size_t)m_Width * m_Height, 0.f);
+    m_TileMS.assign((size_t)m_TilesX * tilesY, 0.0);
+    CounterRegistry::Get().Reset();
+}
+
+// Writes the counters and timings of the last frame as JSON. renderMS is the wall time of the
+// whole render. Returns false if the file cannot be written.
+bool WriteStatsJSON(const std::string& filename, const RenderSettings& settings,
+                    const RenderCounters& counters, const RenderProfile& profile,
+                    double renderMS, int threads)
+{
+    std::ofstream out(filename);
+    if (!out)
+        return false;
+
+    uint64_t secondary = counters.SceneQueries - counters.PrimaryRays;
+    out << "{\n";
+    out << "  \"image\": {\"width\": " << settings.ImageWidth
+        << ", \"height\": " << settings.ImageHeight << ", \"spp\": " << settings.SamplesPerPixel
+        << ", \"max_depth\": " << settings.MaxDepth << ", \"tile_size\": " << settings.TileSize
+        << "},\n";
+    out << "  \"threads\": " << threads << ",\n";
+    out << "  \"render_ms\": " << renderMS << ",\n";
+    out << "  \"rays\": {\"primary\": " << counters.PrimaryRays << ", \"secondary\": " << secondary
+        << ", \"total\": " << counters.SceneQueries << "},\n";
+    out << "  \"hits\": " << counters.Hits << ",\n";
+    out << "  \"misses\": " << counters.Misses << ",\n";
+    out << "  \"primitive_tests\": " << counters.PrimitiveTests << ",\n";
+    out << "  \"bvh_node_visits\": " << counters.NodeVisits << ",\n";
+    out << "  \"scatters\": " << counters.Scatters << ",\n";
+    out << "  \"absorbed\": " << counters.Absorbed << ",\n";
+
+    // A path whose last ray left with remaining depth d traced MaxDepth - d + 1 rays. Paths cut
+    // off by the bounce limit traced MaxDepth rays and are listed separately.
+    std::vector<uint64_t> lengths(settings.MaxDepth + 1, 0);
+    for (size_t d = 1; d < counters.EndsAtDepth.size() && (int)d <= settings.MaxDepth; d++)
+        lengths[settings.MaxDepth - d + 1] += counters.EndsAtDepth[d];
+    size_t longest = lengths.size();
+    while (longest > 1 && lengths[longest - 1] == 0)
+        longest--;
+    out << "  \"path_length_histogram\": [";
+    for (size_t n = 1; n < longest; n++)
+        out << (n > 1 ? ", " : "") << lengths[n];
+    out << "],\n";
+    out << "  \"depth_limit_reached\": " << counters.DepthLimitReached << ",\n";
+
+    // Tiles, slowest first
+    const std::vector<double>& tileMS = profile.TileMS();
+    std::vector<size_t> order(tileMS.size());
+    for (size_t t = 0; t < order.size(); t++)
+        order[t] = t;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return tileMS[a] > tileMS[b] || (tileMS[a] == tileMS[b] && a < b);
+    });
+    double tileTotal = 0.0;
+    for (double ms : tileMS)
+        tileTotal += ms;
+    out << "  \"tiles\": {\"count\": " << tileMS.size();
+    if (!order.empty()) {
+        out << ", \"total_ms\": " << tileTotal << ", \"max_ms\": " << tileMS[order.front()]
+            << ", \"median_ms\": " << tileMS[order[order.size() / 2]]
+            << ", \"min_ms\": " << tileMS[order.back()] << ", \"slowest\": [";
+        for (size_t k = 0; k < std::min<size_t>(10, order.size()); k++) {
+            size_t t = order[k];
+            out << (k > 0 ? ", " : "") << "{\"x\": " << t % profile.TilesX() * profile.TileSize()
+                << ", \"y\": " << t / profile.TilesX() * profile.TileSize()
+                << ", \"ms\": " << tileMS[t] << "}";
+        }
+        out << "]";
+    }
+    out << "},\n";
+
+    // Thread time per row of pixels, top to bottom
+    out << "  \"scanline_ms\": [";
+    const std::vector<float>& pixelMS = profile.PixelMS();
+    for (int y = 0; y < profile.Height(); y++) {
+        double rowMS = 0.0;
+        for (int x = 0; x < profile.Width(); x++)
+            rowMS += pixelMS[(size_t)y * profile.Width() + x];
+        out << (y > 0 ? ", " : "") << rowMS;
+    }
+    out << "]\n";
+    out << "}\n";
+    return (bool)out;
+}
+} // namespace rtiw
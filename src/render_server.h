@@ -0,0 +1,913 @@
+#pragma once
+
+// Render server: a long-running process that keeps scenes and render threads resident and renders
+// the jobs that clients submit over a socket, streaming every tile back as soon as it is done.
+// POSIX only, like distributed.h, whose message framing and socket helpers it uses:
+//
+//   client -> server   Submit        priority, settings, region and camera, then the scene name
+//   server -> client   Accepted      the job's id
+//   server -> client   JobTile       a finished tile of the job: its float sums and sample counts
+//   server -> client   JobFinished   the job's timings, after its last tile
+//   server -> client   JobFailed     the job was rejected, followed by the reason
+//   client -> server   MetricsQuery
+//   server -> client   Metrics       queue depth, latency percentiles and throughput as JSON
+//
+// A connection may submit any number of jobs; their messages are interleaved.
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rtiw
+{
+// A render job as clients submit it
+struct RenderRequest
+{
+    // As for --scene and --spheres. The seed of Settings also seeds the built-in scenes.
+    std::string Scene = "default";
+    int SphereCount = 10000;
+    RenderSettings Settings;
+    // Jobs with a higher priority take over the render threads at the next tile
+    int Priority = 0;
+    // Pixels to render, [X0, X1) x [Y0, Y1); an empty region renders the whole frame
+    Tile Region = {0, 0, 0, 0};
+    // Replaces the scene's camera if set
+    CameraSetup Camera;
+    float AspectRatio = 16.f / 9.f;
+
+    bool HasRegion() const { return Region.X1 > Region.X0 && Region.Y1 > Region.Y0; }
+};
+
+// The tiles of the request's frame, in render order, cut down to its region
+std::vector<Tile> RegionTiles(const RenderRequest& request)
+{
+    const RenderSettings& settings = request.Settings;
+    std::vector<Tile> tiles = MakeTiles(settings.ImageWidth, settings.ImageHeight,
+                                        settings.TileSize);
+    if (!request.HasRegion())
+        return tiles;
+    std::vector<Tile> inside;
+    for (const Tile& tile : tiles) {
+        Tile cut = {std::max(tile.X0, request.Region.X0), std::max(tile.Y0, request.Region.Y0),
+                    std::min(tile.X1, request.Region.X1), std::min(tile.Y1, request.Region.Y1)};
+        if (cut.X0 < cut.X1 && cut.Y0 < cut.Y1)
+            inside.push_back(cut);
+    }
+    return inside;
+}
+
+// What the server measured of a finished job, from the moment it received it
+struct RenderJobReport
+{
+    uint64_t Job = 0;
+    uint64_t Samples = 0;
+    uint64_t Rays = 0;
+    // Until the first tile started rendering, until it was queued to be sent and until the last
+    // one was
+    double QueuedMS = 0.0;
+    double FirstTileMS = 0.0;
+    double TotalMS = 0.0;
+};
+
+namespace detail
+{
+// Followed by the scene name
+struct SubmitMessage
+{
+    int32_t Priority;
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t SamplesPerPixel;
+    uint32_t MaxDepth;
+    uint32_t TileSize;
+    uint32_t Seed;
+    uint32_t Sampling;
+    uint32_t Integrator;
+    uint32_t SphereCount;
+    TileMessage Region;
+    uint32_t HasCamera;
+    float LookFrom[3];
+    float LookAt[3];
+    float Up[3];
+    float Vfov;
+    float AspectRatio;
+};
+
+struct AcceptedMessage
+{
+    uint64_t Job;
+};
+
+// Followed by the tile's RGB float sums and uint32 sample counts, rows top to bottom
+struct JobTileMessage
+{
+    uint64_t Job;
+    TileMessage Tile;
+    uint32_t Padding;
+};
+
+struct JobFinishedMessage
+{
+    uint64_t Job;
+    uint64_t Samples;
+    uint64_t Rays;
+    double QueuedMS;
+    double FirstTileMS;
+    double TotalMS;
+};
+
+// Followed by the reason
+struct JobFailedMessage
+{
+    uint64_t Job;
+};
+
+inline SubmitMessage ToSubmitMessage(const RenderRequest& request)
+{
+    const RenderSettings& settings = request.Settings;
+    SubmitMessage message = {};
+    message.Priority = request.Priority;
+    message.Width = (uint32_t)settings.ImageWidth;
+    message.Height = (uint32_t)settings.ImageHeight;
+    message.SamplesPerPixel = (uint32_t)settings.SamplesPerPixel;
+    message.MaxDepth = (uint32_t)settings.MaxDepth;
+    message.TileSize = (uint32_t)settings.TileSize;
+    message.Seed = settings.Seed;
+    message.Sampling = (uint32_t)settings.Sampling;
+    message.Integrator = (uint32_t)settings.Integrator;
+    message.SphereCount = (uint32_t)request.SphereCount;
+    message.Region = ToTileMessage(0, request.Region);
+    message.HasCamera = request.Camera.Set;
+    for (int a = 0; a < 3; a++) {
+        message.LookFrom[a] = request.Camera.LookFrom[a];
+        message.LookAt[a] = request.Camera.LookAt[a];
+        message.Up[a] = request.Camera.Up[a];
+    }
+    message.Vfov = request.Camera.Vfov;
+    message.AspectRatio = request.AspectRatio;
+    return message;
+}
+
+inline RenderRequest FromSubmitMessage(const SubmitMessage& message, std::string scene)
+{
+    RenderRequest request;
+    request.Scene = std::move(scene);
+    request.SphereCount = (int)message.SphereCount;
+    RenderSettings& settings = request.Settings;
+    settings.ImageWidth = (int)message.Width;
+    settings.ImageHeight = (int)message.Height;
+    settings.SamplesPerPixel = (int)message.SamplesPerPixel;
+    settings.MaxDepth = (int)message.MaxDepth;
+    settings.TileSize = (int)message.TileSize;
+    settings.Seed = message.Seed;
+    settings.Sampling = (SamplerType)message.Sampling;
+    settings.Integrator = (IntegratorType)message.Integrator;
+    request.Priority = message.Priority;
+    request.Region = ToTile(message.Region);
+    request.Camera.Set = message.HasCamera != 0;
+    for (int a = 0; a < 3; a++) {
+        request.Camera.LookFrom[a] = message.LookFrom[a];
+        request.Camera.LookAt[a] = message.LookAt[a];
+        request.Camera.Up[a] = message.Up[a];
+    }
+    request.Camera.Vfov = message.Vfov;
+    request.AspectRatio = message.AspectRatio;
+    return request;
+}
+
+// Why the server would not render request, or an empty string if it would
+inline std::string CheckRequest(const RenderRequest& request)
+{
+    const RenderSettings& settings = request.Settings;
+    const int MAX_SIZE = 16384;
+    if (settings.ImageWidth < 1 || settings.ImageWidth > MAX_SIZE || settings.ImageHeight < 1 ||
+        settings.ImageHeight > MAX_SIZE)
+        return "the image must be 1 to " + std::to_string(MAX_SIZE) + " pixels wide and high";
+    if (settings.SamplesPerPixel < 1 || settings.MaxDepth < 1 || settings.TileSize < 1)
+        return "samples per pixel, bounces and tile size must be positive";
+    if ((uint32_t)settings.Sampling > (uint32_t)SamplerType::R2 ||
+        (uint32_t)settings.Integrator > (uint32_t)IntegratorType::Wavefront)
+        return "unknown sampler or integrator";
+    if (!(request.AspectRatio > 0.f))
+        return "the aspect ratio must be positive";
+    // The spheres scene allocates every sphere; instances only the cube root of them
+    const int MAX_SPHERES = 10000000;
+    if (request.SphereCount < 0 ||
+        (request.Scene == "spheres" && request.SphereCount > MAX_SPHERES))
+        return "the sphere count must be 0 to " + std::to_string(MAX_SPHERES);
+    const Tile& region = request.Region;
+    if (request.HasRegion() && (region.X0 < 0 || region.Y0 < 0 ||
+                                region.X1 > settings.ImageWidth ||
+                                region.Y1 > settings.ImageHeight))
+        return "the region lies outside the image";
+    return "";
+}
+
+// Identifies the scene of request among the resident ones. Only the generated scenes depend on
+// the sphere count and the seed; scene files and the default scene do not.
+inline std::string SceneKey(const RenderRequest& request)
+{
+    const std::string& name = request.Scene;
+    std::string key = name;
+    if (name == "spheres" || name == "instances")
+        key += "\n" + std::to_string(request.SphereCount);
+    if (name == "spheres" || name == "instances" || name == "final")
+        key += "\n" + std::to_string(request.Settings.Seed);
+    return key;
+}
+
+// The p-th percentile (0 to 100) of values by the nearest rank, 0 without values
+inline double Percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    size_t rank = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+} // namespace detail
+
+// Loads the scene of a request in its compiled form, with the camera the scene sets up
+using ServerSceneLoader =
+    std::function<bool(const RenderRequest&, CompiledScene&, CameraSetup&, std::string&)>;
+
+// Renders the jobs that clients submit, one tile at a time on every thread of a pool. Scenes are
+// loaded by the first job that needs them and kept for later ones (see detail::SceneKey()), up to
+// MAX_RESIDENT_SCENES; the least recently used one makes room. Tiles are handed out from the job
+// with the highest priority (the oldest among equals), so a preview submitted during a long
+// render takes over every thread as soon as they finish their current tiles, and the long render
+// continues where it stopped once the preview is done. Render threads queue the tiles on their
+// client, and the network thread sends them as the socket takes them, so a client that reads
+// slowly holds up nobody. A client more than MAX_CLIENT_OUTPUT bytes behind is cut off. Jobs of
+// clients that disconnect are dropped.
+class RenderServer
+{
+  public:
+    RenderServer(ThreadPool& pool, ServerSceneLoader loadScene);
+    ~RenderServer();
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    bool Listen(const std::string& address, std::string& error);
+
+    // Loads the scene of request ahead of the first job that needs it
+    bool Preload(const RenderRequest& request, std::string& error);
+
+    // Accepts clients and their jobs until the listening socket fails, which is the only way it
+    // returns. Loading a new scene holds up the messages behind the job that needs it.
+    bool Run(std::string& error);
+
+    // Queue depth, latency percentiles (over the last jobs) and throughput (since the start)
+    std::string MetricsJSON();
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Client
+    {
+        ~Client() { close(Socket); }
+
+        int Socket = -1;
+        std::vector<char> Input;
+        // Held while a render thread queues a tile and, after the last one, JobFinished, so the
+        // job's messages stay in order
+        std::mutex SendMutex;
+        // Framed messages waiting for the network thread to send them; the first one is
+        // OutputSent bytes in
+        std::mutex OutputMutex;
+        std::deque<std::vector<char>> Output;
+        size_t OutputBytes = 0;
+        size_t OutputSent = 0;
+        std::atomic<bool> Closed{false};
+    };
+
+    struct ResidentScene
+    {
+        CompiledScene World;
+        CameraSetup Camera;
+        // Network thread only: the m_SceneUses count of the last job that used it
+        uint64_t LastUsed = 0;
+    };
+
+    struct Job
+    {
+        uint64_t Id = 0;
+        int Priority = 0;
+        std::shared_ptr<Client> Owner;
+        // Jobs keep their scene alive after it is evicted
+        std::shared_ptr<const ResidentScene> Scene;
+        Camera Cam;
+        RenderSettings Settings;
+        Framebuffer Fb;
+        std::vector<Tile> Tiles;
+        Clock::time_point ReceivedAt;
+        // Guarded by the server's mutex
+        size_t NextTile = 0;
+        Clock::time_point StartedAt;
+        // Guarded by the owner's SendMutex
+        size_t TilesSent = 0;
+        Clock::time_point FirstTileAt;
+        std::atomic<uint64_t> Samples{0};
+        std::atomic<uint64_t> Rays{0};
+    };
+
+    // Totals since the start, and the timings of the last MAX_TIMED_JOBS jobs
+    struct Counters
+    {
+        uint64_t Accepted = 0;
+        uint64_t Finished = 0;
+        uint64_t Failed = 0;
+        uint64_t Cancelled = 0;
+        uint64_t Tiles = 0;
+        uint64_t Samples = 0;
+        uint64_t Rays = 0;
+        // Tiles handed out from a job while an earlier-picked one still had tiles left
+        uint64_t Preemptions = 0;
+        // Summed over the render threads, per tile
+        double BusyMS = 0.0;
+        std::deque<double> QueuedMS;
+        std::deque<double> FirstTileMS;
+        std::deque<double> TotalMS;
+    };
+    static const size_t MAX_TIMED_JOBS = 10000;
+    // Most bytes queued for one client before it is cut off, and its jobs with it
+    static const size_t MAX_CLIENT_OUTPUT = 64 << 20;
+    static const size_t MAX_RESIDENT_SCENES = 8;
+
+    // Orders the queue as a max-heap: a runs later than b
+    static bool RunsLater(const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b)
+    {
+        return a->Priority < b->Priority || (a->Priority == b->Priority && a->Id > b->Id);
+    }
+
+    void Accept();
+    // Queues a message to client. Returns false if the client is gone or was cut off now.
+    bool Send(Client& client, detail::MessageType type, const void* payload, size_t size);
+    // Sends what the socket takes of the client's queue. Returns false if the socket failed.
+    bool Flush(Client& client);
+    bool HandleMessage(const std::shared_ptr<Client>& client, detail::MessageType type,
+                       const char* payload, size_t size);
+    void Submit(const std::shared_ptr<Client>& client, const RenderRequest& request);
+    std::shared_ptr<const ResidentScene> FindScene(const RenderRequest& request,
+                                                   std::string& error);
+    void DispatchLoop();
+    // Waits for a tile of the first job in the queue. Returns nullptr once the server stops.
+    std::shared_ptr<Job> NextTile(Tile& tile);
+    void RenderJobTile(Job& job, const Tile& tile);
+
+    ThreadPool& m_Pool;
+    ServerSceneLoader m_LoadScene;
+    Clock::time_point m_StartedAt;
+
+    // Network thread (Run()) only
+    std::string m_Address;
+    int m_Listener = -1;
+    // Render threads write a byte to wake the network thread when a client's queue fills
+    int m_WakePipe[2] = {-1, -1};
+    std::vector<std::shared_ptr<Client>> m_Clients;
+    std::map<std::string, std::shared_ptr<ResidentScene>> m_Scenes;
+    uint64_t m_SceneUses = 0;
+    uint64_t m_NextJob = 1;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCV;
+    // Jobs with tiles left to hand out, a heap ordered by RunsLater()
+    std::vector<std::shared_ptr<Job>> m_Queue;
+    std::shared_ptr<Job> m_LastJob;
+    Counters m_Counters;
+    bool m_Stop = false;
+    std::thread m_Dispatcher;
+};
+
+RenderServer::RenderServer(ThreadPool& pool, ServerSceneLoader loadScene)
+    : m_Pool(pool), m_LoadScene(std::move(loadScene)), m_StartedAt(Clock::now())
+{
+    m_Dispatcher = std::thread(&RenderServer::DispatchLoop, this);
+}
+
+RenderServer::~RenderServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_WorkCV.notify_all();
+    m_Dispatcher.join();
+    if (m_Listener >= 0) {
+        close(m_Listener);
+        if (m_Address.compare(0, 5, "unix:") == 0)
+            unlink(m_Address.c_str() + 5);
+    }
+    for (int fd : m_WakePipe)
+        if (fd >= 0)
+            close(fd);
+}
+
+bool RenderServer::Listen(const std::string& address, std::string& error)
+{
+    m_Listener = detail::OpenSocket(address, true, error);
+    if (m_Listener < 0)
+        return false;
+    fcntl(m_Listener, F_SETFL, fcntl(m_Listener, F_GETFL) | O_NONBLOCK);
+    m_Address = address;
+    if (pipe(m_WakePipe) != 0) {
+        error = detail::SystemError("pipe");
+        return false;
+    }
+    for (int fd : m_WakePipe)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+bool RenderServer::Preload(const RenderRequest& request, std::string& error)
+{
+    return FindScene(request, error) != nullptr;
+}
+
+bool RenderServer::Run(std::string& error)
+{
+    std::vector<pollfd> fds;
+    for (;;) {
+        fds.assign({pollfd{m_Listener, POLLIN, 0}, pollfd{m_WakePipe[0], POLLIN, 0}});
+        for (const std::shared_ptr<Client>& client : m_Clients) {
+            std::lock_guard<std::mutex> lock(client->OutputMutex);
+            short events = client->Output.empty() ? POLLIN : POLLIN | POLLOUT;
+            fds.push_back(pollfd{client->Socket, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error = detail::SystemError("poll");
+            return false;
+        }
+        if (fds[0].revents & (POLLERR | POLLNVAL)) {
+            error = "the listening socket failed";
+            return false;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drained[64];
+            while (read(m_WakePipe[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+
+        // Clients accepted now are polled in the next round
+        size_t polled = m_Clients.size();
+        if (fds[0].revents & POLLIN)
+            Accept();
+        for (size_t c = 0; c < polled; c++) {
+            std::shared_ptr<Client>& client = m_Clients[c];
+            short revents = fds[c + 2].revents;
+            bool ok = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                ok = detail::ReadMessages(
+                    client->Socket, client->Input,
+                    [&](detail::MessageType type, const char* payload, size_t size) {
+                        return HandleMessage(client, type, payload, size);
+                    });
+            }
+            if (ok && (revents & POLLOUT))
+                ok = Flush(*client);
+            if (!ok) {
+                // The socket stays open until the render threads are done with its jobs
+                {
+                    std::lock_guard<std::mutex> lock(client->OutputMutex);
+                    client->Closed = true;
+                    client->Output.clear();
+                }
+                shutdown(client->Socket, SHUT_RDWR);
+                client.reset();
+            }
+        }
+        m_Clients.erase(std::remove(m_Clients.begin(), m_Clients.end(), nullptr),
+                        m_Clients.end());
+    }
+}
+
+void RenderServer::Accept()
+{
+    for (;;) {
+        int fd = accept(m_Listener, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        auto client = std::make_shared<Client>();
+        client->Socket = fd;
+        m_Clients.push_back(std::move(client));
+    }
+}
+
+bool RenderServer::Send(Client& client, detail::MessageType type, const void* payload,
+                        size_t size)
+{
+    detail::MessageHeader header = {(uint32_t)type, (uint32_t)size};
+    std::vector<char> message(sizeof(header) + size);
+    memcpy(message.data(), &header, sizeof(header));
+    if (size > 0)
+        memcpy(message.data() + sizeof(header), payload, size);
+
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(client.OutputMutex);
+        if (client.Closed)
+            return false;
+        if (client.OutputBytes + message.size() > MAX_CLIENT_OUTPUT) {
+            // Its jobs are cancelled at their next tile, and the network thread drops it
+            client.Closed = true;
+            client.Output.clear();
+            shutdown(client.Socket, SHUT_RDWR);
+            std::cerr << "Cut off a client " << (client.OutputBytes >> 20)
+                      << " MiB behind; its jobs are cancelled" << std::endl;
+            return false;
+        }
+        wake = client.Output.empty();
+        client.OutputBytes += message.size();
+        client.Output.push_back(std::move(message));
+    }
+    // The network thread polls the socket for writing from its next round on. A full pipe means
+    // wake-ups are pending already, so the write may fail.
+    if (wake) {
+        char byte = 0;
+        ssize_t written = write(m_WakePipe[1], &byte, 1);
+        (void)written;
+    }
+    return true;
+}
+
+bool RenderServer::Flush(Client& client)
+{
+    std::lock_guard<std::mutex> lock(client.OutputMutex);
+    while (!client.Output.empty()) {
+        const std::vector<char>& message = client.Output.front();
+        ssize_t sent = send(client.Socket, message.data() + client.OutputSent,
+                            message.size() - client.OutputSent, detail::SEND_FLAGS);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.OutputSent += (size_t)sent;
+        if (client.OutputSent == message.size()) {
+            client.OutputBytes -= message.size();
+            client.OutputSent = 0;
+            client.Output.pop_front();
+        }
+    }
+    return true;
+}
+
+bool RenderServer::HandleMessage(const std::shared_ptr<Client>& client, detail::MessageType type,
+                                 const char* payload, size_t size)
+{
+    if (type == detail::MessageType::Submit) {
+        detail::SubmitMessage message;
+        if (size < sizeof(message))
+            return false;
+        memcpy(&message, payload, sizeof(message));
+        std::string scene(payload + sizeof(message), size - sizeof(message));
+        Submit(client, detail::FromSubmitMessage(message, std::move(scene)));
+        return true;
+    }
+    if (type == detail::MessageType::MetricsQuery && size == 0) {
+        std::string json = MetricsJSON();
+        return Send(*client, detail::MessageType::Metrics, json.data(), json.size());
+    }
+    return false;
+}
+
+void RenderServer::Submit(const std::shared_ptr<Client>& client, const RenderRequest& request)
+{
+    auto job = std::make_shared<Job>();
+    job->Id = m_NextJob++;
+    job->ReceivedAt = Clock::now();
+    std::string problem = detail::CheckRequest(request);
+    if (problem.empty())
+        job->Scene = FindScene(request, problem);
+    if (!job->Scene) {
+        detail::JobFailedMessage failed = {job->Id};
+        std::vector<char> message(sizeof(failed) + problem.size());
+        memcpy(message.data(), &failed, sizeof(failed));
+        memcpy(message.data() + sizeof(failed), problem.data(), problem.size());
+        Send(*client, detail::MessageType::JobFailed, message.data(), message.size());
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Counters.Failed++;
+        return;
+    }
+
+    job->Priority = request.Priority;
+    job->Owner = client;
+    job->Settings = request.Settings;
+    const CameraSetup& camera = request.Camera.Set ? request.Camera : job->Scene->Camera;
+    job->Cam = camera.MakeCamera(request.AspectRatio);
+    job->Fb.Resize(request.Settings.ImageWidth, request.Settings.ImageHeight);
+    job->Tiles = RegionTiles(request);
+    // Queued before any of its tiles can be
+    detail::AcceptedMessage accepted = {job->Id};
+    if (!Send(*client, detail::MessageType::Accepted, &accepted, sizeof(accepted)))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Queue.push_back(std::move(job));
+        std::push_heap(m_Queue.begin(), m_Queue.end(), RunsLater);
+        m_Counters.Accepted++;
+    }
+    m_WorkCV.notify_all();
+}
+
+std::shared_ptr<const RenderServer::ResidentScene>
+RenderServer::FindScene(const RenderRequest& request, std::string& error)
+{
+    std::string key = detail::SceneKey(request);
+    auto found = m_Scenes.find(key);
+    if (found != m_Scenes.end()) {
+        found->second->LastUsed = ++m_SceneUses;
+        return found->second;
+    }
+
+    auto start = Clock::now();
+    auto scene = std::make_shared<ResidentScene>();
+    if (!m_LoadScene(request, scene->World, scene->Camera, error))
+        return nullptr;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+    std::cout << "Loaded scene '" << request.Scene << "' (" << request.SphereCount
+              << " spheres, seed " << request.Settings.Seed << ") in " << ms.count() << "ms"
+              << std::endl;
+    if (m_Scenes.size() >= MAX_RESIDENT_SCENES) {
+        auto oldest = std::min_element(m_Scenes.begin(), m_Scenes.end(),
+                                       [](const auto& a, const auto& b) {
+                                           return a.second->LastUsed < b.second->LastUsed;
+                                       });
+        m_Scenes.erase(oldest);
+    }
+    scene->LastUsed = ++m_SceneUses;
+    return m_Scenes[key] = std::move(scene);
+}
+
+void RenderServer::DispatchLoop()
+{
+    // Every render thread takes tiles, waiting whenever the queue is empty, until the server
+    // stops. A job submitted at any time is picked up by all of them at their next tile.
+    m_Pool.ParallelFor(m_Pool.NumThreads(), [&](int, int) {
+        Tile tile;
+        while (std::shared_ptr<Job> job = NextTile(tile))
+            RenderJobTile(*job, tile);
+    });
+}
+
+std::shared_ptr<RenderServer::Job> RenderServer::NextTile(Tile& tile)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;) {
+        if (m_Queue.empty()) {
+            m_LastJob.reset();
+            m_WorkCV.wait(lock, [&] { return m_Stop || !m_Queue.empty(); });
+        }
+        if (m_Stop)
+            return nullptr;
+
+        std::shared_ptr<Job> job = m_Queue.front();
+        bool cancelled = job->Owner->Closed;
+        if (!cancelled) {
+            if (m_LastJob && m_LastJob != job && m_LastJob->NextTile < m_LastJob->Tiles.size())
+                m_Counters.Preemptions++;
+            m_LastJob = job;
+            if (job->NextTile == 0)
+                job->StartedAt = Clock::now();
+            tile = job->Tiles[job->NextTile++];
+        }
+        if (cancelled || job->NextTile == job->Tiles.size()) {
+            std::pop_heap(m_Queue.begin(), m_Queue.end(), RunsLater);
+            m_Queue.pop_back();
+        }
+        if (!cancelled)
+            return job;
+        m_Counters.Cancelled++;
+    }
+}
+
+void RenderServer::RenderJobTile(Job& job, const Tile& tile)
+{
+    Clock::time_point start = Clock::now();
+    Client& owner = *job.Owner;
+    RenderStats stats;
+    std::vector<char> message;
+    if (!owner.Closed) {
+        if (job.Settings.Integrator == IntegratorType::Wavefront)
+            RenderTileWavefront(job.Scene->World, job.Cam, job.Settings, tile, job.Fb, stats);
+        else
+            RenderTile(job.Scene->World, job.Cam, job.Settings, tile, job.Fb, stats);
+        job.Samples += stats.Samples;
+        job.Rays += stats.Rays;
+
+        detail::JobTileMessage header = {job.Id, detail::ToTileMessage(0, tile), 0};
+        message.resize(sizeof(header) + detail::TilePixelsSize(tile));
+        memcpy(message.data(), &header, sizeof(header));
+        detail::PackTilePixels(job.Fb, tile, message.data() + sizeof(header));
+    }
+
+    bool last, finished = false;
+    RenderJobReport report;
+    {
+        std::lock_guard<std::mutex> lock(owner.SendMutex);
+        Clock::time_point now = Clock::now();
+        if (job.TilesSent++ == 0)
+            job.FirstTileAt = now;
+        last = job.TilesSent == job.Tiles.size();
+        bool sent = Send(owner, detail::MessageType::JobTile, message.data(), message.size());
+        if (last && sent) {
+            auto ms = [&](Clock::time_point t) {
+                return std::chrono::duration<double, std::milli>(t - job.ReceivedAt).count();
+            };
+            report.Job = job.Id;
+            report.Samples = job.Samples;
+            report.Rays = job.Rays;
+            report.QueuedMS = ms(job.StartedAt);
+            report.FirstTileMS = ms(job.FirstTileAt);
+            report.TotalMS = ms(now);
+            detail::JobFinishedMessage done = {report.Job,         report.Samples,
+                                               report.Rays,        report.QueuedMS,
+                                               report.FirstTileMS, report.TotalMS};
+            finished = Send(owner, detail::MessageType::JobFinished, &done, sizeof(done));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Counters.BusyMS += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    m_Counters.Tiles++;
+    m_Counters.Samples += stats.Samples;
+    m_Counters.Rays += stats.Rays;
+    if (!last)
+        return;
+    // The client may hang up as soon as it has the job, so this does not look at Closed
+    if (!finished) {
+        m_Counters.Cancelled++;
+        return;
+    }
+    m_Counters.Finished++;
+    m_Counters.QueuedMS.push_back(report.QueuedMS);
+    m_Counters.FirstTileMS.push_back(report.FirstTileMS);
+    m_Counters.TotalMS.push_back(report.TotalMS);
+    if (m_Counters.TotalMS.size() > MAX_TIMED_JOBS) {
+        m_Counters.QueuedMS.pop_front();
+        m_Counters.FirstTileMS.pop_front();
+        m_Counters.TotalMS.pop_front();
+    }
+}
+
+std::string RenderServer::MetricsJSON()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    const Counters& c = m_Counters;
+    size_t waiting = 0, tilesLeft = 0;
+    for (const std::shared_ptr<Job>& job : m_Queue) {
+        waiting += job->NextTile == 0;
+        tilesLeft += job->Tiles.size() - job->NextTile;
+    }
+    uint64_t rendering = c.Accepted - c.Finished - c.Cancelled - waiting;
+    double seconds = std::chrono::duration<double>(Clock::now() - m_StartedAt).count();
+
+    std::ostringstream out;
+    auto percentiles = [&](const char* name, const std::deque<double>& ms) {
+        std::vector<double> values(ms.begin(), ms.end());
+        out << "  \"" << name << "\": {\"p50\": " << detail::Percentile(values, 50)
+            << ", \"p90\": " << detail::Percentile(values, 90)
+            << ", \"p99\": " << detail::Percentile(values, 99)
+            << ", \"max\": " << detail::Percentile(values, 100) << "},\n";
+    };
+    out << "{\n";
+    out << "  \"uptime_s\": " << seconds << ",\n";
+    out << "  \"threads\": " << m_Pool.NumThreads() << ",\n";
+    out << "  \"resident_scenes\": " << m_Scenes.size() << ",\n";
+    out << "  \"clients\": " << m_Clients.size() << ",\n";
+    out << "  \"queue\": {\"jobs_waiting\": " << waiting << ", \"jobs_rendering\": " << rendering
+        << ", \"tiles_left\": " << tilesLeft << "},\n";
+    out << "  \"jobs\": {\"accepted\": " << c.Accepted << ", \"finished\": " << c.Finished
+        << ", \"failed\": " << c.Failed << ", \"cancelled\": " << c.Cancelled << "},\n";
+    out << "  \"preemptions\": " << c.Preemptions << ",\n";
+    out << "  \"timed_jobs\": " << c.TotalMS.size() << ",\n";
+    percentiles("queued_ms", c.QueuedMS);
+    percentiles("first_tile_ms", c.FirstTileMS);
+    percentiles("latency_ms", c.TotalMS);
+    out << "  \"throughput\": {\"jobs_per_s\": " << c.Finished / seconds
+        << ", \"tiles_per_s\": " << c.Tiles / seconds
+        << ", \"msamples_per_s\": " << c.Samples / seconds / 1e6
+        << ", \"mrays_per_s\": " << c.Rays / seconds / 1e6
+        << ", \"busy\": " << c.BusyMS / 1000.0 / seconds / m_Pool.NumThreads() << "}\n";
+    out << "}\n";
+    return out.str();
+}
+
+// Submits request to the render server at address and receives its tiles into fb, which is
+// resized to the whole frame (pixels outside the region stay black). onTileDone (optional) is
+// called with every tile, the number received and the tile count. Returns false and describes
+// the problem in error if the server rejects the job or the connection fails.
+bool SubmitRender(const std::string& address, const RenderRequest& request, Framebuffer& fb,
+                  const std::function<void(const Tile&, int, int)>& onTileDone,
+                  RenderJobReport& report, std::string& error)
+{
+    int fd = detail::OpenSocket(address, false, error);
+    if (fd < 0)
+        return false;
+    const int tileCount = (int)RegionTiles(request).size();
+    fb.Resize(request.Settings.ImageWidth, request.Settings.ImageHeight);
+    for (int y = 0; y < fb.Height(); y++)
+        for (int x = 0; x < fb.Width(); x++)
+            fb.SampleCount(x, y) = 1;
+
+    detail::SubmitMessage submit = detail::ToSubmitMessage(request);
+    std::vector<char> message(sizeof(submit) + request.Scene.size());
+    memcpy(message.data(), &submit, sizeof(submit));
+    memcpy(message.data() + sizeof(submit), request.Scene.data(), request.Scene.size());
+    bool ok = detail::SendMessage(fd, detail::MessageType::Submit, message.data(), message.size());
+
+    detail::MessageType type;
+    std::vector<char> payload;
+    int received = 0;
+    error.clear();
+    while (ok && detail::RecvMessage(fd, type, payload)) {
+        if (type == detail::MessageType::Accepted && payload.size() == sizeof(uint64_t)) {
+            memcpy(&report.Job, payload.data(), sizeof(uint64_t));
+        } else if (type == detail::MessageType::JobTile &&
+                   payload.size() >= sizeof(detail::JobTileMessage)) {
+            detail::JobTileMessage header;
+            memcpy(&header, payload.data(), sizeof(header));
+            Tile tile = detail::ToTile(header.Tile);
+            if (tile.X0 >= tile.X1 || tile.Y0 >= tile.Y1 || tile.X1 > fb.Width() ||
+                tile.Y1 > fb.Height() ||
+                payload.size() != sizeof(header) + detail::TilePixelsSize(tile)) {
+                error = "invalid tile from " + address;
+                break;
+            }
+            detail::UnpackTilePixels(payload.data() + sizeof(header), tile, fb);
+            received++;
+            if (onTileDone)
+                onTileDone(tile, received, tileCount);
+        } else if (type == detail::MessageType::JobFinished &&
+                   payload.size() == sizeof(detail::JobFinishedMessage)) {
+            detail::JobFinishedMessage finished;
+            memcpy(&finished, payload.data(), sizeof(finished));
+            report.Samples = finished.Samples;
+            report.Rays = finished.Rays;
+            report.QueuedMS = finished.QueuedMS;
+            report.FirstTileMS = finished.FirstTileMS;
+            report.TotalMS = finished.TotalMS;
+            close(fd);
+            return true;
+        } else if (type == detail::MessageType::JobFailed &&
+                   payload.size() >= sizeof(detail::JobFailedMessage)) {
+            error = "the server rejected the job: " +
+                    std::string(payload.data() + sizeof(detail::JobFailedMessage),
+                                payload.size() - sizeof(detail::JobFailedMessage));
+            break;
+        } else {
+            error = "unexpected message from " + address;
+            break;
+        }
+    }
+    if (error.empty())
+        error = "lost the connection to " + address;
+    close(fd);
+    return false;
+}
+
+// Asks the render server at address for its metrics (see RenderServer::MetricsJSON())
+bool QueryServerMetrics(const std::string& address, std::string& json, std::string& error)
+{
+    int fd = detail::OpenSocket(address, false, error);
+    if (fd < 0)
+        return false;
+    detail::MessageType type;
+    std::vector<char> payload;
+    bool ok = detail::SendMessage(fd, detail::MessageType::MetricsQuery, nullptr, 0) &&
+              detail::RecvMessage(fd, type, payload) && type == detail::MessageType::Metrics;
+    close(fd);
+    if (!ok) {
+        error = "no metrics from " + address;
+        return false;
+    }
+    json.assign(payload.begin(), payload.end());
+    return true;
+}
+} // namespace rtiw
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "sampler.h"
+
+#include <cstdint>
+#include <string>
+
+namespace rtiw
+{
+enum class IntegratorType
+{
+    // One path at a time, RayColor() recursing once per bounce
+    Recursive,
+    // Whole tiles of paths advanced one bounce at a time (see wavefront.h)
+    Wavefront,
+};
+
+inline bool ParseIntegratorType(const std::string& name, IntegratorType& type)
+{
+    if (name == "recursive")
+        type = IntegratorType::Recursive;
+    else if (name == "wavefront")
+        type = IntegratorType::Wavefront;
+    else
+        return false;
+    return true;
+}
+
+struct RenderSettings
+{
+    int ImageWidth = 400;
+    int ImageHeight = 225;
+    int SamplesPerPixel = 100;
+    int MaxDepth = 50;
+    int TileSize = 16;
+    uint32_t Seed = 0;
+    SamplerType Sampling = SamplerType::Sobol;
+    IntegratorType Integrator = IntegratorType::Recursive;
+
+    // Adaptive sampling (see adaptive.h). A pixel stops once the standard error of its 8-bit
+    // output value drops below AdaptiveThreshold levels; 0 samples every pixel SamplesPerPixel
+    // times. Samples are taken in batches of AdaptiveMinSamples, at most AdaptiveMaxSamples per
+    // pixel (0 means 4 * SamplesPerPixel), and SamplesPerPixel * pixels in total.
+    float AdaptiveThreshold = 0.f;
+    int AdaptiveMinSamples = 32;
+    int AdaptiveMaxSamples = 0;
+
+    // Samples are drawn from the sampler's sequence in shuffled blocks of this many; 0 means
+    // SamplesPerPixel. Renders refined with more samples keep the block size they started with.
+    int SampleBlockSize = 0;
+
+    int SamplerBlock() const { return SampleBlockSize > 0 ? SampleBlockSize : SamplesPerPixel; }
+};
+
+// Throughput counters of one render
+struct RenderStats
+{
+    // Camera samples, one path each
+    uint64_t Samples = 0;
+    // Closest-hit queries, primary and secondary
+    uint64_t Rays = 0;
+};
+
+// Rectangle of pixels [X0, X1) x [Y0, Y1) in framebuffer (top to bottom) coordinates
+struct Tile
+{
+    int X0, Y0, X1, Y1;
+};
+
+// Color of rays that leave the scene
+inline color BackgroundColor(const ray& r)
+{
+    vec3 unitDirection = Normalize(r.Direction());
+    float t = 0.5f * (unitDirection.y() + 1.f);
+    return ((1.f - t) * color(1.f)) + (t * color(0.5f, 0.7f, 1.f));
+}
+} // namespace rtiw
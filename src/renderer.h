@@ -0,0 +1,246 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "render_profile.h"
+#include "render_settings.h"
+#include "sampler.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+namespace rtiw
+{
+// Scene is either a Hittable (virtual dispatch through the object graph) or a CompiledScene.
+// rayCount is incremented once per closest-hit query. If features is given, what r hits first is
+// stored in it.
+template <typename Scene>
+color RayColor(const ray& r, const Scene& world, const int depth, uint64_t& rayCount,
+               PixelFeatures* features = nullptr)
+{
+    if (depth == 0) {
+        RTIW_STAT_ADD(DepthLimitReached, 1);
+        return color(0.f);
+    }
+
+    HitRecord rec;
+    rayCount++;
+    RTIW_STAT_ADD(SceneQueries, 1);
+    if (world.Hit(r, 0.0001f, INF, rec)) {
+        RTIW_STAT_ADD(Hits, 1);
+        ray scattered;
+        color attenuation;
+        bool scatters = ScatterHit(world, r, rec, attenuation, scattered);
+        if (features) {
+            features->Albedo = scatters ? attenuation : color(0.f);
+            features->Normal = rec.Normal;
+            features->Depth = rec.t * r.Direction().Length();
+        }
+        if (scatters) {
+            RTIW_STAT_ADD(Scatters, 1);
+            return attenuation * RayColor(scattered, world, depth - 1, rayCount);
+        }
+        RTIW_STAT_ADD(Absorbed, 1);
+        RTIW_STAT_END_PATH(depth);
+        return color(0.f);
+    }
+
+    RTIW_STAT_ADD(Misses, 1);
+    RTIW_STAT_END_PATH(depth);
+    if (features) {
+        features->Albedo = BackgroundColor(r);
+        features->Normal = vec3(0.f);
+        features->Depth = 0.f;
+    }
+    return BackgroundColor(r);
+}
+
+// Interleaves the bits of x and y so that sorting by the result walks tiles along a Z-order curve
+inline uint32_t MortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Splits the image into tiles ordered along a Morton curve, so the tiles a worker takes in a row
+// are spatially close and share cache-resident parts of the scene
+std::vector<Tile> MakeTiles(int width, int height, int tileSize)
+{
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    std::vector<std::pair<uint32_t, Tile>> keyed;
+    keyed.reserve((size_t)tilesX * tilesY);
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            Tile t{tx * tileSize, ty * tileSize, std::min(width, (tx + 1) * tileSize),
+                   std::min(height, (ty + 1) * tileSize)};
+            keyed.push_back({MortonCode(tx, ty), t});
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& k : keyed)
+        tiles.push_back(k.second);
+    return tiles;
+}
+
+// Traces samples [firstSample, firstSample + count) of pixel (i, y) and adds them to sum one by
+// one, so a pixel sampled in several steps ends up with the same sum as one sampled at once. If
+// sumSquares is given, the squared samples are added to it for variance estimates, and if
+// features is given, the first-hit features of the samples are added to it.
+template <typename Scene>
+void SamplePixel(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                 Sampler& sampler, int i, int y, uint32_t firstSample, uint32_t count, color& sum,
+                 uint64_t& rayCount, color* sumSquares = nullptr,
+                 PixelFeatures* features = nullptr)
+{
+    const int width = settings.ImageWidth;
+    const int height = settings.ImageHeight;
+    // The camera's v axis points up, the framebuffer's rows go down
+    const int j = height - 1 - y;
+    const uint32_t pixelIndex = (uint32_t)(y * width + i);
+#if RTIW_STATS
+    ProfileClock::time_point start = ProfileClock::now();
+#endif
+
+    for (uint32_t s = firstSample; s < firstSample + count; s++) {
+        // Seeded per sample so any thread rendering this pixel produces the same result
+        SeedRand(settings.Seed, pixelIndex, s);
+        sampler.StartSample(pixelIndex, s);
+
+        Sample2D jitter = sampler.Get2D();
+        float u = (i + jitter.U) / (width - 1);
+        float v = (j + jitter.V) / (height - 1);
+        ray r = cam.GetRay(u, v);
+        PixelFeatures sampleFeatures;
+        color sample = RayColor(r, world, settings.MaxDepth, rayCount,
+                                features ? &sampleFeatures : nullptr);
+        sum += sample;
+        if (sumSquares)
+            *sumSquares += sample * sample;
+        if (features) {
+            sampleFeatures.LuminanceSquared = Luminance(sample) * Luminance(sample);
+            *features += sampleFeatures;
+        }
+    }
+
+    RTIW_STAT_ADD(PrimaryRays, count);
+#if RTIW_STATS
+    RenderProfile::Get().AddPixelTime(i, y, ElapsedMS(start));
+#endif
+}
+
+// Brings every pixel of the tile up to SamplesPerPixel samples, continuing from the samples it
+// already has
+template <typename Scene>
+void RenderTile(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                const Tile& tile, Framebuffer& fb, RenderStats& stats)
+{
+    std::unique_ptr<Sampler> sampler =
+        MakeSampler(settings.Sampling, settings.SamplerBlock(), settings.Seed);
+    ActiveSampler() = sampler.get();
+
+    const uint32_t spp = (uint32_t)settings.SamplesPerPixel;
+    for (int y = tile.Y0; y < tile.Y1; y++) {
+        for (int i = tile.X0; i < tile.X1; i++) {
+            uint32_t& count = fb.SampleCount(i, y);
+            if (count >= spp)
+                continue;
+            SamplePixel(world, cam, settings, *sampler, i, y, count, spp - count, fb.At(i, y),
+                        stats.Rays, nullptr, fb.HasFeatures() ? &fb.Features(i, y) : nullptr);
+            stats.Samples += spp - count;
+            count = spp;
+        }
+    }
+
+    ActiveSampler() = nullptr;
+}
+
+inline bool TileComplete(const Framebuffer& fb, const Tile& tile, uint32_t spp)
+{
+    for (int y = tile.Y0; y < tile.Y1; y++)
+        for (int x = tile.X0; x < tile.X1; x++)
+            if (fb.SampleCount(x, y) < spp)
+                return false;
+    return true;
+}
+
+// Like Render(), but keeps what fb already holds (a resumed checkpoint, or a finished render to
+// refine) and only adds the samples each pixel is missing. Tiles that are already complete are
+// skipped and still reported to onTileDone.
+template <typename Scene>
+RenderStats RenderContinue(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                           ThreadPool& pool, Framebuffer& fb,
+                           const std::function<void(const Tile&, int, int)>& onTileDone = nullptr)
+{
+#if RTIW_STATS
+    RenderProfile::Get().Begin(settings);
+#endif
+    std::vector<Tile> tiles = MakeTiles(settings.ImageWidth, settings.ImageHeight,
+                                        settings.TileSize);
+
+    std::atomic<int> tilesDone{0};
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> rays{0};
+    const int tileCount = (int)tiles.size();
+    pool.ParallelFor(tileCount, [&](int t, int) {
+#if RTIW_STATS
+        ProfileClock::time_point tileStart = ProfileClock::now();
+#endif
+        RenderStats tileStats;
+        if (!TileComplete(fb, tiles[t], (uint32_t)settings.SamplesPerPixel)) {
+            if (settings.Integrator == IntegratorType::Wavefront)
+                RenderTileWavefront(world, cam, settings, tiles[t], fb, tileStats);
+            else
+                RenderTile(world, cam, settings, tiles[t], fb, tileStats);
+        }
+#if RTIW_STATS
+        RenderProfile::Get().AddTileTime(tiles[t], ElapsedMS(tileStart));
+#endif
+        samples += tileStats.Samples;
+        rays += tileStats.Rays;
+
+        int done = ++tilesDone;
+        if (onTileDone)
+            onTileDone(tiles[t], done, tileCount);
+    });
+
+    RenderStats stats;
+    stats.Samples = samples;
+    stats.Rays = rays;
+    return stats;
+}
+
+// Renders the whole frame into fb using every worker of the pool. onTileDone (optional) is
+// called from the worker threads with the finished tile, the number of finished tiles and the
+// total tile count.
+template <typename Scene>
+RenderStats Render(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                   ThreadPool& pool, Framebuffer& fb,
+                   const std::function<void(const Tile&, int, int)>& onTileDone = nullptr)
+{
+    fb.Resize(settings.ImageWidth, settings.ImageHeight);
+    return RenderContinue(world, cam, settings, pool, fb, onTileDone);
+}
+} // namespace rtiw
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
 
+#include "random.h"
+
 /* ----------------------- Constants ----------------------- */
 const float INF = std::numeric_limits<float>::infinity();
 const float F_PI = (float)3.1415926535897932385;
@@ -16,7 +19,7 @@ inline float DegreesToRadians(float degrees) {
 
 // Returns a random real number in [0, 1)
 inline float RandFloat() {
-    return (float)rand() / (RAND_MAX + 1.f);
+    return rtiw::ThreadRNG().NextFloat();
 }
 
 // Returns a random real number in [min, max)
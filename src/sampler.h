@@ -0,0 +1,238 @@
+#pragma once
+
+#include "random.h"
+
+#include <cmath>
+#include <memory>
+#include <string>
+
+namespace rtiw
+{
+enum class SamplerType
+{
+    Independent,
+    Stratified,
+    Sobol,
+    R2,
+};
+
+inline bool ParseSamplerType(const std::string& name, SamplerType& type)
+{
+    if (name == "independent")
+        type = SamplerType::Independent;
+    else if (name == "stratified")
+        type = SamplerType::Stratified;
+    else if (name == "sobol")
+        type = SamplerType::Sobol;
+    else if (name == "r2")
+        type = SamplerType::R2;
+    else
+        return false;
+    return true;
+}
+
+// Returns element i of a pseudo-random permutation of [0, l) selected by p (Kensler, "Correlated
+// Multi-Jittered Sampling"). Used to decorrelate the sample order between pixels and dimensions.
+inline uint32_t PermutationElement(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// Shared bookkeeping of the samplers below: which pixel and sample is being generated and how
+// many dimension pairs have been handed out so far
+class SamplerBase : public Sampler
+{
+  public:
+    SamplerBase(int samplesPerPixel, uint32_t seed)
+        : m_SamplesPerPixel(samplesPerPixel < 1 ? 1 : (uint32_t)samplesPerPixel), m_Seed(seed)
+    {
+    }
+
+    virtual void StartSample(uint32_t pixelIndex, uint32_t sampleIndex) override
+    {
+        m_PixelHash = HashU32(pixelIndex ^ HashU32(m_Seed));
+        m_SampleIndex = sampleIndex;
+        m_Dimension = 0;
+    }
+
+    virtual uint32_t Dimension() const override { return m_Dimension; }
+    virtual void SetDimension(uint32_t dimension) override { m_Dimension = dimension; }
+
+  protected:
+    // Hash of the current pixel and dimension pair, drives scrambling and permutations
+    uint32_t DimensionHash() const { return HashU32(m_PixelHash + 0x9e3779b9u * m_Dimension); }
+
+    // Sample index shuffled per pixel and dimension pair, so that the dimensions of one sample
+    // are not correlated with each other. Indices past SamplesPerPixel (extra passes) are
+    // shuffled within blocks of SamplesPerPixel.
+    uint32_t ShuffledIndex() const
+    {
+        uint32_t block = m_SampleIndex / m_SamplesPerPixel;
+        uint32_t inBlock = m_SampleIndex % m_SamplesPerPixel;
+        return block * m_SamplesPerPixel +
+               PermutationElement(inBlock, m_SamplesPerPixel, DimensionHash());
+    }
+
+    uint32_t m_SamplesPerPixel;
+    uint32_t m_Seed;
+    uint32_t m_PixelHash = 0;
+    uint32_t m_SampleIndex = 0;
+    uint32_t m_Dimension = 0;
+};
+
+// Plain random numbers, the behaviour before samplers existed
+class IndependentSampler : public SamplerBase
+{
+  public:
+    using SamplerBase::SamplerBase;
+
+    virtual Sample2D Get2D() override
+    {
+        PCG32& rng = ThreadRNG();
+        float u = rng.NextFloat();
+        return {u, rng.NextFloat()};
+    }
+};
+
+// Jittered grid: the samples of a pixel fall into distinct cells of a grid of at least
+// SamplesPerPixel cells, visited in a different order for every dimension pair
+class StratifiedSampler : public SamplerBase
+{
+  public:
+    StratifiedSampler(int samplesPerPixel, uint32_t seed) : SamplerBase(samplesPerPixel, seed)
+    {
+        m_CellsX = (uint32_t)sqrtf((float)m_SamplesPerPixel);
+        m_CellsY = (m_SamplesPerPixel + m_CellsX - 1) / m_CellsX;
+    }
+
+    virtual Sample2D Get2D() override
+    {
+        uint32_t cells = m_CellsX * m_CellsY;
+        uint32_t cell = PermutationElement(m_SampleIndex % cells, cells, DimensionHash());
+        m_Dimension++;
+
+        PCG32& rng = ThreadRNG();
+        float u = ((cell % m_CellsX) + rng.NextFloat()) / m_CellsX;
+        float v = ((cell / m_CellsX) + rng.NextFloat()) / m_CellsY;
+        return {u, v};
+    }
+
+  private:
+    uint32_t m_CellsX;
+    uint32_t m_CellsY;
+};
+
+// First two dimensions of the Sobol sequence (a (0,2)-sequence), with random digit scrambling per
+// pixel and dimension pair. Best with power-of-two sample counts.
+class SobolSampler : public SamplerBase
+{
+  public:
+    using SamplerBase::SamplerBase;
+
+    virtual Sample2D Get2D() override
+    {
+        uint32_t index = ShuffledIndex();
+        uint32_t hash = DimensionHash();
+        m_Dimension++;
+
+        uint32_t x = ReverseBits(index) ^ hash;
+        uint32_t y = SobolDim1(index) ^ HashU32(hash);
+        return {ToUnitFloat(x), ToUnitFloat(y)};
+    }
+
+  private:
+    static uint32_t ReverseBits(uint32_t v)
+    {
+        v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+        v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+        v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+        v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+        return (v >> 16) | (v << 16);
+    }
+
+    static uint32_t SobolDim1(uint32_t i)
+    {
+        uint32_t r = 0;
+        for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+            if (i & 1)
+                r ^= v;
+        return r;
+    }
+
+    static float ToUnitFloat(uint32_t bits) { return (float)(bits >> 8) * (1.f / 16777216.f); }
+};
+
+// Roberts' R2 sequence (generalised golden ratio), Cranley-Patterson rotated per pixel and
+// dimension pair. Works well for any sample count.
+class R2Sampler : public SamplerBase
+{
+  public:
+    using SamplerBase::SamplerBase;
+
+    virtual Sample2D Get2D() override
+    {
+        // 1/g and 1/g^2 for the plastic number g
+        const double A1 = 0.7548776662466927;
+        const double A2 = 0.5698402909980532;
+
+        uint32_t index = ShuffledIndex();
+        uint32_t hash = DimensionHash();
+        m_Dimension++;
+
+        double offsetU = (hash >> 8) * (1.0 / 16777216.0);
+        double offsetV = (HashU32(hash) >> 8) * (1.0 / 16777216.0);
+        double u = offsetU + A1 * index;
+        double v = offsetV + A2 * index;
+        return {ToUnitFloat(u - floor(u)), ToUnitFloat(v - floor(v))};
+    }
+
+  private:
+    // Keeps results strictly below one after rounding to float
+    static float ToUnitFloat(double x)
+    {
+        float f = (float)x;
+        return f < 1.f ? f : 0.99999994f;
+    }
+};
+
+inline std::unique_ptr<Sampler> MakeSampler(SamplerType type, int samplesPerPixel, uint32_t seed)
+{
+    switch (type) {
+    case SamplerType::Independent:
+        return std::make_unique<IndependentSampler>(samplesPerPixel, seed);
+    case SamplerType::Stratified:
+        return std::make_unique<StratifiedSampler>(samplesPerPixel, seed);
+    case SamplerType::Sobol:
+        return std::make_unique<SobolSampler>(samplesPerPixel, seed);
+    case SamplerType::R2:
+        return std::make_unique<R2Sampler>(samplesPerPixel, seed);
+    }
+    return nullptr;
+}
+} // namespace rtiw
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Text scene files describe one object per line; '#' starts a comment:
+//
+//   camera <from x y z> <at x y z> <up x y z> <vfov degrees>
+//   lambertian <name> <r g b>
+//   metal <name> <r g b> <fuzz>
+//   sphere <x y z> <radius> <material name>
+//
+// Materials must be declared before the spheres that use them.
+
+namespace rtiw
+{
+// Contents of a scene file in the flat form CompiledScene::Build() takes
+struct SceneDescription
+{
+    CameraSetup Camera;
+    std::vector<CompiledMaterial> Materials;
+    std::vector<CompiledPrimitive> Primitives;
+};
+
+namespace detail
+{
+// Splits one line of a scene file into numbers and words
+class SceneLineReader
+{
+  public:
+    SceneLineReader(const char* begin, const char* end) : m_Pos(begin), m_End(end) {}
+
+    bool AtEnd()
+    {
+        SkipSpace();
+        return m_Pos == m_End;
+    }
+
+    bool Word(std::string& word)
+    {
+        SkipSpace();
+        const char* start = m_Pos;
+        while (m_Pos != m_End && *m_Pos != ' ' && *m_Pos != '\t')
+            m_Pos++;
+        word.assign(start, m_Pos);
+        return !word.empty();
+    }
+
+    bool Number(float& value)
+    {
+        SkipSpace();
+        if (m_Pos == m_End)
+            return false;
+        // Lines are not null-terminated, but every line ends before the file's terminating null
+        char* numberEnd;
+        value = strtof(m_Pos, &numberEnd);
+        if (numberEnd == m_Pos || numberEnd > m_End)
+            return false;
+        m_Pos = numberEnd;
+        return m_Pos == m_End || *m_Pos == ' ' || *m_Pos == '\t';
+    }
+
+    bool Vector(vec3& v)
+    {
+        float x, y, z;
+        if (!Number(x) || !Number(y) || !Number(z))
+            return false;
+        v = vec3(x, y, z);
+        return true;
+    }
+
+  private:
+    void SkipSpace()
+    {
+        while (m_Pos != m_End && (*m_Pos == ' ' || *m_Pos == '\t'))
+            m_Pos++;
+    }
+
+    const char* m_Pos;
+    const char* m_End;
+};
+} // namespace detail
+
+namespace detail
+{
+// Reads the text file at path and calls parseLine(line, message) for each line that is not blank
+// or a comment. parseLine returns false with a description of the problem in message, which stops
+// the parse and goes to error with the file name and line number.
+template <typename ParseLineFn>
+bool ParseSceneLines(const std::string& path, std::string& error, ParseLineFn&& parseLine)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string text;
+    char chunk[1 << 16];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        text.append(chunk, read);
+    fclose(file);
+
+    std::string message;
+    const char* pos = text.c_str();
+    const char* end = pos + text.size();
+    for (int lineNumber = 1; pos < end; lineNumber++) {
+        const char* lineEnd = pos;
+        while (lineEnd != end && *lineEnd != '\n' && *lineEnd != '#')
+            lineEnd++;
+        const char* next = lineEnd;
+        while (next != end && *next != '\n')
+            next++;
+        // Tolerate Windows line endings
+        if (lineEnd != pos && lineEnd[-1] == '\r')
+            lineEnd--;
+
+        SceneLineReader line(pos, lineEnd);
+        pos = next + 1;
+        if (line.AtEnd())
+            continue;
+        if (!parseLine(line, message)) {
+            error = path + ":" + std::to_string(lineNumber) + ": " + message;
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace detail
+
+// Reads a text scene file into scene. Returns false and describes the problem (with its line
+// number) in error if the file cannot be read or parsed.
+bool LoadSceneText(const std::string& path, SceneDescription& scene, std::string& error)
+{
+    scene = SceneDescription();
+    std::unordered_map<std::string, uint32_t> materialIds;
+    std::string keyword, name;
+    return detail::ParseSceneLines(path, error, [&](detail::SceneLineReader& line,
+                                                    std::string& message) {
+        auto fail = [&](const std::string& problem) {
+            message = problem;
+            return false;
+        };
+
+        line.Word(keyword);
+        bool ok = true;
+        if (keyword == "camera") {
+            CameraSetup& cam = scene.Camera;
+            ok = line.Vector(cam.LookFrom) && line.Vector(cam.LookAt) && line.Vector(cam.Up) &&
+                 line.Number(cam.Vfov);
+            cam.Set = true;
+        } else if (keyword == "lambertian" || keyword == "metal") {
+            vec3 albedo;
+            float fuzz = 0.f;
+            ok = line.Word(name) && line.Vector(albedo) &&
+                 (keyword != "metal" || line.Number(fuzz));
+            if (ok) {
+                if (!materialIds.emplace(name, (uint32_t)scene.Materials.size()).second)
+                    return fail("material '" + name + "' is declared twice");
+                if (keyword == "metal")
+                    scene.Materials.emplace_back(Metal(albedo, fuzz));
+                else
+                    scene.Materials.emplace_back(Lambertian(albedo));
+            }
+        } else if (keyword == "sphere") {
+            vec3 center;
+            SphereRecord sphere;
+            ok = line.Vector(center) && line.Number(sphere.Radius) && line.Word(name);
+            if (ok) {
+                auto found = materialIds.find(name);
+                if (found == materialIds.end())
+                    return fail("unknown material '" + name + "'");
+                for (int a = 0; a < 3; a++)
+                    sphere.Center[a] = center[a];
+                sphere.MaterialId = found->second;
+                scene.Primitives.emplace_back(sphere);
+            }
+        } else {
+            return fail("unknown keyword '" + keyword + "'");
+        }
+        if (!ok || !line.AtEnd())
+            return fail("malformed '" + keyword + "' line");
+        return true;
+    });
+}
+
+// Writes a compiled scene and its camera as a text scene file. Floats are written with enough
+// digits to read back exactly. Returns false and describes the problem in error on failure.
+bool SaveSceneText(const std::string& path, const CompiledScene& scene, const CameraSetup& camera,
+                   std::string& error)
+{
+    if (scene.InstanceCount() > 0) {
+        error = "scene files cannot describe instances, save a scene cache instead";
+        return false;
+    }
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    if (camera.Set) {
+        const vec3* vectors[] = {&camera.LookFrom, &camera.LookAt, &camera.Up};
+        fprintf(file, "camera");
+        for (const vec3* v : vectors)
+            fprintf(file, "  %.9g %.9g %.9g", v->x(), v->y(), v->z());
+        fprintf(file, "  %.9g\n", camera.Vfov);
+    }
+
+    for (uint32_t m = 0; m < (uint32_t)scene.MaterialCount(); m++) {
+        const CompiledMaterial& mat = scene.MaterialAt(m);
+        color albedo = std::visit([](const auto& material) { return material.Albedo(); }, mat);
+        if (const Metal* metal = std::get_if<Metal>(&mat))
+            fprintf(file, "metal m%u  %.9g %.9g %.9g  %.9g\n", m, albedo.x(), albedo.y(),
+                    albedo.z(), metal->Fuzz());
+        else
+            fprintf(file, "lambertian m%u  %.9g %.9g %.9g\n", m, albedo.x(), albedo.y(),
+                    albedo.z());
+    }
+
+    for (size_t p = 0; p < scene.PrimitiveCount(); p++) {
+        const SphereRecord& sphere = std::get<SphereRecord>(scene.PrimitiveAt(p));
+        fprintf(file, "sphere  %.9g %.9g %.9g  %.9g  m%u\n", sphere.Center[0], sphere.Center[1],
+                sphere.Center[2], sphere.Radius, sphere.MaterialId);
+    }
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        error = "cannot write " + path;
+    return ok;
+}
+
+// Builds the Hittable graph of a scene description, for the renderer modes that do not use the
+// compiled scene
+void AddToHittableList(const SceneDescription& scene, HittableList& world)
+{
+    std::vector<std::shared_ptr<Material>> materials;
+    for (const CompiledMaterial& mat : scene.Materials) {
+        materials.push_back(std::visit(
+            [](const auto& material) -> std::shared_ptr<Material> {
+                return std::make_shared<std::decay_t<decltype(material)>>(material);
+            },
+            mat));
+    }
+
+    for (const CompiledPrimitive& prim : scene.Primitives) {
+        const SphereRecord& sphere = std::get<SphereRecord>(prim);
+        point3 center(sphere.Center[0], sphere.Center[1], sphere.Center[2]);
+        world.Add(std::make_shared<Sphere>(center, sphere.Radius, materials[sphere.MaterialId]));
+    }
+}
+} // namespace rtiw
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace rtiw
+{
+// The four sphere scene from the book
+inline void DefaultScene(HittableList& world)
+{
+    auto materialGround = std::make_shared<Lambertian>(color(0.8f, 0.8f, 0.f));
+    auto materialCenter = std::make_shared<Lambertian>(color(0.7f, 0.3f, 0.3f));
+    auto materialLeft = std::make_shared<Metal>(color(0.8f), 0.3f);
+    auto materialRight = std::make_shared<Metal>(color(0.8f, 0.6f, 0.2f), 1.f);
+
+    world.Add(std::make_shared<Sphere>(point3(0.f, -100.5f, -1.0f), 100.f, materialGround));
+    world.Add(std::make_shared<Sphere>(point3(0.f, 0.f, -1.0f), 0.5f, materialCenter));
+    world.Add(std::make_shared<Sphere>(point3(-1.f, 0.f, -1.0f), 0.5f, materialLeft));
+    world.Add(std::make_shared<Sphere>(point3(1.f, 0.f, -1.0f), 0.5f, materialRight));
+}
+
+// A small palette keeps the material count of the synthetic scenes independent of their size
+inline std::vector<std::shared_ptr<Material>> RandomPalette()
+{
+    std::vector<std::shared_ptr<Material>> palette;
+    for (int i = 0; i < 16; i++) {
+        if (i % 4 == 3)
+            palette.push_back(
+                std::make_shared<Metal>(color::Random(0.5f, 1.f), RandFloat(0.f, 0.5f)));
+        else
+            palette.push_back(std::make_shared<Lambertian>(color::Random() * color::Random()));
+    }
+    return palette;
+}
+
+// Ground plus sphereCount small random spheres spread out in front of the default camera
+inline void RandomSpheresScene(HittableList& world, int sphereCount, uint32_t seed)
+{
+    SeedRand(seed, 0, 0);
+
+    auto materialGround = std::make_shared<Lambertian>(color(0.5f));
+    world.Add(std::make_shared<Sphere>(point3(0.f, -1000.5f, -1.f), 1000.f, materialGround));
+    std::vector<std::shared_ptr<Material>> palette = RandomPalette();
+
+    // Keep the density roughly constant as the count grows
+    float extent = 4.f * sqrtf((float)sphereCount / 100.f) + 2.f;
+    for (int i = 0; i < sphereCount; i++) {
+        float radius = RandFloat(0.02f, 0.2f);
+        point3 center(RandFloat(-extent, extent), -0.5f + radius,
+                      -1.f - RandFloat(0.f, 2 * extent));
+        world.Add(std::make_shared<Sphere>(center, radius, palette[i % palette.size()]));
+    }
+}
+
+// The random scene from the end of the book: a grid of small spheres around three big ones,
+// seen from (13, 2, 3). The renderer has no dielectric, so the glass spheres are polished
+// metal instead.
+inline void FinalScene(HittableList& world, uint32_t seed, CameraSetup& cam)
+{
+    SeedRand(seed, 0, 0);
+
+    auto materialGround = std::make_shared<Lambertian>(color(0.5f));
+    world.Add(std::make_shared<Sphere>(point3(0.f, -1000.f, 0.f), 1000.f, materialGround));
+    auto polished = std::make_shared<Metal>(color(0.95f), 0.f);
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            float chooseMaterial = RandFloat();
+            point3 center(a + 0.9f * RandFloat(), 0.2f, b + 0.9f * RandFloat());
+            if ((center - point3(4.f, 0.2f, 0.f)).Length() <= 0.9f)
+                continue;
+
+            std::shared_ptr<Material> material;
+            if (chooseMaterial < 0.8f)
+                material = std::make_shared<Lambertian>(color::Random() * color::Random());
+            else if (chooseMaterial < 0.95f)
+                material = std::make_shared<Metal>(color::Random(0.5f, 1.f), RandFloat(0.f, 0.5f));
+            else
+                material = polished;
+            world.Add(std::make_shared<Sphere>(center, 0.2f, material));
+        }
+    }
+
+    world.Add(std::make_shared<Sphere>(point3(0.f, 1.f, 0.f), 1.f, polished));
+    world.Add(std::make_shared<Sphere>(point3(-4.f, 1.f, 0.f), 1.f,
+                                       std::make_shared<Lambertian>(color(0.4f, 0.2f, 0.1f))));
+    world.Add(std::make_shared<Sphere>(point3(4.f, 1.f, 0.f), 1.f,
+                                       std::make_shared<Metal>(color(0.7f, 0.6f, 0.5f), 0.f)));
+
+    cam.Set = true;
+    cam.LookFrom = point3(13.f, 2.f, 3.f);
+    cam.LookAt = point3(0.f);
+    cam.Up = vec3(0.f, 1.f, 0.f);
+    cam.Vfov = 20.f;
+}
+
+// About sphereCount spheres (rounded to a cube n^3) as a field of n blocks, each made of n
+// instances of one cluster of n spheres. Only the cluster's spheres exist in memory, once, so
+// --spheres 1000000000 fits in a few megabytes.
+inline void InstancedScene(HittableList& world, int sphereCount, uint32_t seed, CameraSetup& cam)
+{
+    SeedRand(seed, 0, 0);
+    int n = std::max(1, (int)roundf(cbrtf((float)std::max(1, sphereCount))));
+    int side = 1;
+    while (side * side * side < n)
+        side++;
+    int fieldSide = 1;
+    while (fieldSide * fieldSide < n)
+        fieldSide++;
+
+    const float GROUND_RADIUS = 1000.f;
+    auto materialGround = std::make_shared<Lambertian>(color(0.5f));
+    world.Add(std::make_shared<Sphere>(point3(0.f, -GROUND_RADIUS, 0.f), GROUND_RADIUS,
+                                       materialGround));
+    std::vector<std::shared_ptr<Material>> palette = RandomPalette();
+
+    // Cluster: n spheres in a unit cube, filling about a fifth of it
+    float radius = std::min(0.4f, cbrtf(0.2f * 3.f / (4.f * F_PI * n)));
+    HittableList cluster;
+    for (int i = 0; i < n; i++) {
+        point3 center = vec3::Random(-0.5f + radius, 0.5f - radius);
+        cluster.Add(std::make_shared<Sphere>(center, radius, palette[i % palette.size()]));
+    }
+    auto clusterBVH = std::make_shared<BVH>(cluster);
+
+    // Block: n clusters on a cubic grid, standing on y = 0, each turned and scaled differently
+    const float CLUSTER_SPACING = 1.2f;
+    float blockSize = side * CLUSTER_SPACING;
+    HittableList block;
+    for (int i = 0; i < n; i++) {
+        vec3 cell((float)(i % side), (float)(i / side % side), (float)(i / (side * side)));
+        vec3 offset = CLUSTER_SPACING * (cell - vec3(0.5f * (side - 1), 0.f, 0.5f * (side - 1)));
+        float angle = RandFloat(0.f, 360.f);
+        float scale = RandFloat(0.7f, 1.1f);
+        Transform place = Transform::Translate(offset + vec3(0.f, 0.5f, 0.f)) *
+                          Transform::Rotate(vec3(0.f, 1.f, 0.f), angle) * Transform::Scale(scale);
+        block.Add(std::make_shared<Instance>(clusterBVH, place));
+    }
+    auto blockBVH = std::make_shared<BVH>(block);
+
+    // Field: n blocks on a square grid, sitting on the curved ground
+    float blockSpacing = 1.25f * blockSize;
+    float fieldHalf = 0.5f * fieldSide * blockSpacing;
+    for (int i = 0; i < n; i++) {
+        float x = blockSpacing * (i % fieldSide - 0.5f * (fieldSide - 1));
+        float z = blockSpacing * (i / fieldSide - 0.5f * (fieldSide - 1));
+        float y = sqrtf(std::max(0.f, GROUND_RADIUS * GROUND_RADIUS - x * x - z * z)) -
+                  GROUND_RADIUS;
+        float angle = RandFloat(0.f, 360.f);
+        Transform place = Transform::Translate(vec3(x, y, z)) *
+                          Transform::Rotate(vec3(0.f, 1.f, 0.f), angle);
+        world.Add(std::make_shared<Instance>(blockBVH, place));
+    }
+
+    cam.Set = true;
+    cam.LookFrom = point3(1.1f * fieldHalf, 0.4f * fieldHalf + blockSize, 1.1f * fieldHalf);
+    cam.LookAt = point3(0.f);
+    cam.Up = vec3(0.f, 1.f, 0.f);
+    cam.Vfov = 50.f;
+}
+
+// Fills world and sets up cam for the named scene. Returns false for unknown names.
+inline bool BuildScene(const std::string& name, int sphereCount, uint32_t seed, HittableList& world,
+                       CameraSetup& cam)
+{
+    cam = CameraSetup();
+    if (name == "default")
+        DefaultScene(world);
+    else if (name == "spheres")
+        RandomSpheresScene(world, sphereCount, seed);
+    else if (name == "final")
+        FinalScene(world, seed, cam);
+    else if (name == "instances")
+        InstancedScene(world, sphereCount, seed, cam);
+    else
+        return false;
+    return true;
+}
+} // namespace rtiw
@@ -0,0 +1,91 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RTIW_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include <string>
+
+// Lets a single function use a wider instruction set than the rest of the build; callers must
+// check the CPU first. GCC would otherwise fuse mul/add intrinsics into FMAs once the target has
+// them, which changes results. MSVC allows any intrinsic anywhere, so it needs no attribute.
+#if defined(__clang__)
+#define RTIW_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__GNUC__)
+#define RTIW_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#else
+#define RTIW_TARGET(isa)
+#endif
+
+namespace rtiw
+{
+enum class SimdLevel
+{
+    Scalar,
+    SSE,
+    AVX2,
+    AVX512,
+};
+
+inline const char* SimdLevelName(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::Scalar:
+        return "scalar";
+    case SimdLevel::SSE:
+        return "sse";
+    case SimdLevel::AVX2:
+        return "avx2";
+    case SimdLevel::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+inline bool ParseSimdLevel(const std::string& name, SimdLevel& level)
+{
+    for (SimdLevel l : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (name == SimdLevelName(l)) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Widest instruction set the CPU (and OS) supports
+inline SimdLevel DetectSimdLevel()
+{
+#if defined(RTIW_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    return SimdLevel::SSE;
+#elif defined(RTIW_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    bool ymm = (xcr0 & 0x6) == 0x6;
+    bool zmm = (xcr0 & 0xe6) == 0xe6;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        if (zmm && (info[1] & (1 << 16)))
+            return SimdLevel::AVX512;
+        if (ymm && (info[1] & (1 << 5)))
+            return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+} // namespace rtiw
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.h"
+#include "stats.h"
 
 namespace rtiw
 {
@@ -13,6 +14,11 @@ class Sphere : public Hittable
     }
 
     virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const override;
+    virtual bool BoundingBox(AABB& outputBox) const override;
+
+    point3 Center() const { return m_Center; }
+    float Radius() const { return m_Radius; }
+    std::shared_ptr<Material> MaterialPtr() const { return m_Mat_Ptr; }
 
   private:
     point3 m_Center;
@@ -20,12 +26,15 @@ class Sphere : public Hittable
     std::shared_ptr<Material> m_Mat_Ptr;
 };
 
-bool Sphere::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+// Closest intersection of r with a sphere in [tMin, tMax]. Fills everything but the material.
+inline bool HitSphere(const point3& center, float radius, const ray& r, float tMin, float tMax,
+                      HitRecord& rec)
 {
-    vec3 oc = r.Origin() - m_Center;
+    RTIW_STAT_ADD(PrimitiveTests, 1);
+    vec3 oc = r.Origin() - center;
     float a = r.Direction().LengthSquared();
     float half_b = Dot(oc, r.Direction());
-    float c = oc.LengthSquared() - (m_Radius * m_Radius);
+    float c = oc.LengthSquared() - (radius * radius);
     // Quadratic formula discriminant
     float discriminant = (half_b * half_b) - (a * c);
     if (discriminant < 0)
@@ -44,10 +53,25 @@ bool Sphere::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
 
     rec.t = root;
     rec.HitPoint = r.At(rec.t);
-    vec3 outwardNormal = (rec.HitPoint - m_Center) / m_Radius;
+    vec3 outwardNormal = (rec.HitPoint - center) / radius;
     rec.SetFaceNormal(r, outwardNormal);
-    rec.Mat_Ptr = m_Mat_Ptr;
 
     return true;
 }
+
+bool Sphere::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    if (!HitSphere(m_Center, m_Radius, r, tMin, tMax, rec))
+        return false;
+
+    rec.Mat_Ptr = m_Mat_Ptr.get();
+    return true;
+}
+
+bool Sphere::BoundingBox(AABB& outputBox) const
+{
+    vec3 r(fabsf(m_Radius));
+    outputBox = AABB(m_Center - r, m_Center + r);
+    return true;
+}
 } // namespace rtiw
@@ -0,0 +1,460 @@
+#pragma once
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace rtiw
+{
+// Sphere data of a SphereGroup in structure-of-arrays form. Count is padded to a multiple of
+// SPHERE_GROUP_PADDING with spheres that can never be hit.
+struct SphereGroupSoA
+{
+    const float* CenterX;
+    const float* CenterY;
+    const float* CenterZ;
+    const float* Radius;
+    int Count;
+};
+
+struct SphereGroupRay
+{
+    float Origin[3];
+    float Dir[3];
+    // Squared length of the direction
+    float A;
+    float TMin, TMax;
+};
+
+const int SPHERE_GROUP_PADDING = 16;
+
+// The kernels below return the index of the closest sphere whose root lies in [TMin, TMax] (or -1)
+// and store that root in tHit. Each one performs exactly the operations of Sphere::Hit, in the same
+// order, so all of them agree with the scalar path bit for bit. Ties go to the later sphere, like
+// in HittableList::Hit.
+namespace detail
+{
+inline int SphereGroupHitScalar(const SphereGroupSoA& g, const SphereGroupRay& q, float& tHit)
+{
+    float bestT = INF;
+    int bestIndex = -1;
+    for (int i = 0; i < g.Count; i++) {
+        float ocx = q.Origin[0] - g.CenterX[i];
+        float ocy = q.Origin[1] - g.CenterY[i];
+        float ocz = q.Origin[2] - g.CenterZ[i];
+        float halfB = ocx * q.Dir[0] + ocy * q.Dir[1] + ocz * q.Dir[2];
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - (g.Radius[i] * g.Radius[i]);
+        float discriminant = (halfB * halfB) - (q.A * c);
+        if (!(discriminant >= 0))
+            continue;
+
+        float sqrtDiscriminant = sqrtf(discriminant);
+        float root = (-halfB - sqrtDiscriminant) / q.A;
+        if (!(root >= q.TMin && root <= q.TMax)) {
+            root = (-halfB + sqrtDiscriminant) / q.A;
+            if (!(root >= q.TMin && root <= q.TMax))
+                continue;
+        }
+        if (root <= bestT) {
+            bestT = root;
+            bestIndex = i;
+        }
+    }
+    tHit = bestT;
+    return bestIndex;
+}
+
+// Picks the closest of the per-lane winners, preferring the later sphere on ties
+inline int ReduceLanes(const float* t, const int* index, int lanes, float& tHit)
+{
+    float bestT = INF;
+    int bestIndex = -1;
+    for (int l = 0; l < lanes; l++) {
+        if (index[l] < 0)
+            continue;
+        if (t[l] < bestT || (t[l] == bestT && index[l] > bestIndex)) {
+            bestT = t[l];
+            bestIndex = index[l];
+        }
+    }
+    tHit = bestT;
+    return bestIndex;
+}
+
+#ifdef RTIW_X86
+inline int SphereGroupHitSSE(const SphereGroupSoA& g, const SphereGroupRay& q, float& tHit)
+{
+    const __m128 ox = _mm_set1_ps(q.Origin[0]), oy = _mm_set1_ps(q.Origin[1]),
+                 oz = _mm_set1_ps(q.Origin[2]);
+    const __m128 dx = _mm_set1_ps(q.Dir[0]), dy = _mm_set1_ps(q.Dir[1]), dz = _mm_set1_ps(q.Dir[2]);
+    const __m128 a = _mm_set1_ps(q.A);
+    const __m128 tMin = _mm_set1_ps(q.TMin), tMax = _mm_set1_ps(q.TMax);
+    const __m128 signBit = _mm_set1_ps(-0.f);
+
+    __m128 bestT = _mm_set1_ps(INF);
+    __m128i bestIndex = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+
+    for (int i = 0; i < g.Count; i += 4) {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(g.CenterX + i));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(g.CenterY + i));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(g.CenterZ + i));
+        __m128 r = _mm_loadu_ps(g.Radius + i);
+
+        __m128 halfB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)),
+                                  _mm_mul_ps(ocz, dz));
+        __m128 ocLen2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                                   _mm_mul_ps(ocz, ocz));
+        __m128 c = _mm_sub_ps(ocLen2, _mm_mul_ps(r, r));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(a, c));
+        __m128 hit = _mm_cmpge_ps(disc, _mm_setzero_ps());
+
+        __m128 sq = _mm_sqrt_ps(disc);
+        __m128 negB = _mm_xor_ps(halfB, signBit);
+        __m128 root1 = _mm_div_ps(_mm_sub_ps(negB, sq), a);
+        __m128 root2 = _mm_div_ps(_mm_add_ps(negB, sq), a);
+        __m128 in1 = _mm_and_ps(_mm_cmpge_ps(root1, tMin), _mm_cmple_ps(root1, tMax));
+        __m128 in2 = _mm_and_ps(_mm_cmpge_ps(root2, tMin), _mm_cmple_ps(root2, tMax));
+        __m128 root = _mm_or_ps(_mm_and_ps(in1, root1), _mm_andnot_ps(in1, root2));
+
+        __m128 closer = _mm_and_ps(_mm_and_ps(hit, _mm_or_ps(in1, in2)),
+                                   _mm_cmple_ps(root, bestT));
+        bestT = _mm_or_ps(_mm_and_ps(closer, root), _mm_andnot_ps(closer, bestT));
+        __m128i closerI = _mm_castps_si128(closer);
+        bestIndex = _mm_or_si128(_mm_and_si128(closerI, index),
+                                 _mm_andnot_si128(closerI, bestIndex));
+        index = _mm_add_epi32(index, step);
+    }
+
+    alignas(16) float t[4];
+    alignas(16) int idx[4];
+    _mm_store_ps(t, bestT);
+    _mm_store_si128((__m128i*)idx, bestIndex);
+    return ReduceLanes(t, idx, 4, tHit);
+}
+
+RTIW_TARGET("avx2")
+inline int SphereGroupHitAVX2(const SphereGroupSoA& g, const SphereGroupRay& q, float& tHit)
+{
+    const __m256 ox = _mm256_set1_ps(q.Origin[0]), oy = _mm256_set1_ps(q.Origin[1]),
+                 oz = _mm256_set1_ps(q.Origin[2]);
+    const __m256 dx = _mm256_set1_ps(q.Dir[0]), dy = _mm256_set1_ps(q.Dir[1]),
+                 dz = _mm256_set1_ps(q.Dir[2]);
+    const __m256 a = _mm256_set1_ps(q.A);
+    const __m256 tMin = _mm256_set1_ps(q.TMin), tMax = _mm256_set1_ps(q.TMax);
+    const __m256 signBit = _mm256_set1_ps(-0.f);
+
+    __m256 bestT = _mm256_set1_ps(INF);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+
+    for (int i = 0; i < g.Count; i += 8) {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(g.CenterX + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(g.CenterY + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(g.CenterZ + i));
+        __m256 r = _mm256_loadu_ps(g.Radius + i);
+
+        __m256 halfB = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 ocLen2 = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+            _mm256_mul_ps(ocz, ocz));
+        __m256 c = _mm256_sub_ps(ocLen2, _mm256_mul_ps(r, r));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(halfB, halfB), _mm256_mul_ps(a, c));
+        __m256 hit = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+
+        __m256 sq = _mm256_sqrt_ps(disc);
+        __m256 negB = _mm256_xor_ps(halfB, signBit);
+        __m256 root1 = _mm256_div_ps(_mm256_sub_ps(negB, sq), a);
+        __m256 root2 = _mm256_div_ps(_mm256_add_ps(negB, sq), a);
+        __m256 in1 = _mm256_and_ps(_mm256_cmp_ps(root1, tMin, _CMP_GE_OQ),
+                                   _mm256_cmp_ps(root1, tMax, _CMP_LE_OQ));
+        __m256 in2 = _mm256_and_ps(_mm256_cmp_ps(root2, tMin, _CMP_GE_OQ),
+                                   _mm256_cmp_ps(root2, tMax, _CMP_LE_OQ));
+        __m256 root = _mm256_blendv_ps(root2, root1, in1);
+
+        __m256 closer = _mm256_and_ps(_mm256_and_ps(hit, _mm256_or_ps(in1, in2)),
+                                      _mm256_cmp_ps(root, bestT, _CMP_LE_OQ));
+        bestT = _mm256_blendv_ps(bestT, root, closer);
+        bestIndex = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), closer));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    alignas(32) float t[8];
+    alignas(32) int idx[8];
+    _mm256_store_ps(t, bestT);
+    _mm256_store_si256((__m256i*)idx, bestIndex);
+    return ReduceLanes(t, idx, 8, tHit);
+}
+
+// GCC 12's _mm512_sqrt_ps trips -Wmaybe-uninitialized inside its own header
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+RTIW_TARGET("avx512f")
+inline int SphereGroupHitAVX512(const SphereGroupSoA& g, const SphereGroupRay& q, float& tHit)
+{
+    const __m512 ox = _mm512_set1_ps(q.Origin[0]), oy = _mm512_set1_ps(q.Origin[1]),
+                 oz = _mm512_set1_ps(q.Origin[2]);
+    const __m512 dx = _mm512_set1_ps(q.Dir[0]), dy = _mm512_set1_ps(q.Dir[1]),
+                 dz = _mm512_set1_ps(q.Dir[2]);
+    const __m512 a = _mm512_set1_ps(q.A);
+    const __m512 tMin = _mm512_set1_ps(q.TMin), tMax = _mm512_set1_ps(q.TMax);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i signBit = _mm512_set1_epi32((int)0x80000000u);
+
+    __m512 bestT = _mm512_set1_ps(INF);
+    __m512i bestIndex = _mm512_set1_epi32(-1);
+    __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i step = _mm512_set1_epi32(16);
+
+    for (int i = 0; i < g.Count; i += 16) {
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(g.CenterX + i));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(g.CenterY + i));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(g.CenterZ + i));
+        __m512 r = _mm512_loadu_ps(g.Radius + i);
+
+        __m512 halfB = _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz));
+        __m512 ocLen2 = _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)),
+            _mm512_mul_ps(ocz, ocz));
+        __m512 c = _mm512_sub_ps(ocLen2, _mm512_mul_ps(r, r));
+        __m512 disc = _mm512_sub_ps(_mm512_mul_ps(halfB, halfB), _mm512_mul_ps(a, c));
+        __mmask16 hit = _mm512_cmp_ps_mask(disc, zero, _CMP_GE_OQ);
+
+        __m512 sq = _mm512_sqrt_ps(disc);
+        __m512 negB = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(halfB), signBit));
+        __m512 root1 = _mm512_div_ps(_mm512_sub_ps(negB, sq), a);
+        __m512 root2 = _mm512_div_ps(_mm512_add_ps(negB, sq), a);
+        __mmask16 in1 = _mm512_cmp_ps_mask(root1, tMin, _CMP_GE_OQ) &
+                        _mm512_cmp_ps_mask(root1, tMax, _CMP_LE_OQ);
+        __mmask16 in2 = _mm512_cmp_ps_mask(root2, tMin, _CMP_GE_OQ) &
+                        _mm512_cmp_ps_mask(root2, tMax, _CMP_LE_OQ);
+        __m512 root = _mm512_mask_blend_ps(in1, root2, root1);
+
+        __mmask16 closer = hit & (in1 | in2) & _mm512_cmp_ps_mask(root, bestT, _CMP_LE_OQ);
+        bestT = _mm512_mask_blend_ps(closer, bestT, root);
+        bestIndex = _mm512_mask_blend_epi32(closer, bestIndex, index);
+        index = _mm512_add_epi32(index, step);
+    }
+
+    alignas(64) float t[16];
+    alignas(64) int idx[16];
+    _mm512_store_ps(t, bestT);
+    _mm512_store_si512(idx, bestIndex);
+    return ReduceLanes(t, idx, 16, tHit);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+} // namespace detail
+
+// Flat group of spheres intersected several at a time with the widest SIMD kernel the CPU
+// supports. Use it directly instead of a HittableList of spheres, or as the primitives of a BVH
+// (see MakeSphereGroups()).
+class SphereGroup : public Hittable
+{
+  public:
+    using Kernel = int (*)(const SphereGroupSoA&, const SphereGroupRay&, float&);
+
+    SphereGroup() { SetSimdLevel(DefaultSimdLevel()); }
+
+    void Add(const point3& center, float radius, std::shared_ptr<Material> mat);
+    // Adds every Sphere of the list, returns false if it holds anything else
+    bool AddSpheres(const HittableList& list);
+
+    size_t Size() const { return m_Count; }
+
+    void SetSimdLevel(SimdLevel level);
+    SimdLevel GetSimdLevel() const { return m_SimdLevel; }
+
+    // Level used by new groups: what the CPU supports unless lowered with SetDefaultSimdLevel()
+    static SimdLevel DefaultSimdLevel() { return MaxSimdLevel(); }
+    static void SetDefaultSimdLevel(SimdLevel level) { MaxSimdLevel() = level; }
+
+    virtual bool Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const override;
+    virtual bool BoundingBox(AABB& outputBox) const override;
+
+  private:
+    static SimdLevel& MaxSimdLevel()
+    {
+        static SimdLevel level = DetectSimdLevel();
+        return level;
+    }
+
+    SphereGroupSoA Data() const
+    {
+        return {m_CenterX.data(), m_CenterY.data(), m_CenterZ.data(), m_Radius.data(),
+                (int)m_CenterX.size()};
+    }
+
+    std::vector<float> m_CenterX;
+    std::vector<float> m_CenterY;
+    std::vector<float> m_CenterZ;
+    std::vector<float> m_Radius;
+    std::vector<uint32_t> m_MaterialIds;
+    std::vector<std::shared_ptr<Material>> m_Materials;
+    std::unordered_map<const Material*, uint32_t> m_MaterialLookup;
+    size_t m_Count = 0;
+    AABB m_Bounds;
+
+    SimdLevel m_SimdLevel = SimdLevel::Scalar;
+    Kernel m_Kernel = detail::SphereGroupHitScalar;
+};
+
+void SphereGroup::Add(const point3& center, float radius, std::shared_ptr<Material> mat)
+{
+    auto found = m_MaterialLookup.find(mat.get());
+    uint32_t materialId;
+    if (found != m_MaterialLookup.end()) {
+        materialId = found->second;
+    } else {
+        materialId = (uint32_t)m_Materials.size();
+        m_Materials.push_back(mat);
+        m_MaterialLookup[mat.get()] = materialId;
+    }
+
+    // Drop the padding, append, then pad again with spheres that no ray can hit (NaN centers)
+    m_CenterX.resize(m_Count);
+    m_CenterY.resize(m_Count);
+    m_CenterZ.resize(m_Count);
+    m_Radius.resize(m_Count);
+
+    m_CenterX.push_back(center.x());
+    m_CenterY.push_back(center.y());
+    m_CenterZ.push_back(center.z());
+    m_Radius.push_back(radius);
+    m_MaterialIds.push_back(materialId);
+    m_Count++;
+
+    size_t padded = (m_Count + SPHERE_GROUP_PADDING - 1) / SPHERE_GROUP_PADDING *
+                    SPHERE_GROUP_PADDING;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    m_CenterX.resize(padded, nan);
+    m_CenterY.resize(padded, nan);
+    m_CenterZ.resize(padded, nan);
+    m_Radius.resize(padded, 0.f);
+
+    vec3 r(fabsf(radius));
+    m_Bounds.Expand(AABB(center - r, center + r));
+}
+
+bool SphereGroup::AddSpheres(const HittableList& list)
+{
+    for (const auto& object : list.Objects()) {
+        const Sphere* sphere = dynamic_cast<const Sphere*>(object.get());
+        if (!sphere)
+            return false;
+        Add(sphere->Center(), sphere->Radius(), sphere->MaterialPtr());
+    }
+    return true;
+}
+
+void SphereGroup::SetSimdLevel(SimdLevel level)
+{
+    if (level > DetectSimdLevel())
+        level = DetectSimdLevel();
+
+    m_SimdLevel = level;
+    switch (level) {
+#ifdef RTIW_X86
+    case SimdLevel::AVX512:
+        m_Kernel = detail::SphereGroupHitAVX512;
+        break;
+    case SimdLevel::AVX2:
+        m_Kernel = detail::SphereGroupHitAVX2;
+        break;
+    case SimdLevel::SSE:
+        m_Kernel = detail::SphereGroupHitSSE;
+        break;
+#endif
+    default:
+        m_SimdLevel = SimdLevel::Scalar;
+        m_Kernel = detail::SphereGroupHitScalar;
+        break;
+    }
+}
+
+bool SphereGroup::Hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    if (m_Count == 0)
+        return false;
+    RTIW_STAT_ADD(PrimitiveTests, m_Count);
+
+    point3 origin = r.Origin();
+    vec3 dir = r.Direction();
+    SphereGroupRay q{{origin.x(), origin.y(), origin.z()},
+                     {dir.x(), dir.y(), dir.z()},
+                     dir.LengthSquared(),
+                     tMin,
+                     tMax};
+
+    float root;
+    int index = m_Kernel(Data(), q, root);
+    if (index < 0)
+        return false;
+
+    point3 center(m_CenterX[index], m_CenterY[index], m_CenterZ[index]);
+    rec.t = root;
+    rec.HitPoint = r.At(rec.t);
+    vec3 outwardNormal = (rec.HitPoint - center) / m_Radius[index];
+    rec.SetFaceNormal(r, outwardNormal);
+    rec.Mat_Ptr = m_Materials[m_MaterialIds[index]].get();
+    rec.MaterialId = m_MaterialIds[index];
+
+    return true;
+}
+
+bool SphereGroup::BoundingBox(AABB& outputBox) const
+{
+    if (m_Count == 0)
+        return false;
+    outputBox = m_Bounds;
+    return true;
+}
+
+// Regroups the spheres of a list into spatially compact SphereGroups of up to groupSize spheres,
+// ready to be put in a BVH. Objects that are not spheres are passed through unchanged.
+HittableList MakeSphereGroups(const HittableList& list, int groupSize = 16)
+{
+    HittableList result;
+    std::vector<const Sphere*> spheres;
+    std::vector<AABB> bounds;
+    AABB box;
+    for (const auto& object : list.Objects()) {
+        const Sphere* sphere = dynamic_cast<const Sphere*>(object.get());
+        if (sphere && sphere->BoundingBox(box)) {
+            spheres.push_back(sphere);
+            bounds.push_back(box);
+        } else {
+            result.Add(object);
+        }
+    }
+
+    // The leaf order of a BVH with one sphere per leaf keeps neighbours next to each other
+    BVHBuildResult order = BuildBVH(bounds, 1);
+    std::shared_ptr<SphereGroup> group;
+    for (uint32_t index : order.PrimIndices) {
+        if (!group || group->Size() == (size_t)groupSize) {
+            group = std::make_shared<SphereGroup>();
+            result.Add(group);
+        }
+        const Sphere* sphere = spheres[index];
+        group->Add(sphere->Center(), sphere->Radius(), sphere->MaterialPtr());
+    }
+    return result;
+}
+} // namespace rtiw
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hot-path counters. Building with RTIW_STATS=1 makes RayColor(), the intersection routines and
+// the integrators count into thread-local RenderCounters; otherwise every RTIW_STAT_* macro
+// expands to nothing and the counters cost nothing at all.
+#ifndef RTIW_STATS
+#define RTIW_STATS 0
+#endif
+
+namespace rtiw
+{
+struct RenderCounters
+{
+    // Camera rays
+    uint64_t PrimaryRays = 0;
+    // Closest-hit queries against the whole scene, primary and secondary
+    uint64_t SceneQueries = 0;
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+    // Ray-primitive tests (SIMD groups count every lane) and BVH node visits
+    uint64_t PrimitiveTests = 0;
+    uint64_t NodeVisits = 0;
+    uint64_t Scatters = 0;
+    uint64_t Absorbed = 0;
+    // Paths cut off by the bounce limit
+    uint64_t DepthLimitReached = 0;
+    // Paths that ended on a miss or an absorption, by the remaining depth of their last ray
+    std::vector<uint64_t> EndsAtDepth;
+
+    void EndPath(int remainingDepth)
+    {
+        if ((size_t)remainingDepth >= EndsAtDepth.size())
+            EndsAtDepth.resize(remainingDepth + 1);
+        EndsAtDepth[remainingDepth]++;
+    }
+
+    void Add(const RenderCounters& other)
+    {
+        PrimaryRays += other.PrimaryRays;
+        SceneQueries += other.SceneQueries;
+        Hits += other.Hits;
+        Misses += other.Misses;
+        PrimitiveTests += other.PrimitiveTests;
+        NodeVisits += other.NodeVisits;
+        Scatters += other.Scatters;
+        Absorbed += other.Absorbed;
+        DepthLimitReached += other.DepthLimitReached;
+        if (other.EndsAtDepth.size() > EndsAtDepth.size())
+            EndsAtDepth.resize(other.EndsAtDepth.size());
+        for (size_t d = 0; d < other.EndsAtDepth.size(); d++)
+            EndsAtDepth[d] += other.EndsAtDepth[d];
+    }
+};
+
+// Owns the counters of every thread that ever counted, so they can be reset and summed between
+// renders and outlive their threads
+class CounterRegistry
+{
+  public:
+    static CounterRegistry& Get()
+    {
+        static CounterRegistry registry;
+        return registry;
+    }
+
+    RenderCounters* Register()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Counters.push_back(std::make_unique<RenderCounters>());
+        return m_Counters.back().get();
+    }
+
+    // Only call while no render is running
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (auto& counters : m_Counters)
+            *counters = RenderCounters();
+    }
+
+    RenderCounters Sum()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        RenderCounters total;
+        for (const auto& counters : m_Counters)
+            total.Add(*counters);
+        return total;
+    }
+
+  private:
+    std::mutex m_Mutex;
+    std::vector<std::unique_ptr<RenderCounters>> m_Counters;
+};
+
+inline RenderCounters& ThreadCounters()
+{
+    thread_local RenderCounters* counters = CounterRegistry::Get().Register();
+    return *counters;
+}
+} // namespace rtiw
+
+#if RTIW_STATS
+#define RTIW_STAT_ADD(counter, n) (::rtiw::ThreadCounters().counter += (n))
+#define RTIW_STAT_END_PATH(remainingDepth) (::rtiw::ThreadCounters().EndPath(remainingDepth))
+#else
+#define RTIW_STAT_ADD(counter, n) ((void)0)
+#define RTIW_STAT_END_PATH(remainingDepth) ((void)0)
+#endif
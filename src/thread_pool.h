@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rtiw
+{
+// Fixed set of worker threads, each owning a deque of task indices. A worker pops from the front
+// of its own deque and, once that runs dry, steals from the back of the other workers' deques so
+// cheap tiles (sky) and expensive tiles (reflections) still keep every core busy.
+class ThreadPool
+{
+  public:
+    // (taskIndex, workerIndex)
+    using Job = std::function<void(int, int)>;
+
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int NumThreads() const { return (int)m_Workers.size(); }
+
+    // Runs job(i, worker) for every i in [0, taskCount) and blocks until all of them finished.
+    // Must not be called from inside a job.
+    void ParallelFor(int taskCount, const Job& job);
+
+    static int DefaultThreadCount();
+
+  private:
+    struct WorkQueue
+    {
+        std::mutex Mutex;
+        std::deque<int> Tasks;
+    };
+
+    void WorkerLoop(int workerIndex);
+    bool PopOrSteal(int workerIndex, int& task);
+
+    std::vector<std::thread> m_Workers;
+    std::vector<std::unique_ptr<WorkQueue>> m_Queues;
+
+    std::mutex m_SubmitMutex;
+    std::mutex m_Mutex;
+    std::condition_variable m_WakeCV;
+    std::condition_variable m_DoneCV;
+    const Job* m_Job = nullptr;
+    std::atomic<int> m_Remaining{0};
+    uint64_t m_Generation = 0;
+    bool m_Stop = false;
+};
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = DefaultThreadCount();
+
+    for (int i = 0; i < numThreads; i++)
+        m_Queues.push_back(std::make_unique<WorkQueue>());
+    for (int i = 0; i < numThreads; i++)
+        m_Workers.emplace_back([this, i] { WorkerLoop(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_WakeCV.notify_all();
+    for (auto& worker : m_Workers)
+        worker.join();
+}
+
+int ThreadPool::DefaultThreadCount()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : (int)n;
+}
+
+void ThreadPool::ParallelFor(int taskCount, const Job& job)
+{
+    if (taskCount <= 0)
+        return;
+
+    std::lock_guard<std::mutex> submitLock(m_SubmitMutex);
+    m_Job = &job;
+    m_Remaining = taskCount;
+
+    // Hand out contiguous runs so neighbouring tasks (neighbouring tiles) stay on one worker until
+    // somebody has to steal them
+    int numQueues = (int)m_Queues.size();
+    for (int q = 0; q < numQueues; q++) {
+        int begin = (int)((long long)taskCount * q / numQueues);
+        int end = (int)((long long)taskCount * (q + 1) / numQueues);
+        std::lock_guard<std::mutex> lock(m_Queues[q]->Mutex);
+        for (int t = begin; t < end; t++)
+            m_Queues[q]->Tasks.push_back(t);
+    }
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Generation++;
+    m_WakeCV.notify_all();
+    m_DoneCV.wait(lock, [this] { return m_Remaining.load() == 0; });
+    m_Job = nullptr;
+}
+
+bool ThreadPool::PopOrSteal(int workerIndex, int& task)
+{
+    WorkQueue& own = *m_Queues[workerIndex];
+    {
+        std::lock_guard<std::mutex> lock(own.Mutex);
+        if (!own.Tasks.empty()) {
+            task = own.Tasks.front();
+            own.Tasks.pop_front();
+            return true;
+        }
+    }
+
+    int numQueues = (int)m_Queues.size();
+    for (int offset = 1; offset < numQueues; offset++) {
+        WorkQueue& victim = *m_Queues[(workerIndex + offset) % numQueues];
+        std::lock_guard<std::mutex> lock(victim.Mutex);
+        if (!victim.Tasks.empty()) {
+            task = victim.Tasks.back();
+            victim.Tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(int workerIndex)
+{
+    uint64_t seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_WakeCV.wait(lock, [&] { return m_Stop || m_Generation != seenGeneration; });
+            if (m_Stop)
+                return;
+            seenGeneration = m_Generation;
+        }
+
+        int task;
+        while (PopOrSteal(workerIndex, task)) {
+            (*m_Job)(task, workerIndex);
+            if (--m_Remaining == 0) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_DoneCV.notify_all();
+            }
+        }
+    }
+}
+} // namespace rtiw
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+namespace rtiw
+{
+// Affine transform: a 3x3 linear part and a translation, stored as the top three rows of a 4x4
+// matrix. Plain data, so compiled scenes and their caches can hold it as it is.
+class Transform
+{
+  public:
+    // Identity
+    Transform() : m_M{{1.f, 0.f, 0.f, 0.f}, {0.f, 1.f, 0.f, 0.f}, {0.f, 0.f, 1.f, 0.f}} {}
+
+    static Transform Translate(const vec3& offset);
+    static Transform Scale(const vec3& factors);
+    static Transform Scale(float factor) { return Scale(vec3(factor)); }
+    // Counterclockwise rotation by degrees when looking down axis, which need not be normalized
+    static Transform Rotate(const vec3& axis, float degrees);
+
+    // Applies other first, then this
+    Transform operator*(const Transform& other) const;
+
+    // The transform must not be singular
+    Transform Inverse() const;
+
+    point3 ApplyPoint(const point3& p) const
+    {
+        return point3(Row(0, p) + m_M[0][3], Row(1, p) + m_M[1][3], Row(2, p) + m_M[2][3]);
+    }
+
+    vec3 ApplyVector(const vec3& v) const { return vec3(Row(0, v), Row(1, v), Row(2, v)); }
+
+    // Applies the transpose of the linear part. For a world-to-object transform this takes object
+    // space normals to world space, up to their length.
+    vec3 ApplyTransposed(const vec3& n) const
+    {
+        return vec3(m_M[0][0] * n[0] + m_M[1][0] * n[1] + m_M[2][0] * n[2],
+                    m_M[0][1] * n[0] + m_M[1][1] * n[1] + m_M[2][1] * n[2],
+                    m_M[0][2] * n[0] + m_M[1][2] * n[1] + m_M[2][2] * n[2]);
+    }
+
+    // Bounds of the transformed corners of box
+    AABB ApplyBox(const AABB& box) const;
+
+  private:
+    float Row(int row, const vec3& v) const
+    {
+        return m_M[row][0] * v[0] + m_M[row][1] * v[1] + m_M[row][2] * v[2];
+    }
+
+    float m_M[3][4];
+};
+
+inline Transform Transform::Translate(const vec3& offset)
+{
+    Transform t;
+    for (int row = 0; row < 3; row++)
+        t.m_M[row][3] = offset[row];
+    return t;
+}
+
+inline Transform Transform::Scale(const vec3& factors)
+{
+    Transform t;
+    for (int row = 0; row < 3; row++)
+        t.m_M[row][row] = factors[row];
+    return t;
+}
+
+inline Transform Transform::Rotate(const vec3& axis, float degrees)
+{
+    // Rodrigues' rotation formula
+    vec3 a = Normalize(axis);
+    float sinTheta = sinf(DegreesToRadians(degrees));
+    float cosTheta = cosf(DegreesToRadians(degrees));
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++)
+            t.m_M[row][col] = a[row] * a[col] * (1.f - cosTheta) + (row == col ? cosTheta : 0.f);
+    }
+    t.m_M[0][1] -= a[2] * sinTheta;
+    t.m_M[0][2] += a[1] * sinTheta;
+    t.m_M[1][0] += a[2] * sinTheta;
+    t.m_M[1][2] -= a[0] * sinTheta;
+    t.m_M[2][0] -= a[1] * sinTheta;
+    t.m_M[2][1] += a[0] * sinTheta;
+    return t;
+}
+
+inline Transform Transform::operator*(const Transform& other) const
+{
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) {
+            float sum = col == 3 ? m_M[row][3] : 0.f;
+            for (int k = 0; k < 3; k++)
+                sum += m_M[row][k] * other.m_M[k][col];
+            t.m_M[row][col] = sum;
+        }
+    }
+    return t;
+}
+
+inline Transform Transform::Inverse() const
+{
+    // Inverse of the linear part from its cofactors, then the translation moved to the other side
+    const float(&m)[3][4] = m_M;
+    float cofactors[3][3];
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            int r0 = (row + 1) % 3, r1 = (row + 2) % 3;
+            int c0 = (col + 1) % 3, c1 = (col + 2) % 3;
+            cofactors[row][col] = m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0];
+        }
+    }
+    float det = m[0][0] * cofactors[0][0] + m[0][1] * cofactors[0][1] + m[0][2] * cofactors[0][2];
+    float invDet = 1.f / det;
+
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++)
+            t.m_M[row][col] = cofactors[col][row] * invDet;
+    }
+    vec3 translation = t.ApplyVector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int row = 0; row < 3; row++)
+        t.m_M[row][3] = -translation[row];
+    return t;
+}
+
+inline AABB Transform::ApplyBox(const AABB& box) const
+{
+    if (box.IsEmpty())
+        return AABB();
+
+    AABB result;
+    for (int corner = 0; corner < 8; corner++) {
+        point3 p((corner & 1) ? box.Max().x() : box.Min().x(),
+                 (corner & 2) ? box.Max().y() : box.Min().y(),
+                 (corner & 4) ? box.Max().z() : box.Min().z());
+        result.Expand(ApplyPoint(p));
+    }
+    return result;
+}
+} // namespace rtiw
@@ -5,20 +5,46 @@
 
 #include "rtweekend.h"
 
+// Building with RTIW_SIMD_VEC3=1 stores every vec3 in a 16-byte aligned SSE register and computes
+// the operators with SSE intrinsics; other targets keep the scalar backend. The SSE backend does
+// the same IEEE operations in the same order as the scalar one (no reciprocal estimates, dot
+// products summed x, y, then z), so both render bit-identical images; --check-vec3 verifies it.
+#ifndef RTIW_SIMD_VEC3
+#define RTIW_SIMD_VEC3 0
+#endif
+
+#if RTIW_SIMD_VEC3 && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) ||            \
+                       (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RTIW_VEC3_SSE 1
+#include <xmmintrin.h>
+#else
+#define RTIW_VEC3_SSE 0
+#endif
+
 namespace rtiw
 {
+inline const char* Vec3BackendName() { return RTIW_VEC3_SSE ? "sse" : "scalar"; }
+
 class vec3
 {
   public:
     vec3() : m_El{0, 0, 0} {}
     vec3(float val) : m_El{val, val, val} {}
     vec3(float e0, float e1, float e2) : m_El{e0, e1, e2} {}
+#if RTIW_VEC3_SSE
+    explicit vec3(__m128 v) { _mm_store_ps(m_El, v); }
+    __m128 Simd() const { return _mm_load_ps(m_El); }
+#endif
 
     float x() const { return m_El[0]; }
     float y() const { return m_El[1]; }
     float z() const { return m_El[2]; }
 
+#if RTIW_VEC3_SSE
+    vec3 operator-() const { return vec3(_mm_xor_ps(Simd(), _mm_set1_ps(-0.f))); }
+#else
     vec3 operator-() const { return vec3(-m_El[0], -m_El[1], -m_El[2]); }
+#endif
     float operator[](int i) const { return m_El[i]; }
     float& operator[](int i) { return m_El[i]; }
 
@@ -34,23 +60,36 @@ class vec3
     inline bool NearZero() const {
         // Return true if the vector is close to zero in all dimensions
         const float eps = (float)0.000001;
+#if RTIW_VEC3_SSE
+        __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.f), Simd());
+        return (_mm_movemask_ps(_mm_cmplt_ps(magnitude, _mm_set1_ps(eps))) & 7) == 7;
+#else
         return (fabs(m_El[0]) < eps) && (fabs(m_El[1]) < eps) && (fabs(m_El[2]) < eps);
+#endif
     }
 
     vec3& operator+=(const vec3& v)
     {
+#if RTIW_VEC3_SSE
+        _mm_store_ps(m_El, _mm_add_ps(Simd(), v.Simd()));
+#else
         m_El[0] += v.m_El[0];
         m_El[1] += v.m_El[1];
         m_El[2] += v.m_El[2];
+#endif
 
         return *this;
     }
 
     vec3& operator*=(const float t)
     {
+#if RTIW_VEC3_SSE
+        _mm_store_ps(m_El, _mm_mul_ps(Simd(), _mm_set1_ps(t)));
+#else
         m_El[0] *= t;
         m_El[1] *= t;
         m_El[2] *= t;
+#endif
 
         return *this;
     }
@@ -59,24 +98,77 @@ class vec3
 
     float Length() const { return sqrtf(LengthSquared()); }
 
-    float LengthSquared() const
-    {
-        return (m_El[0] * m_El[0]) + (m_El[1] * m_El[1]) + (m_El[2] * m_El[2]);
-    }
+    float LengthSquared() const;
 
   private:
+#if RTIW_VEC3_SSE
+    // The fourth lane pads the vector to a full register; it starts at zero and is never read
+    alignas(16) float m_El[4];
+#else
     float m_El[3];
+#endif
 };
 
 // Type aliases
 using point3 = vec3; // 3D point
 using color = vec3;  // RGB color
 
+#if RTIW_VEC3_SSE
+namespace detail
+{
+// Lanes 0 + 1 + 2 of v in that order, like the scalar backend sums them
+inline float HorizontalSum3(__m128 v)
+{
+    __m128 sum = _mm_add_ss(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+} // namespace detail
+#endif
+
+inline float vec3::LengthSquared() const
+{
+#if RTIW_VEC3_SSE
+    return detail::HorizontalSum3(_mm_mul_ps(Simd(), Simd()));
+#else
+    return (m_El[0] * m_El[0]) + (m_El[1] * m_El[1]) + (m_El[2] * m_El[2]);
+#endif
+}
+
 inline std::ostream& operator<<(std::ostream& out, const vec3& v)
 {
     return (out << v[0] << ' ' << v[1] << ' ' << v[2]);
 }
 
+#if RTIW_VEC3_SSE
+inline vec3 operator+(const vec3& u, const vec3& v) { return vec3(_mm_add_ps(u.Simd(), v.Simd())); }
+
+inline vec3 operator+(const vec3& u, const float t)
+{
+    return vec3(_mm_add_ps(u.Simd(), _mm_set1_ps(t)));
+}
+
+inline vec3 operator-(const vec3& u, const vec3& v) { return vec3(_mm_sub_ps(u.Simd(), v.Simd())); }
+
+inline vec3 operator*(const vec3& u, const vec3& v) { return vec3(_mm_mul_ps(u.Simd(), v.Simd())); }
+
+inline vec3 operator*(float t, const vec3& v) { return vec3(_mm_mul_ps(_mm_set1_ps(t), v.Simd())); }
+
+inline float Dot(const vec3& u, const vec3& v)
+{
+    return detail::HorizontalSum3(_mm_mul_ps(u.Simd(), v.Simd()));
+}
+
+inline vec3 Cross(const vec3& u, const vec3& v)
+{
+    __m128 a = u.Simd();
+    __m128 b = v.Simd();
+    __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    return vec3(_mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX)));
+}
+#else
 inline vec3 operator+(const vec3& u, const vec3& v)
 {
     return vec3(u[0] + v[0], u[1] + v[1], u[2] + v[2]);
@@ -96,30 +188,43 @@ inline vec3 operator*(const vec3& u, const vec3& v)
 
 inline vec3 operator*(float t, const vec3& v) { return vec3(t * v[0], t * v[1], t * v[2]); }
 
-inline vec3 operator*(const vec3& v, float t) { return t * v; }
-
-inline vec3 operator/(const vec3& v, float t) { return (1 / t) * v; }
-
 inline float Dot(const vec3& u, const vec3& v) { return u[0] * v[0] + u[1] * v[1] + u[2] * v[2]; }
 
 inline vec3 Cross(const vec3& u, const vec3& v)
 {
     return vec3(u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0]);
 }
+#endif
+
+inline vec3 operator*(const vec3& v, float t) { return t * v; }
+
+inline vec3 operator/(const vec3& v, float t) { return (1 / t) * v; }
 
 inline vec3 Normalize(const vec3& v) { return v / v.Length(); }
 
-inline static vec3 RandomInUnitSphere()
+// Maps a point of the unit square to a uniformly distributed direction
+inline vec3 SquareToUnitSphere(float u, float v)
 {
-    while (true) {
-        auto p = vec3::Random(-1, 1);
-        if (p.LengthSquared() >= 1)
-            continue;
-        return p;
-    }
+    float z = 1.f - 2.f * u;
+    float r = sqrtf(fmaxf(0.f, 1.f - z * z));
+    float phi = 2.f * F_PI * v;
+    return vec3(r * cosf(phi), r * sinf(phi), z);
 }
 
-inline vec3 RandomNormalized() { return Normalize(RandomInUnitSphere()); }
+// Bounce directions draw from Random2D() so that the active sampler can stratify them
+inline vec3 RandomNormalized()
+{
+    Sample2D s = Random2D();
+    return SquareToUnitSphere(s.U, s.V);
+}
+
+// The direction is drawn before the radius. Operands of * may be evaluated in either order, so the
+// order is spelled out to keep the random stream the same on every compiler.
+inline vec3 RandomInUnitSphere()
+{
+    vec3 direction = RandomNormalized();
+    return cbrtf(RandFloat()) * direction;
+}
 
 inline vec3 RandomInHemisphere(const vec3& normal) {
     vec3 inUnitSphere = RandomInUnitSphere();
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace rtiw
+{
+namespace detail
+{
+// The scalar formulas every vec3 backend must reproduce, on plain float triples
+struct ScalarTriple
+{
+    float e[3];
+};
+
+inline bool SameBits(float a, float b)
+{
+    // NaNs only need to stay NaNs; their payload may differ between instructions
+    if (std::isnan(a) || std::isnan(b))
+        return std::isnan(a) && std::isnan(b);
+    uint32_t x, y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    return x == y;
+}
+
+inline bool SameBits(const vec3& a, const ScalarTriple& b)
+{
+    return SameBits(a.x(), b.e[0]) && SameBits(a.y(), b.e[1]) && SameBits(a.z(), b.e[2]);
+}
+
+// Mostly ordinary values, with zeros, infinities, NaNs, denormals and huge values mixed in
+inline float CheckValue()
+{
+    static const float SPECIAL[] = {0.f, -0.f,   INF,   -INF,   NAN, 1e-40f,
+                                    -1e-40f, 3e38f, -3e38f, 1e-7f, 1.f, -1.f};
+    float pick = RandFloat();
+    if (pick < 0.05f)
+        return SPECIAL[(int)(RandFloat() * (sizeof(SPECIAL) / sizeof(SPECIAL[0])))];
+    if (pick < 0.2f)
+        return RandFloat(-1e6f, 1e6f);
+    return RandFloat(-2.f, 2.f);
+}
+} // namespace detail
+
+// Runs every vec3 operation of this build's backend on count random inputs and compares the
+// results bit for bit with the scalar formulas. Prints the operations that disagree; returns
+// true if none does.
+inline bool CheckVec3Backend(int count)
+{
+    using detail::ScalarTriple;
+    struct Operation
+    {
+        const char* Name;
+        // Checks one input; a, b and t are the operands
+        std::function<bool(const ScalarTriple& a, const ScalarTriple& b, float t)> Check;
+    };
+
+    auto make = [](const ScalarTriple& s) { return vec3(s.e[0], s.e[1], s.e[2]); };
+    auto lanes = [](float x, float y, float z) { return ScalarTriple{{x, y, z}}; };
+    const std::vector<Operation> operations = {
+        {"u + v",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             return detail::SameBits(make(a) + make(b),
+                                     lanes(a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2]));
+         }},
+        {"u + t",
+         [&](const ScalarTriple& a, const ScalarTriple&, float t) {
+             return detail::SameBits(make(a) + t, lanes(a.e[0] + t, a.e[1] + t, a.e[2] + t));
+         }},
+        {"u - v",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             return detail::SameBits(make(a) - make(b),
+                                     lanes(a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2]));
+         }},
+        {"-u",
+         [&](const ScalarTriple& a, const ScalarTriple&, float) {
+             return detail::SameBits(-make(a), lanes(-a.e[0], -a.e[1], -a.e[2]));
+         }},
+        {"u * v",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             return detail::SameBits(make(a) * make(b),
+                                     lanes(a.e[0] * b.e[0], a.e[1] * b.e[1], a.e[2] * b.e[2]));
+         }},
+        {"t * u",
+         [&](const ScalarTriple& a, const ScalarTriple&, float t) {
+             return detail::SameBits(t * make(a), lanes(t * a.e[0], t * a.e[1], t * a.e[2]));
+         }},
+        {"u / t",
+         [&](const ScalarTriple& a, const ScalarTriple&, float t) {
+             float r = 1 / t;
+             return detail::SameBits(make(a) / t, lanes(r * a.e[0], r * a.e[1], r * a.e[2]));
+         }},
+        {"u += v, u *= t",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float t) {
+             vec3 u = make(a);
+             u += make(b);
+             u *= t;
+             return detail::SameBits(u, lanes((a.e[0] + b.e[0]) * t, (a.e[1] + b.e[1]) * t,
+                                              (a.e[2] + b.e[2]) * t));
+         }},
+        {"Dot",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             float expected = a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2];
+             return detail::SameBits(Dot(make(a), make(b)), expected);
+         }},
+        {"Length",
+         [&](const ScalarTriple& a, const ScalarTriple&, float) {
+             float squared = (a.e[0] * a.e[0]) + (a.e[1] * a.e[1]) + (a.e[2] * a.e[2]);
+             return detail::SameBits(make(a).Length(), sqrtf(squared));
+         }},
+        {"Cross",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             return detail::SameBits(Cross(make(a), make(b)),
+                                     lanes(a.e[1] * b.e[2] - a.e[2] * b.e[1],
+                                           a.e[2] * b.e[0] - a.e[0] * b.e[2],
+                                           a.e[0] * b.e[1] - a.e[1] * b.e[0]));
+         }},
+        {"Normalize",
+         [&](const ScalarTriple& a, const ScalarTriple&, float) {
+             float length = sqrtf((a.e[0] * a.e[0]) + (a.e[1] * a.e[1]) + (a.e[2] * a.e[2]));
+             float r = 1 / length;
+             return detail::SameBits(Normalize(make(a)),
+                                     lanes(r * a.e[0], r * a.e[1], r * a.e[2]));
+         }},
+        {"Reflect",
+         [&](const ScalarTriple& a, const ScalarTriple& b, float) {
+             float d = 2 * (a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2]);
+             return detail::SameBits(Reflect(make(a), make(b)),
+                                     lanes(a.e[0] - d * b.e[0], a.e[1] - d * b.e[1],
+                                           a.e[2] - d * b.e[2]));
+         }},
+        {"NearZero",
+         [&](const ScalarTriple& a, const ScalarTriple&, float t) {
+             // Mostly tiny inputs, so both outcomes are covered
+             ScalarTriple s = lanes(a.e[0] * 1e-6f, a.e[1] * 1e-6f, t * 1e-6f);
+             const float eps = (float)0.000001;
+             bool expected = fabs(s.e[0]) < eps && fabs(s.e[1]) < eps && fabs(s.e[2]) < eps;
+             return make(s).NearZero() == expected;
+         }},
+        {"RandomInUnitSphere",
+         [&](const ScalarTriple&, const ScalarTriple&, float) {
+             uint32_t sample = (uint32_t)(RandFloat() * 1e6f);
+             SeedRand(7, 0, sample);
+             vec3 actual = RandomInUnitSphere();
+             SeedRand(7, 0, sample);
+             vec3 direction = RandomNormalized();
+             float scale = cbrtf(RandFloat());
+             return detail::SameBits(actual, lanes(scale * direction.x(), scale * direction.y(),
+                                                   scale * direction.z()));
+         }},
+    };
+
+    std::cout << "Checking the " << Vec3BackendName() << " vec3 backend against the scalar "
+              << "formulas on " << count << " inputs per operation\n";
+    bool ok = true;
+    for (const Operation& op : operations) {
+        SeedRand(1, 0, 0);
+        int mismatches = 0;
+        for (int i = 0; i < count; i++) {
+            ScalarTriple a = {{detail::CheckValue(), detail::CheckValue(), detail::CheckValue()}};
+            ScalarTriple b = {{detail::CheckValue(), detail::CheckValue(), detail::CheckValue()}};
+            float t = detail::CheckValue();
+            // Checks reseed the generator, so the inputs come from a saved state
+            PCG32 rng = ThreadRNG();
+            if (!op.Check(a, b, t))
+                mismatches++;
+            ThreadRNG() = rng;
+        }
+        std::cout << "  " << op.Name << ": "
+                  << (mismatches ? std::to_string(mismatches) + " mismatches" : "identical")
+                  << "\n";
+        ok = ok && mismatches == 0;
+    }
+    return ok;
+}
+} // namespace rtiw
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "render_profile.h"
+#include "render_settings.h"
+#include "sampler.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace rtiw
+{
+// Upper bound on the paths in flight per thread. Tiles with more pixels * samples are rendered in
+// several waves of consecutive sample indices.
+const int WAVEFRONT_MAX_PATHS = 1 << 16;
+
+// Everything a path needs to continue after its last bounce
+struct PathState
+{
+    ray Ray;
+    color Throughput;
+    // Random state and sampler dimension, restored before the path scatters again
+    PCG32 Rng;
+    uint32_t PixelIndex;
+    uint32_t SampleIndex;
+    uint32_t Dimension;
+};
+
+// Per-thread buffers, reused across tiles so waves do not allocate
+struct WavefrontBuffers
+{
+    std::vector<PathState> Paths;
+    std::vector<color> Radiance;
+    std::vector<uint32_t> Active;
+    std::vector<uint32_t> Next;
+    std::vector<HitRecord> Hits;
+    std::vector<uint32_t> ByMaterial;
+    std::vector<color> PixelSums;
+};
+
+// Renders a tile with a wavefront (stream) integrator. Instead of following one path to the end,
+// all paths of the tile advance in lockstep:
+//   1. generate the camera rays of the whole wave,
+//   2. intersect every active ray,
+//   3. group the hits by material type,
+//   4. scatter each group in one batch,
+//   5. repeat 2-4 with the surviving rays.
+// Paths use the same random numbers as in RenderTile(), so the image matches the recursive
+// integrator up to float rounding (throughputs are multiplied front to back instead of back to
+// front).
+template <typename Scene>
+void RenderTileWavefront(const Scene& world, const Camera& cam, const RenderSettings& settings,
+                         const Tile& tile, Framebuffer& fb, RenderStats& stats)
+{
+    thread_local WavefrontBuffers buf;
+#if RTIW_STATS
+    ProfileClock::time_point start = ProfileClock::now();
+#endif
+
+    const int width = settings.ImageWidth;
+    const int height = settings.ImageHeight;
+    const int tileWidth = tile.X1 - tile.X0;
+    const int pixelCount = tileWidth * (tile.Y1 - tile.Y0);
+    const int spp = settings.SamplesPerPixel;
+    const int samplesPerWave = std::max(1, std::min(spp, WAVEFRONT_MAX_PATHS / pixelCount));
+
+    std::unique_ptr<Sampler> sampler =
+        MakeSampler(settings.Sampling, settings.SamplerBlock(), settings.Seed);
+    ActiveSampler() = sampler.get();
+    PCG32& rng = ThreadRNG();
+
+    buf.PixelSums.assign(pixelCount, color(0.f));
+
+    for (int firstSample = 0; firstSample < spp; firstSample += samplesPerWave) {
+        const int waveSamples = std::min(samplesPerWave, spp - firstSample);
+        const size_t pathCount = (size_t)pixelCount * waveSamples;
+        buf.Paths.resize(pathCount);
+        buf.Radiance.assign(pathCount, color(0.f));
+        buf.Active.clear();
+
+        // 1. Camera rays. Path p belongs to pixel p / waveSamples.
+        for (int p = 0; p < pixelCount; p++) {
+            int i = tile.X0 + p % tileWidth;
+            int y = tile.Y0 + p / tileWidth;
+            int j = height - 1 - y;
+            uint32_t pixelIndex = (uint32_t)(y * width + i);
+
+            for (int s = 0; s < waveSamples; s++) {
+                uint32_t sampleIndex = (uint32_t)(firstSample + s);
+                SeedRand(settings.Seed, pixelIndex, sampleIndex);
+                sampler->StartSample(pixelIndex, sampleIndex);
+
+                Sample2D jitter = sampler->Get2D();
+                float u = (i + jitter.U) / (width - 1);
+                float v = (j + jitter.V) / (height - 1);
+
+                uint32_t slot = (uint32_t)(p * waveSamples + s);
+                PathState& path = buf.Paths[slot];
+                path.Ray = cam.GetRay(u, v);
+                path.Throughput = color(1.f);
+                path.Rng = rng;
+                path.PixelIndex = pixelIndex;
+                path.SampleIndex = sampleIndex;
+                path.Dimension = sampler->Dimension();
+                buf.Active.push_back(slot);
+            }
+        }
+        stats.Samples += pathCount;
+        RTIW_STAT_ADD(PrimaryRays, pathCount);
+
+        for (int depth = settings.MaxDepth; depth > 0 && !buf.Active.empty(); depth--) {
+            // 2. Intersect. Misses pick up the background and leave the wave.
+            buf.Hits.resize(buf.Active.size());
+            size_t hitCount = 0;
+            size_t typeCounts[(int)MaterialType::Count] = {};
+            for (uint32_t slot : buf.Active) {
+                PathState& path = buf.Paths[slot];
+                HitRecord& rec = buf.Hits[hitCount];
+                if (world.Hit(path.Ray, 0.0001f, INF, rec)) {
+                    typeCounts[(int)HitMaterialType(world, rec)]++;
+                    buf.Active[hitCount++] = slot;
+                } else {
+                    buf.Radiance[slot] = path.Throughput * BackgroundColor(path.Ray);
+                    RTIW_STAT_END_PATH(depth);
+                }
+            }
+            stats.Rays += buf.Active.size();
+            RTIW_STAT_ADD(SceneQueries, buf.Active.size());
+            RTIW_STAT_ADD(Hits, hitCount);
+            RTIW_STAT_ADD(Misses, buf.Active.size() - hitCount);
+            buf.Active.resize(hitCount);
+
+            // 3. Counting sort of the hits by material type
+            size_t typeOffsets[(int)MaterialType::Count];
+            size_t offset = 0;
+            for (int t = 0; t < (int)MaterialType::Count; t++) {
+                typeOffsets[t] = offset;
+                offset += typeCounts[t];
+            }
+            buf.ByMaterial.resize(hitCount);
+            for (size_t k = 0; k < hitCount; k++) {
+                int type = (int)HitMaterialType(world, buf.Hits[k]);
+                buf.ByMaterial[typeOffsets[type]++] = (uint32_t)k;
+            }
+
+            // 4. Scatter, one material type after the other. Absorbed paths keep zero radiance.
+            buf.Next.clear();
+            for (uint32_t k : buf.ByMaterial) {
+                uint32_t slot = buf.Active[k];
+                PathState& path = buf.Paths[slot];
+                const HitRecord& rec = buf.Hits[k];
+
+                rng = path.Rng;
+                sampler->StartSample(path.PixelIndex, path.SampleIndex);
+                sampler->SetDimension(path.Dimension);
+
+                ray scattered;
+                color attenuation;
+                if (ScatterHit(world, path.Ray, rec, attenuation, scattered)) {
+                    path.Ray = scattered;
+                    path.Throughput = path.Throughput * attenuation;
+                    path.Rng = rng;
+                    path.Dimension = sampler->Dimension();
+                    buf.Next.push_back(slot);
+                } else {
+                    RTIW_STAT_END_PATH(depth);
+                }
+            }
+            RTIW_STAT_ADD(Scatters, buf.Next.size());
+            RTIW_STAT_ADD(Absorbed, hitCount - buf.Next.size());
+
+            // 5. Survivors form the next wave. Keeping them in slot order helps coherence.
+            std::sort(buf.Next.begin(), buf.Next.end());
+            std::swap(buf.Active, buf.Next);
+        }
+        // Paths still active ran out of bounces and, like in RayColor(), contribute nothing
+        RTIW_STAT_ADD(DepthLimitReached, buf.Active.size());
+
+        // Accumulate in sample order, the same order RenderTile() adds samples in
+        for (int p = 0; p < pixelCount; p++)
+            for (int s = 0; s < waveSamples; s++)
+                buf.PixelSums[p] += buf.Radiance[(size_t)p * waveSamples + s];
+    }
+
+    for (int p = 0; p < pixelCount; p++) {
+        int x = tile.X0 + p % tileWidth;
+        int y = tile.Y0 + p / tileWidth;
+        fb.At(x, y) = buf.PixelSums[p];
+        fb.SampleCount(x, y) = (uint32_t)spp;
+    }
+
+#if RTIW_STATS
+    // Paths of all pixels advance together, so the tile's time is spread evenly over its pixels
+    double pixelMS = ElapsedMS(start) / pixelCount;
+    RenderProfile& profile = RenderProfile::Get();
+    for (int p = 0; p < pixelCount; p++)
+        profile.AddPixelTime(tile.X0 + p % tileWidth, tile.Y0 + p / tileWidth, pixelMS);
+#endif
+
+    ActiveSampler() = nullptr;
+}
+} // namespace rtiw